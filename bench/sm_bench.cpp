@@ -0,0 +1,1097 @@
+#if defined(_WIN32)
+#error "sm_bench runs every case in a child process and needs a POSIX system"
+#endif
+#include "../sm.h"
+#include "../sm_allocator.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<math.h>
+#include<vector>
+#include<string>
+#include<random>
+#include<algorithm>
+#include<chrono>
+#include<thread>
+#include<atomic>
+#include<unistd.h>
+#include<sys/resource.h>
+#include<sys/wait.h>
+
+//----------------------------------------------------------------------------------------------
+// Allocator benchmark. Every workload is a list of operations generated up front, so the timed
+// loop does nothing but call the allocator. Each (workload, allocator) case runs in its own
+// child process: one warm-up pass, one pass timed as a whole for the throughput and one pass
+// timing every operation for the latency percentiles. Peak RSS is what the child's resident
+// set grew by while running the passes.
+//
+// With --threads the multi-threaded workloads run instead, with 1, 2, 4, ... threads up to the
+// number of cores, and the throughput of all threads together is reported for each count.
+//
+//     sm_bench [--ops N] [--filter text] [--csv] [--threads] [--max-threads N]
+//----------------------------------------------------------------------------------------------
+
+// Number of operations of a workload unless given with --ops
+const size_t DEFAULT_OPS = 1000000;
+
+// Live allocations a workload can have at once
+const size_t MAX_SLOTS = 1 << 16;
+
+// An allocation of size bytes into slot, or the free of slot if size is 0
+typedef struct
+{
+    uint32_t slot;
+    uint32_t size;
+}bench_op_t;
+
+typedef struct
+{
+    const char *name;
+    const char *description;
+    void (*generate)(size_t ops, vector<bench_op_t> & setup, vector<bench_op_t> & measured);
+    size_t heapSize;        // Initial size of a Storage Manager heap
+    bool fixedHeap;         // Do not let the heap grow beyond heapSize
+    bool resetHeap;         // Start every pass with a new heap
+    bool twoThreads;        // Producer/consumer: one thread allocates, the other frees
+}bench_workload_t;
+
+typedef struct
+{
+    double opsPerSecond;
+    double meanNs;
+    uint64_t p50Ns;
+    uint64_t p99Ns;
+    uint64_t p999Ns;
+    long peakRssKb;
+    uint64_t failedAllocs;
+}bench_result_t;
+
+static inline uint64_t NowNs()
+{
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//----------------------------------------------------------------------------------------------
+// Allocators under test. They are used as template parameters, so the timed loops call them
+// directly.
+//----------------------------------------------------------------------------------------------
+class MallocBench
+{
+public:
+    static const bool THREAD_SAFE = true;
+
+    void Reset(size_t, bool) {}
+    void* Alloc(size_t size) { return malloc(size); }
+    void Free(void *ptr) { free(ptr); }
+};
+
+template<class FitPolicy, class CoalescePolicy, class LockPolicy>
+class SMBench
+{
+private:
+    typedef BasicStorageManager<FitPolicy, CoalescePolicy, LockPolicy, SMNoStats> Heap;
+    Heap *m_heap;
+    bool m_slabs;
+    bool m_coalesceThread;
+
+public:
+    static const bool THREAD_SAFE = LockPolicy::THREAD_SAFE;
+
+    SMBench(bool slabs = true, bool coalesceThread = false) : m_heap(nullptr), m_slabs(slabs), m_coalesceThread(coalesceThread) {}
+    ~SMBench() { delete m_heap; }
+
+    void Reset(size_t heapSize, bool fixedHeap)
+    {
+        sm_config_t config = {};
+        config.initialSize = heapSize;
+        config.growSize = 64 * 1024 * 1024;
+        config.maxFootprint = fixedHeap ? heapSize : 0;
+        config.slabs = m_slabs;
+        config.coalesceThread = m_coalesceThread;
+        delete m_heap;
+        m_heap = new Heap(config);
+    }
+
+    void* Alloc(size_t size) { return m_heap->SM_alloc(size); }
+    void Free(void *ptr) { m_heap->SM_dealloc(ptr); }
+};
+
+//----------------------------------------------------------------------------------------------
+// Workload generators
+//----------------------------------------------------------------------------------------------
+static mt19937_64 g_random;
+
+static uint32_t UniformSize(uint32_t minSize, uint32_t maxSize)
+{
+    return minSize + (uint32_t)(g_random() % (maxSize - minSize + 1));
+}
+
+static uint32_t PowerLawSize()
+{
+    // Pareto distributed, most allocations are small but a few are up to 1 MB
+    double u = (double)(g_random() >> 11) / (double)(1ull << 53);
+    double size = 16.0 / pow(1.0 - u, 1.0 / 1.2);
+    return (size > 1024 * 1024) ? 1024 * 1024 : (uint32_t)size;
+}
+
+static void GenerateLifo(size_t ops, vector<bench_op_t> &, vector<bench_op_t> & measured)
+{
+    const uint32_t batch = 64;
+    while (measured.size() + 2 * batch <= ops)
+    {
+        for (uint32_t i = 0; i < batch; i++)
+            measured.push_back({ i, UniformSize(16, 512) });
+        for (uint32_t i = batch; i > 0; i--)
+            measured.push_back({ i - 1, 0 });
+    }
+}
+
+static void GenerateFifo(size_t ops, vector<bench_op_t> & setup, vector<bench_op_t> & measured)
+{
+    const uint32_t window = 1024;
+    for (uint32_t i = 0; i < window; i++)
+        setup.push_back({ i, UniformSize(16, 512) });
+
+    for (uint32_t i = 0; measured.size() + 2 <= ops; i = (i + 1) % window)
+    {
+        measured.push_back({ i, 0 });
+        measured.push_back({ i, UniformSize(16, 512) });
+    }
+}
+
+static void GenerateRandom(size_t ops, vector<bench_op_t> &, vector<bench_op_t> & measured, bool powerLaw)
+{
+    const uint32_t slots = 4096;
+    vector<bool> used(slots, false);
+    while (measured.size() < ops)
+    {
+        uint32_t slot = (uint32_t)(g_random() % slots);
+        measured.push_back({ slot, used[slot] ? 0 : (powerLaw ? PowerLawSize() : UniformSize(16, 1024)) });
+        used[slot] = !used[slot];
+    }
+}
+
+static void GenerateRandomFree(size_t ops, vector<bench_op_t> & setup, vector<bench_op_t> & measured)
+{
+    GenerateRandom(ops, setup, measured, false);
+}
+
+static void GeneratePowerLaw(size_t ops, vector<bench_op_t> & setup, vector<bench_op_t> & measured)
+{
+    GenerateRandom(ops, setup, measured, true);
+}
+
+static void GenerateProducerConsumer(size_t ops, vector<bench_op_t> &, vector<bench_op_t> & measured)
+{
+    // Only the allocations, the consumer frees whatever it receives
+    for (size_t i = 0; i < ops / 2; i++)
+        measured.push_back({ (uint32_t)(i % MAX_SLOTS), UniformSize(16, 512) });
+}
+
+static void GenerateChunkPath(size_t ops, vector<bench_op_t> &, vector<bench_op_t> & measured)
+{
+    // Above the small bin limit, so neither slabs nor thread caches take them
+    for (size_t i = 0; i < ops / 16 && i < MAX_SLOTS; i++)
+        measured.push_back({ (uint32_t)i, 1100 });
+}
+
+static void GenerateCachePath(size_t ops, vector<bench_op_t> &, vector<bench_op_t> & measured)
+{
+    while (measured.size() + 2 <= ops)
+    {
+        measured.push_back({ 0, 64 });
+        measured.push_back({ 0, 0 });
+    }
+}
+
+static void GenerateMapPath(size_t ops, vector<bench_op_t> & setup, vector<bench_op_t> & measured)
+{
+    // Fill the heap, then punch holes which the measured allocations reuse. The
+    // blocks in between stay allocated, so the holes are never merged.
+    const uint32_t blocks = 8192;
+    for (uint32_t i = 0; i < blocks; i++)
+        setup.push_back({ i, 2000 });
+    for (uint32_t i = 1; i < blocks; i += 2)
+        setup.push_back({ i, 0 });
+
+    for (uint32_t i = 1; measured.size() + 2 <= ops; i = (i + 2) % blocks)
+    {
+        measured.push_back({ i, 2000 });
+        measured.push_back({ i, 0 });
+    }
+}
+
+static const bench_workload_t WORKLOADS[] =
+{
+    { "path-chunk", "1100 byte allocations from a fresh heap", GenerateChunkPath, 256 * 1024 * 1024, false, true, false },
+    { "path-cache", "64 byte alloc and free of the same size", GenerateCachePath, 64 * 1024 * 1024, false, false, false },
+    { "path-map", "2000 byte allocations reusing freed blocks of a full heap", GenerateMapPath, 8192 * 2016 + 64 * 1024, true, true, false },
+    { "lifo", "batches of 64 allocations freed in reverse order", GenerateLifo, 64 * 1024 * 1024, false, false, false },
+    { "fifo", "1024 live allocations freed oldest first", GenerateFifo, 64 * 1024 * 1024, false, false, false },
+    { "random-free", "4096 slots allocated and freed at random", GenerateRandomFree, 64 * 1024 * 1024, false, false, false },
+    { "power-law", "random free with Pareto sizes up to 1 MB", GeneratePowerLaw, 256 * 1024 * 1024, false, false, false },
+    { "prod-cons", "one thread allocates, another frees", GenerateProducerConsumer, 64 * 1024 * 1024, false, false, true },
+};
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunOps
+//
+// @description             : Runs the operations of a workload once on one thread, then frees
+//                            whatever is left. Freeing the leftovers is not timed.
+//
+// @param allocator         : Allocator under test
+// @param ops               : Operations
+// @param slots             : Live allocations, indexed by slot
+// @param latencies         : Optional. Receives the duration of every operation.
+//
+// @returns                 : Number of failed allocations
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static uint64_t RunOps(Allocator & allocator, const vector<bench_op_t> & ops, vector<void*> & slots, uint64_t *latencies)
+{
+    uint64_t failed = 0;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        const bench_op_t & op = ops[i];
+        uint64_t start = (latencies) ? NowNs() : 0;
+
+        if (op.size)
+        {
+            slots[op.slot] = allocator.Alloc(op.size);
+        }
+        else
+        {
+            allocator.Free(slots[op.slot]);
+            slots[op.slot] = nullptr;
+        }
+
+        if (latencies)
+        {
+            latencies[i] = NowNs() - start;
+        }
+
+        if (op.size && slots[op.slot] == nullptr)
+        {
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+template<class Allocator>
+static void FreeAll(Allocator & allocator, vector<void*> & slots)
+{
+    for (void *& ptr : slots)
+    {
+        if (ptr)
+        {
+            allocator.Free(ptr);
+            ptr = nullptr;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunProducerConsumer
+//
+// @description             : The producer allocates and hands the pointers to the consumer
+//                            through a single producer, single consumer ring, the consumer
+//                            frees them. Nearly every free is of memory from the other thread.
+//
+// @param allocator         : Allocator under test
+// @param ops               : Allocations to do
+// @param latencies         : Optional. Receives the duration of every operation, allocations
+//                            first.
+//
+// @returns                 : Number of failed allocations
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static uint64_t RunProducerConsumer(Allocator & allocator, const vector<bench_op_t> & ops, uint64_t *latencies)
+{
+    const size_t ringSize = 1024;
+    vector<void*> ring(ringSize);
+    atomic<size_t> head(0);
+    atomic<size_t> tail(0);
+    uint64_t failed = 0;
+
+    thread consumer([&]()
+    {
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            while (tail.load(memory_order_acquire) == i)
+            {
+                this_thread::yield();
+            }
+
+            void *ptr = ring[i % ringSize];
+            uint64_t start = (latencies) ? NowNs() : 0;
+            allocator.Free(ptr);
+            if (latencies)
+            {
+                latencies[ops.size() + i] = NowNs() - start;
+            }
+
+            head.store(i + 1, memory_order_release);
+        }
+    });
+
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        while (i - head.load(memory_order_acquire) >= ringSize)
+        {
+            this_thread::yield();
+        }
+
+        uint64_t start = (latencies) ? NowNs() : 0;
+        void *ptr = allocator.Alloc(ops[i].size);
+        if (latencies)
+        {
+            latencies[i] = NowNs() - start;
+        }
+
+        if (ptr == nullptr)
+        {
+            failed++;
+        }
+
+        ring[i % ringSize] = ptr;
+        tail.store(i + 1, memory_order_release);
+    }
+
+    consumer.join();
+    return failed;
+}
+
+static long CurrentRssKb()
+{
+    long pages = 0;
+    long residentPages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == nullptr)
+    {
+        return 0;
+    }
+
+    if (fscanf(file, "%ld %ld", &pages, &residentPages) != 2)
+    {
+        residentPages = 0;
+    }
+
+    fclose(file);
+    return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long PeakRssKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunCase
+//
+// @description             : Runs one workload with one allocator: warm-up, throughput and
+//                            latency pass. Called in the child process.
+//
+// @param allocator         : Allocator under test
+// @param workload          : Workload
+// @param setup             : Untimed operations done before every pass
+// @param measured          : Timed operations
+//
+// @returns                 : Results
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static bench_result_t RunCase(Allocator & allocator, const bench_workload_t & workload,
+                              const vector<bench_op_t> & setup, const vector<bench_op_t> & measured)
+{
+    bench_result_t result;
+    memset(&result, 0, sizeof(result));
+
+    size_t latencyCount = (workload.twoThreads) ? 2 * measured.size() : measured.size();
+    vector<uint64_t> latencies(latencyCount, 0);
+    vector<void*> slots(MAX_SLOTS, nullptr);
+    long baselineRssKb = CurrentRssKb();
+
+    allocator.Reset(workload.heapSize, workload.fixedHeap);
+    for (int pass = 0; pass < 3; pass++)
+    {
+        if (workload.resetHeap && pass)
+        {
+            allocator.Reset(workload.heapSize, workload.fixedHeap);
+        }
+
+        RunOps(allocator, setup, slots, nullptr);
+
+        uint64_t *passLatencies = (pass == 2) ? latencies.data() : nullptr;
+        uint64_t start = NowNs();
+        uint64_t failed = (workload.twoThreads) ? RunProducerConsumer(allocator, measured, passLatencies)
+                                                : RunOps(allocator, measured, slots, passLatencies);
+        uint64_t duration = NowNs() - start;
+
+        if (pass == 1)
+        {
+            result.opsPerSecond = (double)latencyCount * 1e9 / (double)(duration ? duration : 1);
+            result.failedAllocs = failed;
+        }
+
+        FreeAll(allocator, slots);
+    }
+
+    result.peakRssKb = PeakRssKb() - baselineRssKb;
+
+    uint64_t total = 0;
+    for (uint64_t latency : latencies)
+    {
+        total += latency;
+    }
+
+    result.meanNs = (latencyCount) ? (double)total / latencyCount : 0;
+    sort(latencies.begin(), latencies.end());
+    if (latencyCount)
+    {
+        result.p50Ns = latencies[latencyCount / 2];
+        result.p99Ns = latencies[latencyCount * 99 / 100];
+        result.p999Ns = latencies[latencyCount * 999 / 1000];
+    }
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunInChild
+//
+// @description             : Forks, runs the case in the child and passes the results back
+//                            through a pipe, so that every case starts from the same process
+//                            state and has a peak RSS of its own.
+//
+// @param runCase           : Runs the case and returns its results
+// @param result            : [OUTPUT] Results
+//
+// @returns                 : true on success, false if the child failed.
+//----------------------------------------------------------------------------------------------
+template<class Function>
+static bool RunInChild(Function runCase, bench_result_t & result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+
+        bench_result_t childResult = runCase();
+        ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+        _exit(written == (ssize_t)sizeof(childResult) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool success = (pid > 0 && read(fds[0], &result, sizeof(result)) == (ssize_t)sizeof(result));
+    close(fds[0]);
+
+    int status = 0;
+    if (pid > 0)
+    {
+        waitpid(pid, &status, 0);
+    }
+
+    return success && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static size_t g_ops = DEFAULT_OPS;
+static const char *g_filter = nullptr;
+static bool g_csv = false;
+static bool g_threads = false;
+static unsigned int g_maxThreads = 0;
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PrintResult
+//
+// @description             : Prints the results of one case as a table row or a CSV line
+//
+// @param workloadName      : Workload
+// @param allocatorName     : Allocator
+// @param success           : Whether the case ran, false if its child failed
+// @param result            : Results
+// @param hasLatency        : Whether the case timed every operation
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+static void PrintResult(const char *workloadName, const char *allocatorName, bool success, const bench_result_t & result, bool hasLatency)
+{
+    if (!success)
+    {
+        printf("%-12s %-16s failed\n", workloadName, allocatorName);
+    }
+    else if (g_csv)
+    {
+        printf("%s,%s,%.0f,%.1f,%llu,%llu,%llu,%ld,%llu\n", workloadName, allocatorName, result.opsPerSecond, result.meanNs,
+               (unsigned long long)result.p50Ns, (unsigned long long)result.p99Ns, (unsigned long long)result.p999Ns,
+               result.peakRssKb, (unsigned long long)result.failedAllocs);
+    }
+    else if (hasLatency)
+    {
+        printf("%-12s %-16s %10.2f %8.1f %8llu %8llu %9llu %12.1f%s\n", workloadName, allocatorName, result.opsPerSecond / 1e6,
+               result.meanNs, (unsigned long long)result.p50Ns, (unsigned long long)result.p99Ns, (unsigned long long)result.p999Ns,
+               result.peakRssKb / 1024.0, result.failedAllocs ? "  (allocations failed)" : "");
+    }
+    else
+    {
+        printf("%-12s %-16s %10.2f %8s %8s %8s %9s %12.1f\n", workloadName, allocatorName, result.opsPerSecond / 1e6,
+               "-", "-", "-", "-", result.peakRssKb / 1024.0);
+    }
+}
+
+template<class Allocator>
+static void Benchmark(const char *allocatorName, Allocator allocator)
+{
+    for (const bench_workload_t & workload : WORKLOADS)
+    {
+        string caseName = string(workload.name) + " " + allocatorName;
+        if ((g_filter && caseName.find(g_filter) == string::npos) || (workload.twoThreads && !Allocator::THREAD_SAFE))
+        {
+            continue;
+        }
+
+        bench_result_t result;
+        bool success = RunInChild([&]()
+        {
+            vector<bench_op_t> setup;
+            vector<bench_op_t> measured;
+            g_random.seed(42);
+            workload.generate(g_ops, setup, measured);
+            return RunCase(allocator, workload, setup, measured);
+        }, result);
+
+        PrintResult(workload.name, allocatorName, success, result, true);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// Container workload. Vectors in CONTAINER_SLOTS slots are filled by push_back to a random 
+// length and emptied again at random, so they grow by allocating a larger array and freeing
+// the old one with its size. It runs std::allocator against SMAllocator and SMMemoryResource
+// on the global Storage Manager. An operation is one push_back or one emptying.
+//----------------------------------------------------------------------------------------------
+const size_t CONTAINER_SLOTS = 1024;
+
+static void GenerateContainerOps(size_t ops, vector<bench_op_t> & measured)
+{
+    vector<bool> used(CONTAINER_SLOTS, false);
+    for (size_t count = 0; count < ops; )
+    {
+        uint32_t slot = (uint32_t)(g_random() % CONTAINER_SLOTS);
+        uint32_t length = used[slot] ? 0 : UniformSize(1, 2000);
+        measured.push_back({ slot, length });
+        used[slot] = !used[slot];
+        count += (length) ? length : 1;
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunContainers
+//
+// @description             : Runs the container workload twice, the first time to warm up.
+//                            Called in the child process.
+//
+// @param allocator         : Allocator of the vectors
+// @param ops               : Lengths to fill the slots to, 0 to empty them
+//
+// @returns                 : Results of the second run
+//----------------------------------------------------------------------------------------------
+template<class Vector>
+static bench_result_t RunContainers(const typename Vector::allocator_type & allocator, const vector<bench_op_t> & ops)
+{
+    bench_result_t result;
+    memset(&result, 0, sizeof(result));
+    long baselineRssKb = CurrentRssKb();
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        vector<Vector> slots;
+        slots.reserve(CONTAINER_SLOTS);
+        for (size_t i = 0; i < CONTAINER_SLOTS; i++)
+        {
+            slots.emplace_back(allocator);
+        }
+
+        size_t count = 0;
+        uint64_t start = NowNs();
+        for (const bench_op_t & op : ops)
+        {
+            Vector & slot = slots[op.slot];
+            if (op.size == 0)
+            {
+                Vector(allocator).swap(slot);
+                count++;
+            }
+            else
+            {
+                for (uint32_t i = 0; i < op.size; i++)
+                {
+                    slot.push_back(i);
+                }
+
+                count += op.size;
+            }
+        }
+
+        uint64_t duration = NowNs() - start;
+        result.opsPerSecond = (double)count * 1e9 / (double)(duration ? duration : 1);
+    }
+
+    result.peakRssKb = PeakRssKb() - baselineRssKb;
+    return result;
+}
+
+template<class Function>
+static void BenchmarkContainers(const char *allocatorName, Function runContainers)
+{
+    string caseName = string("containers ") + allocatorName;
+    if (g_filter && caseName.find(g_filter) == string::npos)
+    {
+        return;
+    }
+
+    bench_result_t result;
+    bool success = RunInChild([&]()
+    {
+        vector<bench_op_t> ops;
+        g_random.seed(42);
+        GenerateContainerOps(g_ops, ops);
+        return runContainers(ops);
+    }, result);
+
+    PrintResult("containers", allocatorName, success, result, false);
+}
+
+//----------------------------------------------------------------------------------------------
+// Multi-threaded workloads. Every thread has its own list of operations, the threads start
+// together and the time runs until the last one is done.
+//----------------------------------------------------------------------------------------------
+const int MT_LOCAL = 0;         // Every thread allocates and frees its own memory
+const int MT_REMOTE = 1;        // Memory is freed by another thread than the one allocating it
+const int MT_SHARED = 2;        // All threads allocate into and free from one pool
+
+// Allocations on their way from one thread to the next in MT_REMOTE
+const size_t MT_RING_SIZE = 1024;
+
+// Pool size of MT_SHARED
+const size_t MT_SHARED_SLOTS = 4096;
+
+// Heap size of the Storage Managers, they grow if needed
+const size_t MT_HEAP_SIZE = 256 * 1024 * 1024;
+
+typedef struct
+{
+    const char *name;
+    const char *description;
+    int kind;
+}bench_threadWorkload_t;
+
+static const bench_threadWorkload_t THREAD_WORKLOADS[] =
+{
+    { "mt-local", "every thread allocates and frees its own memory at random", MT_LOCAL },
+    { "mt-remote", "every thread frees what the thread before it allocated", MT_REMOTE },
+    { "mt-shared", "all threads swap allocations in and out of one shared pool", MT_SHARED },
+};
+
+// Single producer, single consumer ring. Thread i writes the ring of thread i + 1.
+typedef struct
+{
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+    atomic<bool> done;
+    void *ptrs[MT_RING_SIZE];
+}bench_ring_t;
+
+static void GenerateSharedOps(size_t ops, vector<bench_op_t> & measured)
+{
+    for (size_t i = 0; i < ops / 2; i++)
+        measured.push_back({ (uint32_t)(g_random() % MT_SHARED_SLOTS), UniformSize(16, 512) });
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunThread
+//
+// @description             : Does the operations of one thread of a multi-threaded workload
+//
+// @param allocator         : Allocator under test, shared by all threads
+// @param kind              : MT_LOCAL, MT_REMOTE or MT_SHARED
+// @param ops               : Operations of this thread
+// @param in                : MT_REMOTE: ring to free from
+// @param out               : MT_REMOTE: ring to pass allocations on to
+// @param pool              : MT_SHARED: the shared pool
+//
+// @returns                 : Number of failed allocations
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static uint64_t RunThread(Allocator & allocator, int kind, const vector<bench_op_t> & ops,
+                          bench_ring_t & in, bench_ring_t & out, atomic<void*> *pool)
+{
+    uint64_t failed = 0;
+    if (kind == MT_LOCAL)
+    {
+        vector<void*> slots(MAX_SLOTS, nullptr);
+        failed = RunOps(allocator, ops, slots, nullptr);
+        FreeAll(allocator, slots);
+    }
+    else if (kind == MT_REMOTE)
+    {
+        auto drain = [&]()
+        {
+            size_t head = in.head.load(memory_order_relaxed);
+            size_t tail = in.tail.load(memory_order_acquire);
+            for (; head != tail; head++)
+            {
+                allocator.Free(in.ptrs[head % MT_RING_SIZE]);
+            }
+
+            in.head.store(head, memory_order_release);
+        };
+
+        for (const bench_op_t & op : ops)
+        {
+            void *ptr = allocator.Alloc(op.size);
+            if (ptr == nullptr)
+            {
+                failed++;
+                continue;
+            }
+
+            size_t tail = out.tail.load(memory_order_relaxed);
+            while (tail - out.head.load(memory_order_acquire) >= MT_RING_SIZE)
+            {
+                drain();
+                this_thread::yield();
+            }
+
+            out.ptrs[tail % MT_RING_SIZE] = ptr;
+            out.tail.store(tail + 1, memory_order_release);
+            drain();
+        }
+
+        out.done.store(true, memory_order_release);
+        while (!in.done.load(memory_order_acquire))
+        {
+            drain();
+            this_thread::yield();
+        }
+
+        drain();
+    }
+    else
+    {
+        for (const bench_op_t & op : ops)
+        {
+            void *ptr = allocator.Alloc(op.size);
+            if (ptr == nullptr)
+            {
+                failed++;
+            }
+
+            void *oldPtr = pool[op.slot].exchange(ptr, memory_order_acq_rel);
+            if (oldPtr)
+            {
+                allocator.Free(oldPtr);
+            }
+        }
+    }
+
+    return failed;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunThreads
+//
+// @description             : Runs a multi-threaded workload twice with the given number of
+//                            threads, the first time to warm up. Called in the child process.
+//
+// @param allocator         : Allocator under test
+// @param workload          : Workload
+// @param threadCount       : Number of threads
+//
+// @returns                 : Results of the second run
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static bench_result_t RunThreads(Allocator & allocator, const bench_threadWorkload_t & workload, unsigned int threadCount)
+{
+    bench_result_t result;
+    memset(&result, 0, sizeof(result));
+    long baselineRssKb = CurrentRssKb();
+
+    vector<vector<bench_op_t>> ops(threadCount);
+    vector<bench_op_t> unused;
+    size_t totalOps = 0;
+    g_random.seed(42);
+    for (vector<bench_op_t> & threadOps : ops)
+    {
+        if (workload.kind == MT_LOCAL)
+            GenerateRandomFree(g_ops, unused, threadOps);
+        else if (workload.kind == MT_REMOTE)
+            GenerateProducerConsumer(g_ops, unused, threadOps);
+        else
+            GenerateSharedOps(g_ops, threadOps);
+
+        // An allocation and its free on the other paths
+        totalOps += (workload.kind == MT_LOCAL) ? threadOps.size() : 2 * threadOps.size();
+    }
+
+    allocator.Reset(MT_HEAP_SIZE, false);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        vector<bench_ring_t> rings(threadCount);
+        vector<atomic<void*>> pool(MT_SHARED_SLOTS);
+        for (bench_ring_t & ring : rings)
+        {
+            ring.head.store(0, memory_order_relaxed);
+            ring.tail.store(0, memory_order_relaxed);
+            ring.done.store(false, memory_order_relaxed);
+        }
+
+        for (atomic<void*> & slot : pool)
+        {
+            slot.store(nullptr, memory_order_relaxed);
+        }
+
+        atomic<unsigned int> ready(0);
+        atomic<bool> go(false);
+        atomic<uint64_t> failed(0);
+        vector<thread> threads;
+        for (unsigned int i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back([&, i]()
+            {
+                ready.fetch_add(1);
+                while (!go.load(memory_order_acquire))
+                {
+                    this_thread::yield();
+                }
+
+                failed.fetch_add(RunThread(allocator, workload.kind, ops[i], rings[i], rings[(i + 1) % threadCount], pool.data()));
+            });
+        }
+
+        while (ready.load() < threadCount)
+        {
+            this_thread::yield();
+        }
+
+        uint64_t start = NowNs();
+        go.store(true, memory_order_release);
+        for (thread & worker : threads)
+        {
+            worker.join();
+        }
+
+        uint64_t duration = NowNs() - start;
+
+        for (atomic<void*> & slot : pool)
+        {
+            if (slot.load(memory_order_relaxed))
+            {
+                allocator.Free(slot.load(memory_order_relaxed));
+            }
+        }
+
+        result.opsPerSecond = (double)totalOps * 1e9 / (double)(duration ? duration : 1);
+        result.failedAllocs = failed.load();
+    }
+
+    result.peakRssKb = PeakRssKb() - baselineRssKb;
+    return result;
+}
+
+// Thread counts run: 1, 2, 4, ... and the maximum
+static unsigned int NextThreadCount(unsigned int threadCount)
+{
+    return (threadCount == g_maxThreads) ? threadCount + 1 : min(2 * threadCount, g_maxThreads);
+}
+
+template<class Allocator>
+static void BenchmarkThreads(const char *allocatorName, Allocator allocator)
+{
+    if (!Allocator::THREAD_SAFE)
+    {
+        return;
+    }
+
+    for (const bench_threadWorkload_t & workload : THREAD_WORKLOADS)
+    {
+        string caseName = string(workload.name) + " " + allocatorName;
+        if (g_filter && caseName.find(g_filter) == string::npos)
+        {
+            continue;
+        }
+
+        if (!g_csv)
+        {
+            printf("%-12s %-16s", workload.name, allocatorName);
+        }
+
+        double singleThreadOps = 0;
+        for (unsigned int threadCount = 1; threadCount <= g_maxThreads; threadCount = NextThreadCount(threadCount))
+        {
+            bench_result_t result;
+            bool success = RunInChild([&]()
+            {
+                return RunThreads(allocator, workload, threadCount);
+            }, result);
+
+            if (g_csv)
+            {
+                if (success)
+                {
+                    printf("%s,%s,%u,%.0f,%ld,%llu\n", workload.name, allocatorName, threadCount, result.opsPerSecond,
+                           result.peakRssKb, (unsigned long long)result.failedAllocs);
+                }
+
+                continue;
+            }
+
+            if (!success)
+            {
+                printf(" %16s", "failed");
+                continue;
+            }
+
+            if (threadCount == 1)
+            {
+                singleThreadOps = result.opsPerSecond;
+            }
+
+            printf(" %8.2f (%4.1fx)", result.opsPerSecond / 1e6, (singleThreadOps > 0) ? result.opsPerSecond / singleThreadOps : 0);
+            fflush(stdout);
+        }
+
+        if (!g_csv)
+        {
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+        {
+            g_ops = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            g_filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--csv") == 0)
+        {
+            g_csv = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0)
+        {
+            g_threads = true;
+        }
+        else if (strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc)
+        {
+            g_threads = true;
+            g_maxThreads = (unsigned int)strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--ops N] [--filter text] [--csv] [--threads] [--max-threads N]\n", argv[0]);
+            for (const bench_workload_t & workload : WORKLOADS)
+            {
+                fprintf(stderr, "  %-12s %s\n", workload.name, workload.description);
+            }
+
+            for (const bench_threadWorkload_t & workload : THREAD_WORKLOADS)
+            {
+                fprintf(stderr, "  %-12s %s\n", workload.name, workload.description);
+            }
+
+            fprintf(stderr, "  %-12s %s\n", "containers", "vectors grown by push_back and emptied, on std::allocator and the adapters");
+            return 2;
+        }
+    }
+
+    if (g_threads)
+    {
+        if (g_maxThreads == 0)
+        {
+            g_maxThreads = thread::hardware_concurrency() ? thread::hardware_concurrency() : 1;
+        }
+
+        if (g_csv)
+        {
+            printf("workload,allocator,threads,ops_per_second,peak_rss_kb,failed_allocs\n");
+        }
+        else
+        {
+            printf("%zu operations per thread, Mops/s of all threads together and the speedup over one thread\n\n", g_ops);
+            printf("%-12s %-16s", "workload", "allocator");
+            for (unsigned int threadCount = 1; threadCount <= g_maxThreads; threadCount = NextThreadCount(threadCount))
+            {
+                char label[32];
+                snprintf(label, sizeof(label), "%u thread%s", threadCount, (threadCount == 1) ? "" : "s");
+                printf(" %16s", label);
+            }
+
+            printf("\n");
+        }
+
+        BenchmarkThreads("glibc", MallocBench());
+        BenchmarkThreads("sm", SMBench<SMBestFit, SMCoalesceOnFree, SMThreadCacheLock>());
+        BenchmarkThreads("sm-mutex", SMBench<SMBestFit, SMCoalesceOnFree, SMMutexLock>());
+        return 0;
+    }
+
+    // Cost of reading the clock, included in every latency
+    uint64_t start = NowNs();
+    for (int i = 0; i < 1000; i++)
+    {
+        NowNs();
+    }
+
+    uint64_t timerNs = (NowNs() - start) / 1000;
+
+    if (g_csv)
+    {
+        printf("workload,allocator,ops_per_second,mean_ns,p50_ns,p99_ns,p999_ns,peak_rss_kb,failed_allocs\n");
+    }
+    else
+    {
+        printf("%zu operations per workload, latencies include %llu ns of clock overhead\n\n", g_ops, (unsigned long long)timerNs);
+        printf("%-12s %-16s %10s %8s %8s %8s %9s %12s\n", "workload", "allocator", "Mops/s", "mean ns", "p50 ns", "p99 ns", "p999 ns", "peak RSS MB");
+    }
+
+    Benchmark("glibc", MallocBench());
+    Benchmark("sm", SMBench<SMBestFit, SMCoalesceOnFree, SMThreadCacheLock>());
+    Benchmark("sm-mutex", SMBench<SMBestFit, SMCoalesceOnFree, SMMutexLock>());
+    Benchmark("sm-nolock", SMBench<SMBestFit, SMCoalesceOnFree, SMNoLock>());
+    Benchmark("sm-nolock-noslab", SMBench<SMBestFit, SMCoalesceOnFree, SMNoLock>(false));
+    Benchmark("sm-worstfit", SMBench<SMWorstFit, SMCoalesceOnFree, SMNoLock>());
+    Benchmark("sm-deferred", SMBench<SMBestFit, SMDeferredCoalesce, SMThreadCacheLock>());
+    Benchmark("sm-deferred-bg", SMBench<SMBestFit, SMDeferredCoalesce, SMThreadCacheLock>(true, true));
+
+    BenchmarkContainers("glibc", [](const vector<bench_op_t> & ops)
+    {
+        return RunContainers<vector<uint64_t>>(allocator<uint64_t>(), ops);
+    });
+    BenchmarkContainers("sm", [](const vector<bench_op_t> & ops)
+    {
+        return RunContainers<vector<uint64_t, SMAllocator<uint64_t>>>(SMAllocator<uint64_t>(), ops);
+    });
+#ifdef SM_HAS_MEMORY_RESOURCE
+    BenchmarkContainers("sm-pmr", [](const vector<bench_op_t> & ops)
+    {
+        return RunContainers<pmr::vector<uint64_t>>(pmr::polymorphic_allocator<uint64_t>(SM_GetMemoryResource()), ops);
+    });
+#endif
+    return 0;
+}
@@ -27,11 +27,23 @@ const int DO_DEALLOCS_PERCENT = 95;
 const bool USE_STORAGE_MANAGER = true;
 const bool USE_NATIVE_MALLOC = true;
 
+// Allocation trace written after the simulation when the Storage Manager records one,
+// see tools/sm_trace_decode.cpp
+const char *TRACE_FILE = "sm_trace.bin";
+
+// Statistics written after the simulation for monitoring, in JSON
+const char *STATS_FILE = "sm_stats.json";
+
+// Heap of the regression checks, separate from the global instance
+typedef BasicStorageManager<SMBestFit, SMCoalesceOnFree, SMNoLock, SMNoStats> CheckHeap;
+typedef BasicStorageManager<SMBestFit, SMCoalesceOnFree, SMThreadCacheLock, SMNoStats> CheckSharedHeap;
+const size_t CHECK_HEAP_SIZE = 1024 * 1024;  // bytes
+
 //----------------------------------------------------------------------------------------------
 // Globals
 //----------------------------------------------------------------------------------------------
 RandomGenerator rng;
-extern StorageManager sm;
+extern StorageManager & sm;
 unsigned long long g_countAllocs = 0;
 unsigned long long g_countAllocsFailed = 0;
 unsigned long long g_countFrees = 0;
@@ -84,6 +96,114 @@ long long getCurrentTimestampInMilliseconds()
     return ts_ms;
 }
 
+//----------------------------------------------------------------------------------------------
+// @name                    : IsZero
+//
+// @description             : Checks that a piece of memory reads as zero.
+//
+// @returns                 : true if all bytes are zero, false otherwise.
+//----------------------------------------------------------------------------------------------
+bool IsZero(const char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (ptr[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunRegressionChecks
+//
+// @description             : Checks behaviour that once was broken, on a heap of its own.
+//
+// @returns                 : Number of failed checks
+//----------------------------------------------------------------------------------------------
+int RunRegressionChecks()
+{
+    int failures = 0;
+
+    // The tail cut off by a shrinking realloc goes back to the chunk, calloc must not
+    // take it for memory that was never used
+    {
+        CheckHeap heap(CHECK_HEAP_SIZE);
+        char *ptr = (char *)heap.SM_alloc(100000);
+        memset(ptr, 0xAB, 100000);
+        ptr = (char *)heap.SM_realloc(ptr, 1000);
+        char *zeroed = (char *)heap.SM_calloc(1, 50000);
+        if (zeroed == nullptr || !IsZero(zeroed, 50000))
+        {
+            printf("*** REGRESSION: calloc after a shrinking realloc returned dirty memory\n");
+            failures++;
+        }
+    }
+
+    // Compaction gives the free memory at the end of the chunk back to the chunk as well
+    {
+        CheckHeap heap(CHECK_HEAP_SIZE);
+        sm_handle_t handles[50];
+        for (int i = 0; i < 50; i++)
+        {
+            handles[i] = heap.SM_handle_alloc(1000);
+            memset(heap.SM_handle_pin(handles[i]), 0xAB, 1000);
+            heap.SM_handle_unpin(handles[i]);
+        }
+
+        for (int i = 0; i < 50; i += 2)
+        {
+            heap.SM_handle_dealloc(handles[i]);
+        }
+
+        heap.CompactHeap();
+        char *zeroed = (char *)heap.SM_calloc(1, 20000);
+        if (zeroed == nullptr || !IsZero(zeroed, 20000))
+        {
+            printf("*** REGRESSION: calloc after CompactHeap returned dirty memory\n");
+            failures++;
+        }
+    }
+
+    // Free blocks past their purge delay are purged even when the heap goes idle
+    {
+        sm_config_t config = {};
+        config.initialSize = 16 * CHECK_HEAP_SIZE;
+        config.growSize = 16 * CHECK_HEAP_SIZE;
+        config.slabs = true;
+        config.purgeDelay = 20;
+        CheckSharedHeap heap(config);
+
+        char *blocks[8];
+        for (int i = 0; i < 8; i++)
+        {
+            blocks[i] = (char *)heap.SM_alloc(CHECK_HEAP_SIZE);
+            memset(blocks[i], 0xAB, CHECK_HEAP_SIZE);
+        }
+
+        char *kept = (char *)heap.SM_alloc(100);
+        for (int i = 0; i < 8; i++)
+        {
+            heap.SM_dealloc(blocks[i]);
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(200));
+        sm_stats_t stats;
+        heap.GetStats(stats);
+        if (stats.purgedSize == 0)
+        {
+            printf("*** REGRESSION: free blocks of an idle heap were not purged after the delay\n");
+            failures++;
+        }
+
+        heap.SM_dealloc(kept);
+    }
+
+    return failures;
+}
+
 //----------------------------------------------------------------------------------------------
 // @name                    : Cleanup
 //
@@ -202,6 +322,25 @@ long long DoSimulation(const vector<unsigned int> & rngList, bool useStorageMana
     {
         //sm.DisplayMemoryMapDetails();
         sm.DisplayMemoryStats();
+
+        if (sm.DumpTrace(TRACE_FILE))
+        {
+            printf("Allocation trace written to %s\n", TRACE_FILE);
+        }
+
+        char statsText[8192];
+        size_t statsLength = sm.ExportStats(statsText, sizeof(statsText), SM_STATS_JSON);
+        FILE *statsFile = fopen(STATS_FILE, "w");
+        if (statsFile && statsLength < sizeof(statsText))
+        {
+            fwrite(statsText, 1, statsLength, statsFile);
+            printf("Statistics written to %s\n", STATS_FILE);
+        }
+
+        if (statsFile)
+        {
+            fclose(statsFile);
+        }
     }
 
     DisplayStats();
@@ -214,6 +353,11 @@ long long DoSimulation(const vector<unsigned int> & rngList, bool useStorageMana
 //----------------------------------------------------------------------------------------------
 int main()
 {
+    if (RunRegressionChecks() == 0)
+    {
+        printf("Regression checks passed\n");
+    }
+
     // Generate random len of string 1st
     vector<unsigned int> rngList;
     for (size_t i = 0; i < REPEATS; i++)
@@ -242,8 +386,8 @@ int main()
         cout << endl << "** Time required (using storage manager) : " << timeRequired2 << " ms" << endl << endl;
     }
 
-    float result = ((float)(timeRequired1 - timeRequired2) / timeRequired1) * 100;
-    printf("\n*** Time comparison of Storage manager: %f %%\n", result);
+    // Millisecond totals of one run are not a benchmark, see bench/sm_bench.cpp for that
+    printf("\n*** For throughput, latency and memory use per workload run bench/sm_bench\n");
 
     getchar();
     return 0;
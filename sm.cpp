@@ -1,637 +1,401 @@
 ﻿#include<assert.h>
 #include "sm.h"
-#include<iostream> 
 #include<stdlib.h> 
+#include<new>
+#include<string.h>
 
 #ifdef TEST
 // Storage manager initial size
-const unsigned int SM_SIZE = 1000;  // bytes
-const bool DEBUG = true;
+const size_t SM_SIZE = 1000;  // bytes
+// Heap growth: size of further chunks and limit of the whole heap (0 = no limit)
+const size_t SM_GROW_SIZE = 1000;  // bytes
+const size_t SM_MAX_FOOTPRINT = 4000;  // bytes
+// The test heap is too small to hold a slab
+const bool SM_SLABS = false;
 #else
-const unsigned int SM_SIZE = 1024 * 1024 * 1024;  // bytes
-const bool DEBUG = false;
+const size_t SM_SIZE = 1024 * 1024 * 1024;  // bytes
+const size_t SM_GROW_SIZE = 1024 * 1024 * 1024;  // bytes
+const size_t SM_MAX_FOOTPRINT = 0;  // bytes
+const bool SM_SLABS = true;
 #endif
 
-const bool DO_DEFRAGMENTATION = true;
-const bool USE_CACHE = true;
+const bool SM_PREFAULT = false;
+const bool SM_COALESCE_THREAD = false;  // Only used by SMDeferredCoalesce
+const bool SM_HUGE_PAGES = false;
+// Purging of free memory: free bytes kept resident (0 = no threshold), milliseconds a free 
+// block stays resident (0 = forever) and limit of the resident heap (0 = no limit)
+const size_t SM_PURGE_THRESHOLD = 0;  // bytes
+const unsigned int SM_PURGE_DELAY = 10000;  // ms
+const size_t SM_SOFT_LIMIT = 0;  // bytes
 
 //----------------------------------------------------------------------------------------------
-// Create global Storage Manager object which will be used by entire system
+// Create global Storage Manager object which will be used by entire system. It is created on
+// first use, which may be an operator new or malloc call from another static initializer, and
+// never destroyed, since memory may still be freed after static destruction has started.
 //----------------------------------------------------------------------------------------------
-StorageManager sm(SM_SIZE);
+static const sm_config_t SM_CONFIG = { SM_SIZE, SM_GROW_SIZE, SM_MAX_FOOTPRINT, SM_PREFAULT, SM_SLABS, SM_COALESCE_THREAD, SM_HUGE_PAGES,
+                                       SM_PURGE_THRESHOLD, SM_PURGE_DELAY, SM_SOFT_LIMIT };
+alignas(StorageManager) static unsigned char g_instanceStorage[sizeof(StorageManager)];
+static atomic<int> g_instanceState;    // 0: not created, 1: being created, 2: ready
+static thread_local bool t_creatingInstance;
 
-// Not allowing new and delete override for now
 //----------------------------------------------------------------------------------------------
-// Overriding new and delete operators to use our Storage Manager
-//----------------------------------------------------------------------------------------------
-//void * operator new (size_t size)
-//{
-//    return sm.SM_alloc(size);
-//}
-//
-//void * operator new[](size_t size)
-//{
-//    return  sm.SM_alloc(size);
-//}
-//
-//void operator delete (void* ptr)
-//{
-//    sm.SM_dealloc(ptr);
-//}
-//
-//void operator delete[](void* ptr)
-//{
-//    sm.SM_dealloc(ptr);
-//}
-
-//----------------------------------------------------------------------------------------------
-// @name                    : StorageManager
+// @name                    : SM_GetInstance
 //
-// @description             : Constructor
+// @description             : Returns the global Storage Manager, creating it on first use. 
+//                            Threads arriving while it is being created wait for it.
 //
-// @returns                 : Nothing
+// @returns                 : The global Storage Manager, nullptr when called by the creating
+//                            thread from within the constructor.
 //----------------------------------------------------------------------------------------------
-StorageManager::StorageManager(int size)
+StorageManager* SM_GetInstance()
 {
-    if (!InitStorageManager(size))
+    if (g_instanceState.load(memory_order_acquire) == 2)
     {
-        printf("\n *** FATAL ERROR: InitStorageManager: Cannot proceed!\n");
-        return;
+        return (StorageManager*)g_instanceStorage;
+    }
+
+    int expected = 0;
+    if (g_instanceState.compare_exchange_strong(expected, 1, memory_order_acq_rel))
+    {
+        t_creatingInstance = true;
+        new (g_instanceStorage) StorageManager(SM_CONFIG);
+        t_creatingInstance = false;
+        g_instanceState.store(2, memory_order_release);
+    }
+    else if (t_creatingInstance)
+    {
+        return nullptr;
+    }
+    else
+    {
+        while (g_instanceState.load(memory_order_acquire) != 2)
+        {
+            this_thread::yield();
+        }
     }
 
-    m_chunkTotalSize = size;
-    m_chunkUsedSize = 0;
-    m_countChunkAllocs = 0;
-    m_countMemoryMapAllocs = 0;
-    m_countCacheAllocs = 0;
-    m_countFrees = 0;
-    m_cacheBlockSize = 0;
-    m_cacheBlock = nullptr;
+    return (StorageManager*)g_instanceStorage;
 }
 
+StorageManager & sm = *SM_GetInstance();
+
 //----------------------------------------------------------------------------------------------
-// @name                    : StorageManager
-//
-// @description             : Destructor
-//
-// @returns                 : Nothing
+// Thread slots, shared by all Storage Managers of the process. An exiting thread flushes its
+// caches without the slot lock, since a thread may take its slot while holding a heap lock.
+// Its slot stays used meanwhile, and flushes are only removed once no thread is exiting.
 //----------------------------------------------------------------------------------------------
-StorageManager::~StorageManager()
+typedef struct
 {
-    free(m_chunkPtr);
-    m_chunkPtr = nullptr;
-}
+    void *owner;
+    sm_threadExitFlush_t flush;
+}sm_exitFlush_t;
 
-//----------------------------------------------------------------------------------------------
-// @name                    : InitStorageManager
-//
-// @description             : TODO
-//
-// @param size              : Memory chunk allocated on init.
-//
-// @returns                 : true on success, false otherwise.
-//----------------------------------------------------------------------------------------------
-bool StorageManager::InitStorageManager(size_t size)
+static mutex g_threadSlotLock;
+static bool g_threadSlotUsed[SM_MAX_THREADS];
+static sm_exitFlush_t g_exitFlushes[SM_MAX_EXIT_FLUSHES];
+static unsigned int g_exitFlushCount;
+static unsigned int g_exitingThreads;
+
+ThreadSlot::ThreadSlot()
 {
-    m_chunkPtr = (char *)malloc(size);
-    if (m_chunkPtr)
+    lock_guard<mutex> lock(g_threadSlotLock);
+    for (index = 0; index < SM_MAX_THREADS; index++)
     {
-        printf("Storage Manager initialized with %lu bytes\n", size);
-        m_currentPtr = m_chunkPtr;
-        memset(m_chunkPtr, 0, size);
-        //cout << "Chunk content: " << m_chunkPtr << endl;
-        return true;
+        if (!g_threadSlotUsed[index])
+        {
+            g_threadSlotUsed[index] = true;
+            break;
+        }
     }
-
-    printf("Storage Manager failed to allocate %lu bytes\n", size);
-    return false;
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : SM_alloc
-//
-// @description             : This function is called from SM_ALLOC_ARRAY macro. 
-//
-// @param size              : Size of memory requested for heap allocation.
-//
-// @returns                 : Pointer to start of the allocated memory
-//----------------------------------------------------------------------------------------------
-void * StorageManager::SM_alloc(size_t size)
+ThreadSlot::~ThreadSlot()
 {
-    char *ptr = nullptr;
-    sm_metaData_t metaData;
-
-    if (size == 0)
+    if (index >= SM_MAX_THREADS)
     {
-        return ptr;
+        return;
     }
 
-    if (DEBUG)
-        cout << "\nCustom alloc for " << size << " bytes" << endl;
-
-    // Allocate from chunk. 
-    if (m_chunkTotalSize - m_chunkUsedSize >= size)
+    sm_exitFlush_t flushes[SM_MAX_EXIT_FLUSHES];
+    unsigned int count = 0;
     {
-        if (DEBUG)
-            cout << "  Allocating from chunk" << endl;
-
-        ptr = m_currentPtr;
-        if (ptr)
-        {
-            m_countChunkAllocs++;
-            m_chunkUsedSize += size;
-            m_currentPtr = m_currentPtr + size;
-        }
+        lock_guard<mutex> lock(g_threadSlotLock);
+        count = g_exitFlushCount;
+        memcpy(flushes, g_exitFlushes, count * sizeof(sm_exitFlush_t));
+        g_exitingThreads++;
     }
-    else
+
+    for (unsigned int i = 0; i < count; i++)
     {
-        // Allocate from recycled memory
-        ptr = GetMemoryFromMap(size);
+        flushes[i].flush(flushes[i].owner, index);
     }
 
-    // Update metadata and memory map if a valid memory is allocated
-    if (ptr)
+    lock_guard<mutex> lock(g_threadSlotLock);
+    g_exitingThreads--;
+    g_threadSlotUsed[index] = false;
+    index = SM_MAX_THREADS;
+}
+
+bool AddThreadExitFlush(void *owner, sm_threadExitFlush_t flush)
+{
+    lock_guard<mutex> lock(g_threadSlotLock);
+    if (g_exitFlushCount == SM_MAX_EXIT_FLUSHES)
     {
-        // Fill up the meta data
-        metaData.isFree = false;
-        metaData.size = size;
-        m_memoryMap[ptr] = metaData;
+        return false;
+    }
+
+    g_exitFlushes[g_exitFlushCount].owner = owner;
+    g_exitFlushes[g_exitFlushCount].flush = flush;
+    g_exitFlushCount++;
+    return true;
+}
 
-        if (DEBUG)
+void RemoveThreadExitFlush(void *owner)
+{
+    for (;;)
+    {
         {
-            printf("  Allocated 0x%lu\n", ptr);
-            DisplayMemoryMapDetails();
+            lock_guard<mutex> lock(g_threadSlotLock);
+            if (g_exitingThreads == 0)
+            {
+                for (unsigned int i = 0; i < g_exitFlushCount; i++)
+                {
+                    if (g_exitFlushes[i].owner == owner)
+                    {
+                        g_exitFlushes[i] = g_exitFlushes[--g_exitFlushCount];
+                        break;
+                    }
+                }
+
+                return;
+            }
         }
-    }
 
-    return ptr;
+        this_thread::yield();
+    }
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : SM_dealloc
-//
-// @description             : This function is called from SM_DEALLOC macro. It marks the 
-//                            memory pointed to by ptr as free. Actual de-allocation DOES NOT
-//                            takes place. This memory block is then re-claimed for future
-//                            allocations from this pool.
-//
-// @param ptr               : Pointer to memory that needs to be freed.
-//
-// @returns                 : Nothing
-//----------------------------------------------------------------------------------------------
-void StorageManager::SM_dealloc(void *ptr)
+void LockThreadSlots()
 {
-    if (DEBUG)
-        printf("\nCustom dealloc for 0x%lu\n", (char*)ptr);
+    g_threadSlotLock.lock();
+}
 
-    if (ptr == nullptr)
+void UnlockThreadSlots(bool inChild)
+{
+    // The child's only thread does not own the lock as far as the system is concerned
+    if (inChild)
     {
+        new (&g_threadSlotLock) mutex();
+        g_exitingThreads = 0;
         return;
     }
 
-    auto it = m_memoryMap.find((char*)ptr);
-    if (it != m_memoryMap.end())
-    {
-        sm_metaData_t & metaData = it->second;
+    g_threadSlotLock.unlock();
+}
 
-        // Do not actually deallocate memory, Mark it as free
-        metaData.isFree = true;
+#ifdef SM_OVERRIDE_NEW
+//----------------------------------------------------------------------------------------------
+// Overriding new and delete operators to use our Storage Manager. Allocations made while the
+// Storage Manager is being created go to malloc, delete tells them apart by their address.
+// Sized delete passes the size on, which spares most frees the lookup of their address.
+//----------------------------------------------------------------------------------------------
+static bool g_newUsedMalloc;    // Written before the instance is published
+static void * AllocateForNew(size_t size, size_t alignment)
+{
+    if (size == 0)
+    {
+        size = 1;
+    }
 
-        int defragCount = 0;
-        if (DO_DEFRAGMENTATION)
+    for (;;)
+    {
+        StorageManager *instance = SM_GetInstance();
+        void *ptr = nullptr;
+        if (instance == nullptr)
+        {
+            ptr = (alignment <= SM_MIN_ALIGNMENT) ? malloc(size) : nullptr;
+            g_newUsedMalloc = true;
+        }
+        else if (alignment > SM_MIN_ALIGNMENT)
+        {
+            ptr = instance->SM_alloc_aligned(size, alignment);
+        }
+        else
         {
-            defragCount = HandleFragmentedMemory((char*)ptr, metaData, nullptr);
+            ptr = instance->SM_alloc(size);
         }
 
-        // Update the cache block if the size of this freed block 
-        // is larger than the current cache block
-        if (it->second.size > m_cacheBlockSize)
+        if (ptr)
         {
-            m_cacheBlockSize = metaData.size;
-            m_cacheBlock = it->first;
+            return ptr;
         }
 
-        if (DEBUG)
+        new_handler handler = get_new_handler();
+        if (handler == nullptr)
         {
-            if (defragCount)
-            {
-                printf ("  Memory map Defragmentation done %d times\n", defragCount);
-            }
-            
-            DisplayCacheMemoryDetails();
-            DisplayMemoryMapDetails();
+            return nullptr;
         }
 
-        m_countFrees++;
-    }
-    else
-    {
-        cout << "*** DEALLOC ERROR: Invalid memory address provided!" << endl;
+        handler();
     }
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : FindNextFreeSpaceInMemoryMap
-//
-// @description             : Finds out the free block in Memory map next to the given block.
-//
-// @returns                 : If a free block is found, then pointer to free block, 
-//                            nullptr otherwise.
-//----------------------------------------------------------------------------------------------
-char* StorageManager::FindNextFreeSpaceInMemoryMap(char *ptr)
+static void DeallocateForDelete(void *ptr)
 {
-    auto it = m_memoryMap.find(ptr);
-    if (it != m_memoryMap.end())
+    if (ptr == nullptr)
     {
-        while (it != m_memoryMap.end())
-        {
-            sm_metaData_t metaData = it->second;
-            if (metaData.isFree && it->first != ptr)
-            {
-                return it->first;
-            }
-
-            it++;
-        }
+        return;
     }
 
-    return nullptr;
+    StorageManager *instance = SM_GetInstance();
+    if (instance && instance->OwnsPointer(ptr))
+    {
+        instance->SM_dealloc(ptr);
+    }
+    else
+    {
+        free(ptr);
+    }
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : FindFreeSpaceInMemoryMap
-//
-// @description             : Finds out the first free block in Memory map.
-//
-// @returns                 : If a free block is found, then pointer to free block, 
-//                            nullptr otherwise.
-//----------------------------------------------------------------------------------------------
-char* StorageManager::FindFreeSpaceInMemoryMap()
+static void DeallocateForDelete(void *ptr, size_t size)
 {
-    for (auto it = m_memoryMap.begin(); it != m_memoryMap.end(); it++)
+    // Only when nothing came from malloc can the address go unchecked
+    StorageManager *instance = SM_GetInstance();
+    if (instance && !g_newUsedMalloc)
     {
-        sm_metaData_t metaData = it->second;
-        if (metaData.isFree)
-        {
-            return it->first;
-        }
+        instance->SM_dealloc(ptr, size);
+    }
+    else
+    {
+        DeallocateForDelete(ptr);
     }
-
-    return nullptr;
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : FindFreeSpaceSizeInMemoryMap
-//
-// @description             : Finds out the first free block in Memory map.
-//
-// @returns                 : If a free block is found, then pointer to free block, 
-//                            nullptr otherwise.
-//----------------------------------------------------------------------------------------------
-size_t StorageManager::FindFreeSpaceSizeInMemoryMap()
+void * operator new (size_t size)
 {
-    size_t totalFreeSize = 0;
-
-    for (auto it = m_memoryMap.begin(); it != m_memoryMap.end(); it++)
+    void *ptr = AllocateForNew(size, 0);
+    if (ptr == nullptr)
     {
-        sm_metaData_t metaData = it->second;
-        if (metaData.isFree)
-        {
-            totalFreeSize += metaData.size;
-        }
+        throw bad_alloc();
     }
 
-    return totalFreeSize;
+    return ptr;
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : FetchMemoryIfAvailable
-//
-// @description             : Given the memory address, this function checks if it is marked 
-//                            as free in the memory map and has adequate size to cater to
-//                            the requested alloc size. It also merges the leftover space
-//                            with the subsequent free blocks (if available). In this process
-//                            it also tries to check additional free blocks and merges (defragments) 
-//                            them to form a single large block.
-//
-// @returns                 : pointer to memory in memory map
-//----------------------------------------------------------------------------------------------
-inline char *StorageManager::FetchMemoryIfAvailable(const size_t size, char *ptrToCheck, sm_metaData_t & metaData)
+void * operator new[](size_t size)
 {
-    char *ptr = nullptr; 
-
-    if (DEBUG && metaData.isFree)
-    {
-        printf("  Required: %u, inMap: %u\n", size, metaData.size);
-    }
-
-    if (metaData.isFree == true && metaData.size >= size)
+    void *ptr = AllocateForNew(size, 0);
+    if (ptr == nullptr)
     {
-        ptr = ptrToCheck;
-        size_t originalBlockSize = metaData.size;
-        metaData.size = size;
-        metaData.isFree = false;
-
-        // What to do if there is some memory left after this allocation?
-        if (originalBlockSize > size)
-        {
-            sm_metaData_t fragmentedMetaData;
-            fragmentedMetaData.isFree = true;
-            fragmentedMetaData.size = originalBlockSize - size;
-            char *fragmentedPtr = ptr + size;
-
-            int defragCount = 0;
-            if (DO_DEFRAGMENTATION)
-            {
-                defragCount = HandleFragmentedMemory(fragmentedPtr, fragmentedMetaData, nullptr);
-            }
-
-            // Add the defragmented memory to the map
-            m_memoryMap[fragmentedPtr] = fragmentedMetaData;
-            
-            if (DEBUG)
-            {
-                printf("Adding fragmented block 0x%lu to memory map\n", fragmentedPtr);
-
-                if (defragCount)
-                {
-                    printf("  Defragmentation done %d times\n", defragCount);
-                }
-
-                DisplayMemoryMapDetails();
-            }
-        }
+        throw bad_alloc();
     }
 
     return ptr;
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : GetMemoryFromMap
-//
-// @description             : Looks for a memory block of sufficient size in the memory map. This
-//                            function needs to be optimized so as to make a quick search of 
-//                            next free block from the reusable memory map.
-//
-// @returns                 : pointer to free memory in Memory map (recycled memory)
-//----------------------------------------------------------------------------------------------
-char* StorageManager::GetMemoryFromMap(size_t size)
+void * operator new (size_t size, const nothrow_t &) noexcept
 {
-    char *ptr = nullptr;
-
-    if (USE_CACHE)
-    {
-        if (DEBUG)
-        {
-            DisplayCacheMemoryDetails();
-        }
-
-        // Check if memory can be allocated from the cached block
-        if (m_cacheBlockSize >= size)
-        {
-            sm_metaData_t & metaData = m_memoryMap[m_cacheBlock];
-            ptr = FetchMemoryIfAvailable(size, m_cacheBlock, metaData);
-
-            if (ptr)
-            {
-                if (DEBUG)
-                {
-                    printf("  Adding block 0x%lu from cache\n", ptr);
-                }
+    return AllocateForNew(size, 0);
+}
 
-                m_countCacheAllocs++;
-
-                // Update the cache with the 1st available free block
-                // in memory map. This is sort of a compromise as we
-                // could have obtained the largest free block, but that 
-                // would involve traversing the memory map, which we are
-                // avoiding. This is the reason cache was brough in the first
-                // place - to avoid memory map traversal on every 
-                // allocation request.
-                m_cacheBlock = FindFreeSpaceInMemoryMap();
-                if (m_cacheBlock)
-                {
-                    m_cacheBlockSize = m_memoryMap[m_cacheBlock].size;
-                }
-                else
-                {
-                    // No free space avaiable in Memory map. Set the 
-                    // cache to NULL
-                    m_cacheBlock = nullptr;
-                    m_cacheBlockSize = 0;
-                }
+void * operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return AllocateForNew(size, 0);
+}
 
-                return ptr;
-            }
-            else
-            {
-                if (DEBUG)
-                    printf("  Not found in cache\n");
-            }
-        }
-    } // Use of cache
+void operator delete (void* ptr) noexcept
+{
+    DeallocateForDelete(ptr);
+}
 
-    // Required M/m not found in cache, look in the entire Memory Map
-    for (auto it = m_memoryMap.begin(); it != m_memoryMap.end(); it++)
-    {
-        sm_metaData_t & metaData = it->second;
-        char *ptrToCheck = it->first;
-        ptr = FetchMemoryIfAvailable(size, ptrToCheck, metaData);
-        if (ptr)
-        {
-            if (DEBUG)
-            {
-                printf("  Adding block 0x%lu from Memory map\n", ptr);
-            }
+void operator delete[](void* ptr) noexcept
+{
+    DeallocateForDelete(ptr);
+}
 
-            m_countMemoryMapAllocs++;
-            break;
-        }
-    }
+void operator delete (void* ptr, const nothrow_t &) noexcept
+{
+    DeallocateForDelete(ptr);
+}
 
-    return ptr;
+void operator delete[](void* ptr, const nothrow_t &) noexcept
+{
+    DeallocateForDelete(ptr);
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : DefragmentMemoryMap
-//
-// @description             : NOT USED. Looks for consecutive free blocks and merges them.
-//
-// @returns                 : Number of times defragmentation was done
-//----------------------------------------------------------------------------------------------
-int StorageManager::DefragmentMemoryMap()
+void operator delete (void* ptr, size_t size) noexcept
 {
-    int count = 0;
-    bool done = false;
-    char *curBlock = FindNextFreeSpaceInMemoryMap(m_chunkPtr);
-    char *nextBlock = nullptr;
+    DeallocateForDelete(ptr, size);
+}
 
-    if (DEBUG)
-        printf("  Defragmenting memory map...\n");
+void operator delete[](void* ptr, size_t size) noexcept
+{
+    DeallocateForDelete(ptr, size);
+}
 
-    do
+#ifdef __cpp_aligned_new
+void * operator new (size_t size, align_val_t alignment)
+{
+    void *ptr = AllocateForNew(size, (size_t)alignment);
+    if (ptr == nullptr)
     {
-        sm_metaData_t & metaData = m_memoryMap[curBlock];
-        count += HandleFragmentedMemory(curBlock, metaData, nextBlock);
-        if (nextBlock == nullptr)
-        {
-            curBlock = FindNextFreeSpaceInMemoryMap(curBlock);
-        }
-        else
-        {
-            curBlock = nextBlock;
-        }
-    } while (curBlock != nullptr && curBlock < m_chunkPtr + m_chunkTotalSize);
+        throw bad_alloc();
+    }
 
-    return count;
+    return ptr;
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : HandleFragmentedMemory
-//
-// @description             : Once a particular block has been marked as free, we check if
-//                            a larger block can be formed by merging this with the next
-//                            free block. 
-//                            Limitation: If a free block lies before the current block, then
-//                                        this function would not be able to merge it.
-//                                        TODO: Some mechanism to detect previous free blocks.
-//
-// @param ptr               : Current block address
-// @param metaData          : Reference of meta data for current block
-// @param nextOccupiedBlock : [OUTPUT] Will store the address of the next occupied block
-//                            address in memory map.
-//
-// @returns                 : Number of times defragmentation was done
-//----------------------------------------------------------------------------------------------
-int StorageManager::HandleFragmentedMemory(char *ptr, sm_metaData_t & metaData, char *nextOccupiedBlock)
+void * operator new[](size_t size, align_val_t alignment)
 {
-    static int count = 0;
-    nextOccupiedBlock = nullptr;
-
+    void *ptr = AllocateForNew(size, (size_t)alignment);
     if (ptr == nullptr)
     {
-        return count;
+        throw bad_alloc();
     }
 
-    if (ptr >= m_chunkPtr + m_chunkTotalSize)
-    {
-        if (DEBUG)
-        {
-            printf("  Defragment Info: Reached end of chunk. No merge possible\n");
-        }
+    return ptr;
+}
 
-        return count;
-    }
+void * operator new (size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return AllocateForNew(size, (size_t)alignment);
+}
 
-    char *nextBlock = ptr + metaData.size;
-    if (nextBlock >= m_chunkPtr + m_chunkTotalSize)
-    {
-        if (DEBUG)
-        {
-            printf("  Defragment Info: Reached end of chunk. No merge possible\n");
-        }
+void * operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept
+{
+    return AllocateForNew(size, (size_t)alignment);
+}
 
-        return count;
-    }
+void operator delete (void* ptr, align_val_t) noexcept
+{
+    DeallocateForDelete(ptr);
+}
 
-    // Check if this is free
-    auto it = m_memoryMap.find(nextBlock);
-    if (it != m_memoryMap.end())
-    {
-        sm_metaData_t nextMetaData = it->second;
-        if (nextMetaData.isFree == true)
-        {
-            if (DEBUG)
-                printf("  Merging %lu --> %lu bytes\n", metaData.size, metaData.size + nextMetaData.size);
-            
-            // Update size of the merged block
-            metaData.size += nextMetaData.size;
-            count++;
-
-            // remove next block's entry from map since it will 
-            // get merged to previous block
-            m_memoryMap.erase(it);
-
-            // Check if further blocks can be merged, call this function recursively
-            count = HandleFragmentedMemory(ptr, metaData, nextOccupiedBlock);
-        }
-        else
-        {
-            // Next block not free. Merge not possible.
-            // Store the address of the next non-free block.
-            nextOccupiedBlock = it->first;
-        }
-    }
-    else
-    {
-        //if (DEBUG)
-            //printf("  Defragmentation: Next block 0x%lu not present in Memory Map!\n", nextBlock);
-    }
+void operator delete[](void* ptr, align_val_t) noexcept
+{
+    DeallocateForDelete(ptr);
+}
 
-    int countToReturn = count;
-    count = 0;
-    return countToReturn;
+void operator delete (void* ptr, align_val_t, const nothrow_t &) noexcept
+{
+    DeallocateForDelete(ptr);
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : DisplayCacheMemoryDetails
-//
-// @description             : Cache memory stats
-//
-// @returns                 : Nothing
-//----------------------------------------------------------------------------------------------
-void StorageManager::DisplayCacheMemoryDetails()
+void operator delete[](void* ptr, align_val_t, const nothrow_t &) noexcept
 {
-    printf("  Cache block     : 0x%lu %u bytes\n", m_cacheBlock, m_cacheBlockSize);
+    DeallocateForDelete(ptr);
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : DisplayMemoryMapDetails
-//
-// @description             : Displays the address, size and free/occupied status of memory map
-//
-// @returns                 : Nothing
-//----------------------------------------------------------------------------------------------
-void StorageManager::DisplayMemoryMapDetails()
+void operator delete (void* ptr, size_t size, align_val_t) noexcept
 {
-    printf("\n");
-    printf("+-----------------------------------------------+\n");
-    printf("|               Memory map                      |\n");
-    printf("+-----------------------------------------------+\n");
-    size_t freeSpaceInMemoryMap = 0;
-    unsigned int index = 1;
-    for (auto it = m_memoryMap.begin(); it != m_memoryMap.end(); it++)
-    {
-        sm_metaData_t metaData = it->second;
-        printf("| %3d) 0x%lu : %-4lu bytes   <%-8s>     |\n", index, it->first, metaData.size, metaData.isFree ? "  Free  " : "Occupied");
-        index++;
-    }
-    printf("+-----------------------------------------------+\n");
+    DeallocateForDelete(ptr, size);
 }
 
-//----------------------------------------------------------------------------------------------
-// @name                    : DisplayMemoryStats
-//
-// @description             : Memory usage statistics
-//
-// @returns                 : Nothing
-//----------------------------------------------------------------------------------------------
-void StorageManager::DisplayMemoryStats()
+void operator delete[](void* ptr, size_t size, align_val_t) noexcept
 {
-    size_t freeSpaceInMemoryMap = FindFreeSpaceSizeInMemoryMap();
-    unsigned long long totalAllocs = m_countChunkAllocs + m_countMemoryMapAllocs + m_countCacheAllocs;
-
-    printf("+----------------------------------------------------------+\n");
-    printf("|               Storage Manager Statistics                 |\n");
-    printf("+----------------------------------------------------------+\n");
-    printf("| 1) Total chunk size                 : %-12ld bytes |\n", m_chunkTotalSize);
-    printf("| 2) Used chunk size                  : %-12ld bytes |\n", m_chunkUsedSize);
-    printf("| 3) Available chunk size             : %-12ld bytes |\n", m_chunkTotalSize - m_chunkUsedSize);
-    printf("| 4) Reusable recycled memory size    : %-12ld bytes |\n", freeSpaceInMemoryMap);
-    printf("| 5) Total Allocs                     : %-12llu       |\n", totalAllocs);
-    printf("|     a) From memory chunk            : %-12llu       |\n", m_countChunkAllocs);
-    printf("|     b) From recycled memory         : %-12llu       |\n", m_countMemoryMapAllocs);
-    printf("|     c) From cache memory            : %-12llu       |\n", m_countCacheAllocs);
-    printf("| 6) Total Frees                      : %-12llu       |\n", m_countFrees);
-    printf("+----------------------------------------------------------+\n");
-}
\ No newline at end of file
+    DeallocateForDelete(ptr, size);
+}
+#endif
+#endif
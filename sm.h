@@ -1,7 +1,13 @@
 ﻿#ifndef SM_H
 #define SM_H
-#include<unordered_map>
-#include<map>
+#include<stdint.h>
+#include<stdio.h>
+#include<mutex>
+#include<atomic>
+#include<thread>
+#include<condition_variable>
+#include<type_traits>
+#include "sm_trace.h"
 
 using namespace std;
 
@@ -9,70 +15,785 @@ using namespace std;
 // number of test cases
 #define TEST
 
+// Uncomment to route the global operator new and delete through the storage manager
+//#define SM_OVERRIDE_NEW
+
 //----------------------------------------------------------------------------------------------
 // Instead of malloc, these macros should be used to allocate memory. For C++ style allocation
-// new and delete have been overriden so they will automatically use our Storage manager.
+// new and delete are overriden when SM_OVERRIDE_NEW is defined, so they will automatically use
+// our Storage manager.
 //----------------------------------------------------------------------------------------------
 #define SM_ALLOC_ARRAY(type, size)      (type *)sm.SM_alloc(size * sizeof(type))
 #define SM_ALLOC(type)                  (type *)sm.SM_alloc(sizeof(type))
+#define SM_ALLOC_ALIGNED(type, align)   (type *)sm.SM_alloc_aligned(sizeof(type), align)
+#define SM_REALLOC_ARRAY(type, ptr, size) (type *)sm.SM_realloc(ptr, size * sizeof(type))
 #define SM_DEALLOC(ptr)                 sm.SM_dealloc(ptr)
 
+//----------------------------------------------------------------------------------------------
+// Block layout. Every block starts with a header word holding the block size and two flags.
+// A free block additionally holds its free list links and repeats its size in a footer (the
+// last word of the block), which lets the following block find a free predecessor in O(1).
+// Block sizes are multiples of SM_GRANULE, so the low bits of the header are free for flags.
+// Blocks are placed so that every user pointer is aligned to at least SM_MIN_ALIGNMENT.
+//----------------------------------------------------------------------------------------------
+const size_t SM_GRANULE = 16;
+const size_t SM_MIN_ALIGNMENT = SM_GRANULE;
+const size_t SM_HEADER_SIZE = sizeof(size_t);
+const size_t SM_FREE_BIT = 1;
+const size_t SM_PREV_FREE_BIT = 2;
+const size_t SM_DEFERRED_BIT = 4;     // Freed, waiting to be coalesced
+const size_t SM_MOVABLE_BIT = 8;      // Reached through a handle, may be moved by CompactHeap
+const size_t SM_FLAG_MASK = SM_GRANULE - 1;
+const size_t SM_MIN_BLOCK_SIZE = 2 * SM_GRANULE;
+
+//----------------------------------------------------------------------------------------------
+// Recycled memory. Free blocks below SM_SMALL_BIN_LIMIT are kept in an exact size class bin per
+// granule, larger ones in a tree ordered by size.
+//----------------------------------------------------------------------------------------------
+const size_t SM_SMALL_BIN_LIMIT_LOG2 = 10;
+const size_t SM_SMALL_BIN_LIMIT = (size_t)1 << SM_SMALL_BIN_LIMIT_LOG2;
+const size_t SM_SMALL_BINS = SM_SMALL_BIN_LIMIT / SM_GRANULE;
+const size_t SM_BIN_COUNT = SM_SMALL_BINS;
+const size_t SM_BIN_WORDS = (SM_BIN_COUNT + 63) / 64;
+
+//----------------------------------------------------------------------------------------------
+// Thread caches. Blocks below SM_SMALL_BIN_LIMIT are cached per thread in the exact size 
+// classes of the small bins. At most SM_MAX_THREADS threads get a cache at the same time, any
+// further threads use the shared heap directly.
+//----------------------------------------------------------------------------------------------
+const unsigned int SM_MAX_THREADS = 256;
+
+// Storage Managers whose thread caches are flushed when a thread exits. The caches of any
+// further ones are kept for the next thread to get the slot.
+const unsigned int SM_MAX_EXIT_FLUSHES = 64;
+
+// Number of blocks moved between a thread cache and the shared heap at once, and number
+// of blocks per size class a thread may keep before flushing.
+const unsigned int SM_TCACHE_BATCH = 32;
+const unsigned int SM_TCACHE_MAX = 64;
+
+//----------------------------------------------------------------------------------------------
+// Slabs. Allocations of up to SM_SLAB_LIMIT bytes are served from slabs of SM_SLAB_SIZE bytes
+// which are cut into equal sized slots, one slab size class per SM_GRANULE. Slots have no
+// header, a per-chunk slab map tells slab memory apart from the variable sized blocks.
+//----------------------------------------------------------------------------------------------
+const size_t SM_SLAB_SIZE_LOG2 = 16;
+const size_t SM_SLAB_SIZE = (size_t)1 << SM_SLAB_SIZE_LOG2;
+const size_t SM_SLAB_LIMIT = 256;
+const size_t SM_SLAB_CLASSES = SM_SLAB_LIMIT / SM_GRANULE;
+
+//----------------------------------------------------------------------------------------------
+// Regions. A region bump allocates from blocks of the heap of SM_REGION_BLOCK_SIZE bytes or 
+// more. Its objects have no header and cannot be freed one by one, SM_region_reset frees them
+// all at once and SM_region_destroy gives the blocks back to the heap.
+//----------------------------------------------------------------------------------------------
+const size_t SM_REGION_BLOCK_SIZE = 64 * 1024;
+
+//----------------------------------------------------------------------------------------------
+// Handles. A movable allocation is reached through a handle, an index into the handle table,
+// and is moved by CompactHeap unless it is pinned. Its block keeps the handle index in its last
+// word, so compaction finds the handle of every block it moves. A handle also carries the 
+// generation of its entry, so a handle used after it was freed is recognized.
+//----------------------------------------------------------------------------------------------
+typedef uint64_t sm_handle_t;
+const sm_handle_t SM_NULL_HANDLE = 0;
+const size_t SM_HANDLE_MIN_ENTRIES = 4096;
+
+// Frees of SM_dealloc_batch which are sorted and done together under the lock
+const size_t SM_BATCH_PENDING = 128;
+
+// Deferred coalescing. Every allocation from the shared heap merges up to SM_COALESCE_SLICE 
+// queued frees, unless a background thread does it, and every free does so too once more than
+// SM_COALESCE_BACKLOG are queued. The background thread wakes up every SM_COALESCE_INTERVAL
+// and when half of the backlog is queued.
+const size_t SM_COALESCE_SLICE = 8;
+const size_t SM_COALESCE_BACKLOG = 4096;
+const unsigned int SM_COALESCE_INTERVAL = 1;  // ms
+
+// Purging. Free blocks of at least SM_PURGE_MIN_BLOCK bytes are kept on a list, oldest first,
+// until their pages are given back to the system. Frees and commits purge up to SM_PURGE_SLICE
+// of them when the free bytes threshold or the delay of sm_config_t says so, and as many as 
+// needed above the soft limit. With a delay the clock is read every SM_PURGE_TICKS frees, and
+// thread-safe heaps run a background thread which checks the delay every half of it, so that a
+// heap which is idle or only frees to the thread caches purges too.
+const size_t SM_PURGE_MIN_BLOCK = 64 * 1024;  // bytes
+const size_t SM_PURGE_SLICE = 8;
+const unsigned int SM_PURGE_TICKS = 64;
+
+// Maximum number of chunks the heap can grow to
+const unsigned int SM_MAX_CHUNKS = 1024;
+
+// Chunks are committed in steps of this size as the bump pointer advances. With
+// prefaulting a background thread keeps SM_PREFAULT_AHEAD bytes faulted in ahead of it.
+const size_t SM_COMMIT_STEP = 1024 * 1024;  // bytes
+const size_t SM_PREFAULT_AHEAD = 64 * 1024 * 1024;  // bytes
+
 //----------------------------------------------------------------------------------------------
 // Structs
 //----------------------------------------------------------------------------------------------
-typedef struct 
+// Heap configuration
+typedef struct
+{
+    size_t initialSize;     // Size of the first chunk
+    size_t growSize;        // Minimum size of every further chunk
+    size_t maxFootprint;    // Upper limit for the sum of all chunks, 0 means no limit
+    bool prefault;          // Fault in pages ahead of the bump pointer in a background thread
+    bool slabs;             // Serve allocations of up to SM_SLAB_LIMIT bytes from slabs
+    bool coalesceThread;    // Merge deferred frees in a background thread (SMDeferredCoalesce)
+    bool hugePages;         // Back the chunks with huge pages where the system allows
+    size_t purgeThreshold;  // Free bytes kept resident before purging, 0 means no threshold
+    unsigned int purgeDelay; // Milliseconds a free block stays resident, 0 means forever
+    size_t softLimit;       // Resident bytes above which free blocks are purged, 0 means no limit
+}sm_config_t;
+
+// One contiguous piece of memory reserved from the system. Only the newest chunk
+// is bump allocated from, the free blocks of all chunks share the bins. Blocks
+// never span chunks, each chunk ends its used part with its own epilogue. Pages
+// are committed as the bump pointer advances, everything from committedEnd to 
+// the end of the reservation is address space only.
+typedef struct
+{
+    char *chunkPtr;
+    char *chunkEnd;
+    char *firstBlock;
+    char *currentPtr;
+    char *dirtyEnd;             // Highest currentPtr before it was moved back, memory from
+                                // there on has never been handed out
+    char *committedEnd;
+    char *prefaultedEnd;
+    size_t totalSize;
+    size_t reservedSize;
+    size_t usedSize;
+    int pages;                  // OS_PAGES_SMALL or the kind of huge pages asked for
+    unsigned char *slabMap;     // One byte per SM_SLAB_SIZE bytes from slabMapBase, set for slabs
+    char *slabMapBase;
+}sm_chunk_t;
+
+// Start of a free block. The links live inside the free block itself, so keeping
+// a block in a bin costs no extra memory.
+typedef struct sm_freeBlock
+{
+    size_t header;
+    struct sm_freeBlock *prev;
+    struct sm_freeBlock *next;
+}sm_freeBlock_t;
+
+// Start of a free block of at least SM_SMALL_BIN_LIMIT bytes. These form a treap
+// ordered by size and address, the heap priority is derived from the address. Blocks
+// of at least SM_PURGE_MIN_BLOCK bytes are also on the purge list until purged.
+typedef struct sm_treeBlock
+{
+    size_t header;
+    struct sm_treeBlock *left;
+    struct sm_treeBlock *right;
+    struct sm_treeBlock *older;     // Purge list
+    struct sm_treeBlock *newer;
+    uint64_t freedAt;               // Milliseconds, when purging has a delay
+    size_t purgedSize;              // Bytes given back to the system
+}sm_treeBlock_t;
+
+// Recycled memory: segregated free lists of small blocks, one per size class, a
+// bitmap of the non-empty ones, and the size ordered tree of the larger blocks.
+typedef struct
+{
+    sm_freeBlock_t *bins[SM_BIN_COUNT];
+    uint64_t binBitmap[SM_BIN_WORDS];
+    sm_treeBlock_t *tree;
+}sm_freeLists_t;
+
+// Header of a slab, at the SM_SLAB_SIZE aligned start of the slab. Slots past
+// unusedPtr have never been handed out, freed slots are linked through their
+// first word. Slabs with free slots are kept in a list per size class.
+typedef struct sm_slab
+{
+    struct sm_slab *prev;
+    struct sm_slab *next;
+    void *freeList;
+    char *unusedPtr;
+    char *endPtr;
+    unsigned int slotSize;
+    unsigned int slotCount;
+    unsigned int usedCount;
+    unsigned int sizeClass;
+}sm_slab_t;
+
+// A free of SM_dealloc_batch waiting for the lock
+typedef struct
+{
+    char *ptr;                  // Slot or block
+    sm_slab_t *slab;            // Slab of a slot, nullptr for a block
+    sm_chunk_t *chunk;          // Chunk of a block
+}sm_pendingFree_t;
+
+// Start of a block of the heap owned by a region. Objects are allocated from the
+// end of this header up to endPtr.
+typedef struct sm_regionBlock
+{
+    struct sm_regionBlock *next;
+    char *endPtr;
+}sm_regionBlock_t;
+
+// Region, kept in its first block right after the block header. Objects are
+// bump allocated from currentPtr up to endPtr in the current block, the blocks
+// after it were filled before the last reset and are reused in turn. A region 
+// must only be used by one thread at a time.
+typedef struct
+{
+    sm_regionBlock_t *firstBlock;
+    sm_regionBlock_t *currentBlock;
+    char *startPtr;             // First object in the first block
+    char *currentPtr;
+    char *endPtr;
+    size_t blockSize;           // Size of further blocks
+    size_t size;                // Total size of the blocks
+}sm_region_t;
+
+// Entry of the handle table. Free entries are linked through nextFree.
+typedef struct
 {
-    size_t size;
-    bool isFree;
-}sm_metaData_t;
+    char *block;                // nullptr when the entry is free
+    uint32_t pinCount;
+    uint32_t generation;
+    uint32_t nextFree;          // Index + 1 of the next free entry, 0 for none
+}sm_handleEntry_t;
+
+// Free blocks owned by one thread. The blocks remain marked as allocated in the
+// heap, so nobody else touches them. cachedBytes is written by the owning thread
+// only and read by GetStats.
+typedef struct
+{
+    sm_freeBlock_t *lists[SM_SMALL_BINS];
+    unsigned int counts[SM_SMALL_BINS];
+    void *slabLists[SM_SLAB_CLASSES];
+    unsigned int slabCounts[SM_SLAB_CLASSES];
+    atomic<size_t> cachedBytes;
+}sm_threadCache_t;
+
+// Trace records of one thread. Only the owning thread writes, head counts the
+// records written so far, the newest SM_TRACE_RECORDS of them are kept.
+typedef struct
+{
+    atomic<uint64_t> head;
+    sm_traceRecord_t records[SM_TRACE_RECORDS];
+}sm_traceBuffer_t;
+
+//----------------------------------------------------------------------------------------------
+// Allocation tracer, see sm_trace.h. SMNoTracer takes its place when tracing is disabled.
+//----------------------------------------------------------------------------------------------
+class SMTracer
+{
+private:
+    atomic<sm_traceBuffer_t*> m_buffers[SM_MAX_THREADS];
+
+    sm_traceBuffer_t* GetBuffer(unsigned int index);
+
+public:
+    SMTracer();
+    ~SMTracer();
+    void Record(uint8_t op, uint8_t path, void *ptr, size_t size, unsigned int mergeCount = 0);
+    bool Dump(const char *fileName);
+};
+
+class SMNoTracer
+{
+public:
+    void Record(uint8_t, uint8_t, void*, size_t, unsigned int = 0) {}
+    bool Dump(const char*) { return false; }
+};
+
+// Initial size of the capture's object table
+const size_t SM_CAPTURE_MIN_OBJECTS = 65536;
+
+// Object number of a live allocation, kept in an open addressing table by address
+typedef struct
+{
+    uint64_t ptr;
+    uint32_t id;
+    uint32_t unused;
+}sm_captureEntry_t;
+
+//----------------------------------------------------------------------------------------------
+// Allocation capture, see sm_trace.h. A captured operation holds the recorder's lock from
+// before it starts until it is recorded, which puts the records in an order that can be 
+// replayed: nobody can get an address before its free is recorded. While no capture runs the
+// only cost is checking IsActive.
+//----------------------------------------------------------------------------------------------
+class SMRecorder
+{
+private:
+    atomic<bool> m_active;
+    mutex m_mutex;
+    FILE *m_file;
+    uint64_t m_startTime;
+    sm_captureFileHeader_t m_header;
+    sm_captureRecord_t *m_buffer;
+    size_t m_bufferCount;
+    sm_captureEntry_t *m_objects;
+    size_t m_objectCapacity;
+    size_t m_objectCount;
+
+    static bool & InCapture();
+    void Append(uint8_t op, uint32_t id, size_t size, uint8_t alignmentLog2 = 0);
+    void Flush();
+    void ReleaseMemory();
+    bool AddObject(void *ptr, uint32_t id);
+    uint32_t RemoveObject(void *ptr);
+
+public:
+    SMRecorder();
+    ~SMRecorder();
+    bool Start(const char *fileName);
+    void Stop();
+    bool IsActive() const { return m_active.load(memory_order_relaxed) && !InCapture(); }
+    void lock();
+    void unlock();
+    void RecordAlloc(uint8_t op, void *ptr, size_t size, size_t alignment = 0);
+    void RecordRealloc(void *oldPtr, void *newPtr, size_t size);
+    void RecordFree(void *ptr);
+    void LockForFork();
+    void UnlockAfterFork(bool inChild);
+};
+
+//----------------------------------------------------------------------------------------------
+// Statistics. Everything in sm_stats_t is kept up to date as the heap changes, so taking it
+// costs no heap traversal. Free blocks are counted in classes of powers of two: class k holds
+// the blocks of 2^k up to 2^(k+1) - 1 bytes. Latencies are counted in buckets of powers of two
+// as well, bucket k holds the operations which took less than 2^k nanoseconds but at least
+// half of that.
+//----------------------------------------------------------------------------------------------
+const size_t SM_SIZE_CLASSES = 64;
+const size_t SM_LATENCY_BUCKETS = 32;
+
+// Formats of ExportStats
+const int SM_STATS_JSON = 0;
+const int SM_STATS_PROMETHEUS = 1;
+
+typedef struct
+{
+    size_t heapSize;                // Reserved for the chunks
+    size_t committedSize;
+    size_t hugePageSize;            // Committed in chunks asked to get huge pages
+    size_t residentSize;            // In physical memory, committed - purged
+    size_t purgedSize;              // Free, given back to the system
+    size_t usedSize;                // Taken from the chunks, in use or free
+    size_t freeSize;                // Recycled blocks ready for reuse
+    size_t freeBlockCount;
+    size_t largestFreeBlock;
+    double fragmentation;           // 1 - largest free block / free size
+    size_t threadCacheSize;
+    size_t slabSize;
+    size_t slabUsedSize;
+    size_t regionSize;              // Held by regions
+    size_t regionCount;
+    size_t deferredSize;            // Freed, waiting to be coalesced
+    size_t deferredBlockCount;
+    unsigned int chunkCount;
+    size_t slabCount;
+    unsigned long long countAllocs;
+    unsigned long long countChunkAllocs;
+    unsigned long long countMemoryMapAllocs;
+    unsigned long long countTreeAllocs;
+    unsigned long long countSlabAllocs;
+    unsigned long long countThreadCacheAllocs;
+    unsigned long long countFrees;
+    unsigned long long countInPlaceReallocs;
+    unsigned long long freeBlocksBySize[SM_SIZE_CLASSES];
+    bool hasLatency;                // Whether the stats policy measures latencies
+    unsigned long long allocLatency[SM_LATENCY_BUCKETS];
+    unsigned long long allocLatencyTotalNs;
+    unsigned long long deallocLatency[SM_LATENCY_BUCKETS];
+    unsigned long long deallocLatencyTotalNs;
+}sm_stats_t;
+
+//----------------------------------------------------------------------------------------------
+// Allocation counters and latency histograms, sharded by thread slot. Every thread counts in a
+// shard of its own, which it alone writes, so counting is a plain store to a cache line no 
+// other thread writes. Threads without a slot share one more shard and count with atomic adds.
+// Collect adds the shards up without stopping anybody. It reads all frees before any
+// allocation, and a free is always counted after its allocation, so a snapshot never shows
+// more frees than allocations. SMNoCounters takes its place when counting is disabled.
+//----------------------------------------------------------------------------------------------
+// Counters
+const unsigned int SM_COUNT_CHUNK_ALLOCS = 0;
+const unsigned int SM_COUNT_MAP_ALLOCS = 1;
+const unsigned int SM_COUNT_TREE_ALLOCS = 2;
+const unsigned int SM_COUNT_SLAB_ALLOCS = 3;
+const unsigned int SM_COUNT_CACHE_ALLOCS = 4;
+const unsigned int SM_COUNT_FREES = 5;
+const unsigned int SM_COUNT_IN_PLACE_REALLOCS = 6;
+const unsigned int SM_COUNTERS = 7;
+
+// Operations timed into latency histograms
+const unsigned int SM_LATENCY_ALLOC = 0;
+const unsigned int SM_LATENCY_DEALLOC = 1;
+const unsigned int SM_LATENCY_OPS = 2;
+
+typedef struct
+{
+    alignas(64) atomic<unsigned long long> counts[SM_COUNTERS];
+    atomic<unsigned long long> latency[SM_LATENCY_OPS][SM_LATENCY_BUCKETS];
+    atomic<unsigned long long> latencyTotalNs[SM_LATENCY_OPS];
+}sm_counterShard_t;
+
+class SMCounters
+{
+private:
+    atomic<sm_counterShard_t*> m_shards[SM_MAX_THREADS];
+    sm_counterShard_t m_sharedShard;
+
+    sm_counterShard_t* GetShard(unsigned int index);
+    static void Add(atomic<unsigned long long> & counter, unsigned long long value, bool shared);
+
+public:
+    SMCounters();
+    ~SMCounters();
+    void Count(unsigned int counter, unsigned long long value = 1);
+    void CountLatency(unsigned int op, uint64_t latency);
+    void Collect(sm_stats_t & stats);
+};
+
+class SMNoCounters
+{
+public:
+    void Count(unsigned int, unsigned long long = 1) {}
+    void CountLatency(unsigned int, uint64_t) {}
+    void Collect(sm_stats_t &) {}
+};
+
+// Measures the time from its construction to its destruction into a latency histogram
+template<class Counters, bool ENABLED>
+class SMLatencyTimer
+{
+public:
+    SMLatencyTimer(Counters &, unsigned int) {}
+};
+
+template<class Counters>
+class SMLatencyTimer<Counters, true>
+{
+private:
+    Counters & m_counters;
+    unsigned int m_op;
+    uint64_t m_start;
+
+public:
+    SMLatencyTimer(Counters & counters, unsigned int op);
+    ~SMLatencyTimer();
+};
+
+//----------------------------------------------------------------------------------------------
+// Policies. A StorageManager is put together at compile time from one policy of each kind, 
+// the constants they define are known to the compiler, so whatever a policy switches off is 
+// not compiled in.
+//----------------------------------------------------------------------------------------------
+// Fit policies choose the recycled block an allocation is cut from
+struct SMBestFit
+{
+    static char* FindFreeBlock(const sm_freeLists_t & freeLists, size_t size);
+};
+
+struct SMWorstFit
+{
+    static char* FindFreeBlock(const sm_freeLists_t & freeLists, size_t size);
+};
+
+// Coalescing policies decide when freed blocks are merged with their free neighbours. 
+// SMCoalesceOnFree merges them right away. SMDeferredCoalesce queues them and merges them in
+// bounded slices, on allocation or in a background thread, and all at once before the heap
+// grows. With SMNoCoalesce, DefragmentMemoryMap has to be called to merge them.
+struct SMCoalesceOnFree
+{
+    static const bool COALESCE_ON_FREE = true;
+    static const bool DEFERRED = false;
+};
+
+struct SMDeferredCoalesce
+{
+    static const bool COALESCE_ON_FREE = false;
+    static const bool DEFERRED = true;
+};
+
+struct SMNoCoalesce
+{
+    static const bool COALESCE_ON_FREE = false;
+    static const bool DEFERRED = false;
+};
+
+// Lock policies guard the shared heap. SMNoLock is for heaps used by a single thread,
+// SMThreadCacheLock additionally gives every thread a cache of small blocks.
+class SMNoLock
+{
+public:
+    static const bool THREAD_SAFE = false;
+    static const bool THREAD_CACHE = false;
+
+    void lock() {}
+    void unlock() {}
+};
+
+class SMMutexLock
+{
+private:
+    mutex m_mutex;
+
+public:
+    static const bool THREAD_SAFE = true;
+    static const bool THREAD_CACHE = false;
+
+    void lock() { m_mutex.lock(); }
+    void unlock() { m_mutex.unlock(); }
+};
+
+class SMThreadCacheLock : public SMMutexLock
+{
+public:
+    static const bool THREAD_CACHE = true;
+};
+
+// Stats policies: COUNT keeps the allocation counters, REPORT prints the heap size on
+// initialization, LATENCY keeps latency histograms of SM_alloc and SM_dealloc, TRACE records
+// every operation in the binary trace and DEBUG prints it.
+struct SMNoStats
+{
+    static const bool COUNT = false;
+    static const bool REPORT = false;
+    static const bool LATENCY = false;
+    static const bool TRACE = false;
+    static const bool DEBUG = false;
+};
+
+struct SMStats
+{
+    static const bool COUNT = true;
+    static const bool REPORT = true;
+    static const bool LATENCY = false;
+    static const bool TRACE = false;
+    static const bool DEBUG = false;
+};
+
+struct SMLatencyStats
+{
+    static const bool COUNT = true;
+    static const bool REPORT = true;
+    static const bool LATENCY = true;
+    static const bool TRACE = false;
+    static const bool DEBUG = false;
+};
+
+struct SMTraceStats
+{
+    static const bool COUNT = true;
+    static const bool REPORT = true;
+    static const bool LATENCY = false;
+    static const bool TRACE = true;
+    static const bool DEBUG = false;
+};
+
+struct SMDebugStats
+{
+    static const bool COUNT = true;
+    static const bool REPORT = true;
+    static const bool LATENCY = false;
+    static const bool TRACE = true;
+    static const bool DEBUG = true;
+};
 
 //----------------------------------------------------------------------------------------------
 // StorageManager class
 //----------------------------------------------------------------------------------------------
-class StorageManager
+template<class FitPolicy, class CoalescePolicy, class LockPolicy, class StatsPolicy>
+class BasicStorageManager
 {
 private:
-    char *m_chunkPtr;
-    char *m_currentPtr;
+    sm_config_t m_config;
+
+    // Chunks in creation order, the last one is bump allocated from
+    sm_chunk_t m_chunks[SM_MAX_CHUNKS];
+    unsigned int m_chunkCount;
+    sm_chunk_t *m_newestChunk;
     size_t m_chunkTotalSize;
     size_t m_chunkUsedSize;
-    unsigned long long m_countChunkAllocs;
-    unsigned long long m_countMemoryMapAllocs;
-    unsigned long long m_countCacheAllocs;
-    unsigned long long m_countFrees;
-    map<char *, sm_metaData_t> m_memoryMap;
+    size_t m_chunkCommittedSize;
+    size_t m_hugeCommittedSize;
+
+    // Chunks sorted by address for FindChunk. Lock free readers use the version
+    // as a sequence lock, it is odd while the table is being changed.
+    atomic<sm_chunk_t*> m_sortedChunks[SM_MAX_CHUNKS];
+    atomic<unsigned int> m_sortedChunkCount;
+    atomic<unsigned int> m_chunkTableVersion;
+
+    // Recycled blocks, with their total size and count by size class
+    sm_freeLists_t m_freeLists;
+    size_t m_freeSize;
+    size_t m_freeBlockCount;
+    unsigned long long m_freeBlocksBySize[SM_SIZE_CLASSES];
+
+    // Slabs with free slots, one list per slab size class
+    sm_slab_t *m_slabs[SM_SLAB_CLASSES];
+    size_t m_slabCount;
+    size_t m_slabUsedSize;
+
+    // Memory held by regions
+    size_t m_regionSize;
+    size_t m_regionCount;
+
+    // Handle table of the movable allocations
+    sm_handleEntry_t *m_handles;
+    size_t m_handleCapacity;
+    size_t m_handleEnd;         // Entries ever used
+    uint32_t m_freeHandle;      // Index + 1 of the first free entry, 0 for none
+
+    // Frees waiting to be coalesced, oldest first
+    sm_freeBlock_t *m_deferredHead;
+    sm_freeBlock_t *m_deferredTail;
+    size_t m_deferredSize;
+    size_t m_deferredCount;
+
+    // Large free blocks not purged yet, oldest first, and the bytes purged from free blocks.
+    // The time is the last one read, in milliseconds.
+    sm_treeBlock_t *m_purgeOldest;
+    sm_treeBlock_t *m_purgeNewest;
+    size_t m_purgedSize;
+    uint64_t m_purgeTime;
+    unsigned int m_purgeTicks;
+
+    // Guards everything above
+    LockPolicy m_lock;
 
-    // Cache memory
-    char* m_cacheBlock;
-    size_t m_cacheBlockSize;
+    // Thread caches, indexed by thread slot
+    sm_threadCache_t *m_threadCaches[SM_MAX_THREADS];
+
+    // Allocation trace, and where the last block allocated under the lock came from
+    typename conditional<StatsPolicy::TRACE, SMTracer, SMNoTracer>::type m_tracer;
+    uint8_t m_lastPath;
+
+    // Allocation capture for replay, started and stopped at run time
+    SMRecorder m_recorder;
+
+    // Allocation counters and latency histograms, sharded by thread
+    typename conditional<StatsPolicy::COUNT, SMCounters, SMNoCounters>::type m_counters;
+
+    // Background prefaulting
+    thread m_prefaultThread;
+    mutex m_prefaultMutex;
+    condition_variable m_prefaultCondition;
+    bool m_prefaultStop;
+
+    // Background coalescing
+    thread m_coalesceThread;
+    mutex m_coalesceMutex;
+    condition_variable m_coalesceCondition;
+    bool m_coalesceStop;
+
+    // Background purging
+    thread m_purgeThread;
+    mutex m_purgeMutex;
+    condition_variable m_purgeCondition;
+    bool m_purgeStop;
+
+    void LinkFreeBlock(char *block);
+    void UnlinkFreeBlock(char *block);
+    bool AddChunk(size_t minSize);
+    bool CommitChunk(sm_chunk_t *chunk, char *end);
+    void PrefaultThread();
+    void CoalesceThread();
+    void PurgeThread();
+    size_t CoalesceDeferred(size_t limit);
+    size_t PurgeIfNeeded();
+    size_t PurgeBlock(sm_treeBlock_t *block);
+    sm_chunk_t* FindChunk(char *ptr);
+    sm_chunk_t* ValidateBlock(char *block);
+    char* AllocateBlock(size_t blockSize, bool countAlloc, bool *isFresh = nullptr, bool grow = true);
+    char* AllocateAlignedBlock(size_t blockSize, size_t alignment, bool countAlloc);
+    void ShrinkBlock(char *block, size_t size);
+    void FreeBlock(char *block, bool countFree);
+    sm_threadCache_t* GetThreadCache();
+    void RefillThreadCache(sm_threadCache_t *cache, size_t blockSize);
+    void FlushThreadCache(sm_threadCache_t *cache, size_t sizeClass, unsigned int count);
+    void ReturnCachedBlocks(sm_threadCache_t *cache, size_t sizeClass, unsigned int count);
+    sm_slab_t* FindSlab(void *ptr);
+    sm_slab_t* CreateSlab(size_t sizeClass);
+    void* AllocateSlot(size_t sizeClass);
+    void FreeSlot(sm_slab_t *slab, void *ptr);
+    void RefillSlabCache(sm_threadCache_t *cache, size_t sizeClass);
+    void FlushSlabCache(sm_threadCache_t *cache, size_t sizeClass, unsigned int count);
+    void ReturnCachedSlots(sm_threadCache_t *cache, size_t sizeClass, unsigned int count);
+    size_t CarveBlocks(size_t blockSize, size_t size, size_t count, void **out);
+    void FreePending(sm_pendingFree_t *pending, size_t count);
+    bool IsCacheableBlock(char *block);
+    void DeallocateBlock(char *block, sm_chunk_t *chunk);
+    sm_regionBlock_t* AddRegionBlock(size_t minSize);
+    void* GrowRegion(sm_region_t *region, size_t size, size_t alignment);
+    sm_handleEntry_t* FindHandle(sm_handle_t handle);
+    bool GrowHandleTable();
+    void CloseGap(sm_chunk_t & chunk, char *gap, size_t gapSize);
+    void GetHeapStats(sm_stats_t & stats);
+    static void FlushExitingThread(void *owner, unsigned int index);
 
 public:
-    StorageManager(int size);
-    ~StorageManager();
+    BasicStorageManager(size_t size);
+    BasicStorageManager(const sm_config_t & config);
+    ~BasicStorageManager();
     bool InitStorageManager(size_t size);
     void *SM_alloc(size_t size);
+    void *SM_alloc_aligned(size_t size, size_t alignment);
+    void *SM_calloc(size_t count, size_t size);
+    void *SM_realloc(void *ptr, size_t size);
     void SM_dealloc(void *ptr);
+    void SM_dealloc(void *ptr, size_t size);
+    size_t SM_alloc_batch(size_t count, size_t size, void **out);
+    void SM_dealloc_batch(void **ptrs, size_t count);
+    size_t SM_usable_size(void *ptr);
+    bool OwnsPointer(void *ptr);
+    sm_region_t* SM_region_create(size_t blockSize = SM_REGION_BLOCK_SIZE);
+    void* SM_region_alloc(sm_region_t *region, size_t size, size_t alignment = SM_MIN_ALIGNMENT);
+    void SM_region_reset(sm_region_t *region);
+    void SM_region_destroy(sm_region_t *region);
+    sm_handle_t SM_handle_alloc(size_t size);
+    void SM_handle_dealloc(sm_handle_t handle);
+    void* SM_handle_pin(sm_handle_t handle);
+    void SM_handle_unpin(sm_handle_t handle);
+    void* SM_handle_resolve(sm_handle_t handle);
+    size_t CompactHeap();
+    size_t PurgeMemory();
+    void LockForFork();
+    void UnlockAfterFork(bool inChild);
     char* FindNextFreeSpaceInMemoryMap(char *ptr);
     char* FindFreeSpaceInMemoryMap();
     size_t FindFreeSpaceSizeInMemoryMap();
-    char* GetMemoryFromMap(size_t size);
+    char* GetMemoryFromMap(size_t size, bool countAlloc = true);
     int DefragmentMemoryMap();
-    int HandleFragmentedMemory(char *ptr, sm_metaData_t & metaData, char *nextOccupiedBlock);
-    char* FetchMemoryIfAvailable(const size_t size, char *ptrToCheck, sm_metaData_t & metaData);
+    char* HandleFragmentedMemory(char *block, int & mergeCount);
+    char* FetchMemoryIfAvailable(const size_t size, char *blockToCheck);
     void DisplayMemoryStats();
     void DisplayMemoryMapDetails();
-    void DisplayCacheMemoryDetails();
+    void DisplayLargestFreeBlock();
+    bool DumpTrace(const char *fileName);
+    bool StartCapture(const char *fileName);
+    void StopCapture();
+    size_t GetFootprint();
+    void GetStats(sm_stats_t & stats);
+    size_t MeasureResidentSize();
+    size_t MeasureHugePageSize();
+    size_t ExportStats(char *buffer, size_t size, int format);
 };
 
 
+// The Storage Manager used by the global instance and the allocation macros
+#if defined(TEST)
+typedef BasicStorageManager<SMBestFit, SMCoalesceOnFree, SMMutexLock, SMDebugStats> StorageManager;
+#elif defined(SM_PRELOAD)
+typedef BasicStorageManager<SMBestFit, SMCoalesceOnFree, SMThreadCacheLock, SMNoStats> StorageManager;
+#else
+typedef BasicStorageManager<SMBestFit, SMCoalesceOnFree, SMThreadCacheLock, SMStats> StorageManager;
+#endif
+
 //----------------------------------------------------------------------------------------------
 // Functions
 //----------------------------------------------------------------------------------------------
-// Not allowing new and delete override for now
-//void * operator new (size_t size);
-//void * operator new[](size_t size);
-//void operator delete (void* ptr);
-//void operator delete[] (void* ptr);
+StorageManager* SM_GetInstance();
+
+#include "sm_impl.h"
 
 
 #endif
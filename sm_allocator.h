@@ -0,0 +1,148 @@
+#ifndef SM_ALLOCATOR_H
+#define SM_ALLOCATOR_H
+#include "sm.h"
+#include<new>
+#include<type_traits>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include<memory_resource>
+#define SM_HAS_MEMORY_RESOURCE
+#endif
+
+//----------------------------------------------------------------------------------------------
+// Adapters which let standard containers allocate from a StorageManager. SMAllocator<T> is a
+// standard allocator for the classic containers, SMMemoryResource plugs into the std::pmr ones.
+// Both default to the global Storage Manager and ask for the alignment of the stored type when
+// it is larger than SM_MIN_ALIGNMENT.
+//----------------------------------------------------------------------------------------------
+template<class T>
+class SMAllocator
+{
+private:
+    StorageManager *m_storageManager;
+
+public:
+    typedef T value_type;
+    typedef true_type propagate_on_container_copy_assignment;
+    typedef true_type propagate_on_container_move_assignment;
+    typedef true_type propagate_on_container_swap;
+
+    SMAllocator() noexcept : m_storageManager(SM_GetInstance())
+    {
+    }
+
+    explicit SMAllocator(StorageManager & storageManager) noexcept : m_storageManager(&storageManager)
+    {
+    }
+
+    template<class U>
+    SMAllocator(const SMAllocator<U> & other) noexcept : m_storageManager(other.GetStorageManager())
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        if (count > (size_t)-1 / sizeof(T))
+        {
+            throw bad_array_new_length();
+        }
+
+        size_t size = (count) ? count * sizeof(T) : 1;
+        void *ptr = (alignof(T) > SM_MIN_ALIGNMENT) ? m_storageManager->SM_alloc_aligned(size, alignof(T))
+                                                   : m_storageManager->SM_alloc(size);
+        if (ptr == nullptr)
+        {
+            throw bad_alloc();
+        }
+
+        return (T*)ptr;
+    }
+
+    void deallocate(T *ptr, size_t count) noexcept
+    {
+        m_storageManager->SM_dealloc(ptr, count * sizeof(T));
+    }
+
+    StorageManager* GetStorageManager() const noexcept
+    {
+        return m_storageManager;
+    }
+};
+
+template<class T, class U>
+bool operator==(const SMAllocator<T> & a, const SMAllocator<U> & b) noexcept
+{
+    return a.GetStorageManager() == b.GetStorageManager();
+}
+
+template<class T, class U>
+bool operator!=(const SMAllocator<T> & a, const SMAllocator<U> & b) noexcept
+{
+    return a.GetStorageManager() != b.GetStorageManager();
+}
+
+#ifdef SM_HAS_MEMORY_RESOURCE
+class SMMemoryResource : public pmr::memory_resource
+{
+private:
+    StorageManager *m_storageManager;
+
+public:
+    SMMemoryResource() noexcept : m_storageManager(SM_GetInstance())
+    {
+    }
+
+    explicit SMMemoryResource(StorageManager & storageManager) noexcept : m_storageManager(&storageManager)
+    {
+    }
+
+    StorageManager* GetStorageManager() const noexcept
+    {
+        return m_storageManager;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (bytes == 0)
+        {
+            bytes = 1;
+        }
+
+        void *ptr = (alignment > SM_MIN_ALIGNMENT) ? m_storageManager->SM_alloc_aligned(bytes, alignment)
+                                                   : m_storageManager->SM_alloc(bytes);
+        if (ptr == nullptr)
+        {
+            throw bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, size_t bytes, size_t) override
+    {
+        m_storageManager->SM_dealloc(ptr, bytes);
+    }
+
+    bool do_is_equal(const pmr::memory_resource & other) const noexcept override
+    {
+        const SMMemoryResource *resource = dynamic_cast<const SMMemoryResource*>(&other);
+        return resource && resource->m_storageManager == m_storageManager;
+    }
+};
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_GetMemoryResource
+//
+// @description             : Memory resource of the global Storage Manager, e.g. for
+//                            pmr::set_default_resource.
+//
+// @returns                 : The memory resource
+//----------------------------------------------------------------------------------------------
+inline SMMemoryResource* SM_GetMemoryResource()
+{
+    static SMMemoryResource resource;
+    return &resource;
+}
+#endif
+
+#endif
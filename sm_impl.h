@@ -0,0 +1,5367 @@
+#ifndef SM_IMPL_H
+#define SM_IMPL_H
+#include "sm_os.h"
+#include<iostream> 
+#include<stdlib.h> 
+#include<string.h>
+#include<stdio.h>
+#include<stdarg.h>
+#include<chrono>
+#include<new>
+#include<algorithm>
+#ifdef _MSC_VER
+#include<intrin.h>
+#endif
+
+//----------------------------------------------------------------------------------------------
+// Implementation of BasicStorageManager, included at the end of sm.h. Everything here is a 
+// template or inline, so each policy combination is compiled with its hot paths inlined and
+// the code of disabled features removed.
+//----------------------------------------------------------------------------------------------
+#define SM_TEMPLATE template<class FitPolicy, class CoalescePolicy, class LockPolicy, class StatsPolicy>
+#define SM_CLASS BasicStorageManager<FitPolicy, CoalescePolicy, LockPolicy, StatsPolicy>
+
+//----------------------------------------------------------------------------------------------
+// Thread slots. Every thread gets a small index which selects its thread cache in each 
+// StorageManager. When the thread exits, its thread caches are flushed and the index is given
+// back to be handed to a later thread. What the thread allocates or frees after that, from
+// other thread local destructors, goes to the shared heap. Slots are managed in sm.cpp.
+//----------------------------------------------------------------------------------------------
+class ThreadSlot
+{
+public:
+    unsigned int index;
+
+    ThreadSlot();
+    ~ThreadSlot();
+};
+
+inline unsigned int GetThreadSlot()
+{
+    static thread_local ThreadSlot slot;
+    return slot.index;
+}
+
+void LockThreadSlots();
+void UnlockThreadSlots(bool inChild);
+
+// Called with the owner and the slot of an exiting thread, see SM_MAX_EXIT_FLUSHES
+typedef void (*sm_threadExitFlush_t)(void *owner, unsigned int index);
+bool AddThreadExitFlush(void *owner, sm_threadExitFlush_t flush);
+void RemoveThreadExitFlush(void *owner);
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMTracer
+//
+// @description             : Constructor. Trace buffers are created by the threads on their
+//                            first record.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline SMTracer::SMTracer()
+{
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        m_buffers[i].store(nullptr, memory_order_relaxed);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMTracer
+//
+// @description             : Destructor
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline SMTracer::~SMTracer()
+{
+    size_t pageSize = OsGetPageSize();
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        sm_traceBuffer_t *buffer = m_buffers[i].load(memory_order_relaxed);
+        if (buffer)
+        {
+            OsReleaseMemory((char*)buffer, (sizeof(sm_traceBuffer_t) + pageSize - 1) & ~(pageSize - 1));
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetBuffer
+//
+// @description             : Returns the trace buffer of a thread slot, creating it on first 
+//                            use. Only the thread owning the slot calls this. The memory comes
+//                            from the system, tracing must not change the heap it looks at.
+//
+// @param index             : Thread slot
+//
+// @returns                 : Trace buffer, nullptr if the system is out of memory.
+//----------------------------------------------------------------------------------------------
+inline sm_traceBuffer_t* SMTracer::GetBuffer(unsigned int index)
+{
+    sm_traceBuffer_t *buffer = m_buffers[index].load(memory_order_relaxed);
+    if (buffer == nullptr)
+    {
+        size_t pageSize = OsGetPageSize();
+        size_t size = (sizeof(sm_traceBuffer_t) + pageSize - 1) & ~(pageSize - 1);
+        char *memory = OsReserveMemory(size);
+        if (memory == nullptr)
+        {
+            return nullptr;
+        }
+
+        if (!OsCommitMemory(memory, size))
+        {
+            OsReleaseMemory(memory, size);
+            return nullptr;
+        }
+
+        buffer = (sm_traceBuffer_t*)memory;
+        buffer->head.store(0, memory_order_relaxed);
+        m_buffers[index].store(buffer, memory_order_release);
+    }
+
+    return buffer;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Record
+//
+// @description             : Appends a record to the calling thread's trace buffer. Takes no
+//                            lock, the buffer belongs to the thread.
+//
+// @param op                : Operation, SM_TRACE_ALLOC etc.
+// @param path              : Where the memory came from or went to, SM_TRACE_PATH_CHUNK etc.
+// @param ptr               : User pointer
+// @param size              : Size asked for, or the block size for frees
+// @param mergeCount        : Number of free blocks merged with a freed block
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMTracer::Record(uint8_t op, uint8_t path, void *ptr, size_t size, unsigned int mergeCount)
+{
+    unsigned int index = GetThreadSlot();
+    if (index >= SM_MAX_THREADS)
+    {
+        return;
+    }
+
+    sm_traceBuffer_t *buffer = GetBuffer(index);
+    if (buffer == nullptr)
+    {
+        return;
+    }
+
+    uint64_t head = buffer->head.load(memory_order_relaxed);
+    sm_traceRecord_t & record = buffer->records[head % SM_TRACE_RECORDS];
+    record.timestamp = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    record.ptr = (uint64_t)(uintptr_t)ptr;
+    record.size = size;
+    record.thread = (uint16_t)index;
+    record.op = op;
+    record.path = path;
+    record.mergeCount = mergeCount;
+    buffer->head.store(head + 1, memory_order_release);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Dump
+//
+// @description             : Writes the records of all threads to a file. Threads may go on
+//                            recording meanwhile, but their records are only exact if they are
+//                            idle during the dump.
+//
+// @param fileName          : File to write
+//
+// @returns                 : true on success, false if the file could not be written.
+//----------------------------------------------------------------------------------------------
+inline bool SMTracer::Dump(const char *fileName)
+{
+    FILE *file = fopen(fileName, "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    uint64_t heads[SM_MAX_THREADS];
+    sm_traceFileHeader_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SM_TRACE_MAGIC;
+    header.version = SM_TRACE_VERSION;
+    header.recordSize = sizeof(sm_traceRecord_t);
+
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        sm_traceBuffer_t *buffer = m_buffers[i].load(memory_order_acquire);
+        heads[i] = (buffer) ? buffer->head.load(memory_order_acquire) : 0;
+        if (heads[i])
+        {
+            uint64_t kept = (heads[i] < SM_TRACE_RECORDS) ? heads[i] : SM_TRACE_RECORDS;
+            header.threadCount++;
+            header.recordCount += kept;
+            header.lostCount += heads[i] - kept;
+        }
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        if (heads[i] == 0)
+        {
+            continue;
+        }
+
+        // Oldest record first, the ring may wrap around once
+        sm_traceBuffer_t *buffer = m_buffers[i].load(memory_order_relaxed);
+        uint64_t kept = (heads[i] < SM_TRACE_RECORDS) ? heads[i] : SM_TRACE_RECORDS;
+        size_t start = (size_t)((heads[i] - kept) % SM_TRACE_RECORDS);
+        size_t firstPart = (start + kept > SM_TRACE_RECORDS) ? SM_TRACE_RECORDS - start : (size_t)kept;
+        fwrite(&buffer->records[start], sizeof(sm_traceRecord_t), firstPart, file);
+        fwrite(&buffer->records[0], sizeof(sm_traceRecord_t), (size_t)kept - firstPart, file);
+    }
+
+    bool success = !ferror(file);
+    fclose(file);
+    return success;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMRecorder
+//
+// @description             : Constructor
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline SMRecorder::SMRecorder() : m_active(false), m_file(nullptr), m_startTime(0), m_buffer(nullptr),
+                                  m_bufferCount(0), m_objects(nullptr), m_objectCapacity(0), m_objectCount(0)
+{
+    memset(&m_header, 0, sizeof(m_header));
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMRecorder
+//
+// @description             : Destructor. Completes a capture still running.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline SMRecorder::~SMRecorder()
+{
+    Stop();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : InCapture
+//
+// @description             : Set while the calling thread is inside a captured operation, so
+//                            that the operations it is made of are not recorded again.
+//
+// @returns                 : The flag of the calling thread
+//----------------------------------------------------------------------------------------------
+inline bool & SMRecorder::InCapture()
+{
+    static thread_local bool inCapture = false;
+    return inCapture;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Start
+//
+// @description             : Starts writing every allocation, reallocation and free to a file.
+//                            The buffer and the object table come from the system, capturing
+//                            must not change the heap it looks at. The file is unbuffered, so
+//                            writing it never allocates.
+//
+// @param fileName          : File to write
+//
+// @returns                 : true on success, false if a capture is running already or the
+//                            file could not be created.
+//----------------------------------------------------------------------------------------------
+inline bool SMRecorder::Start(const char *fileName)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_file)
+    {
+        return false;
+    }
+
+    size_t pageSize = OsGetPageSize();
+    size_t bufferSize = (SM_CAPTURE_BUFFER_RECORDS * sizeof(sm_captureRecord_t) + pageSize - 1) & ~(pageSize - 1);
+    m_buffer = (sm_captureRecord_t*)OsReserveMemory(bufferSize);
+    if (m_buffer == nullptr || !OsCommitMemory((char*)m_buffer, bufferSize))
+    {
+        ReleaseMemory();
+        return false;
+    }
+
+    m_file = fopen(fileName, "wb");
+    if (m_file == nullptr)
+    {
+        ReleaseMemory();
+        return false;
+    }
+
+    setvbuf(m_file, nullptr, _IONBF, 0);
+
+    memset(&m_header, 0, sizeof(m_header));
+    m_header.magic = SM_CAPTURE_MAGIC;
+    m_header.version = SM_CAPTURE_VERSION;
+    m_header.recordSize = sizeof(sm_captureRecord_t);
+    fwrite(&m_header, sizeof(m_header), 1, m_file);
+
+    m_bufferCount = 0;
+    m_startTime = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    m_active.store(true, memory_order_release);
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Stop
+//
+// @description             : Ends the capture. Operations which are running meanwhile are
+//                            recorded or not, but never half.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::Stop()
+{
+    m_active.store(false, memory_order_relaxed);
+
+    lock_guard<mutex> lock(m_mutex);
+    if (m_file == nullptr)
+    {
+        return;
+    }
+
+    Flush();
+    fseek(m_file, 0, SEEK_SET);
+    fwrite(&m_header, sizeof(m_header), 1, m_file);
+    fclose(m_file);
+    m_file = nullptr;
+    ReleaseMemory();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : lock
+//
+// @description             : Starts a captured operation. Operations of other threads wait
+//                            until it is recorded.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::lock()
+{
+    m_mutex.lock();
+    InCapture() = true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : unlock
+//
+// @description             : Ends a captured operation
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::unlock()
+{
+    InCapture() = false;
+    m_mutex.unlock();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RecordAlloc
+//
+// @description             : Records an allocation as a new object. Called with the lock held.
+//
+// @param op                : SM_TRACE_ALLOC, SM_TRACE_ALLOC_ALIGNED or SM_TRACE_CALLOC
+// @param ptr               : Memory allocated, nullptr if the allocation failed.
+// @param size              : Size asked for
+// @param alignment         : Alignment asked for, SM_TRACE_ALLOC_ALIGNED only.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::RecordAlloc(uint8_t op, void *ptr, size_t size, size_t alignment)
+{
+    if (m_file == nullptr || ptr == nullptr)
+    {
+        return;
+    }
+
+    uint8_t alignmentLog2 = 0;
+    while (alignment > 1)
+    {
+        alignment >>= 1;
+        alignmentLog2++;
+    }
+
+    uint32_t id = ++m_header.objectCount;
+    AddObject(ptr, id);
+    Append(op, id, size, alignmentLog2);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RecordRealloc
+//
+// @description             : Records a reallocation, the object keeps its number. Memory
+//                            allocated before the capture becomes a new object. Called with
+//                            the lock held.
+//
+// @param oldPtr            : Memory before the reallocation
+// @param newPtr            : Memory after the reallocation, nullptr if it failed.
+// @param size              : New size
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::RecordRealloc(void *oldPtr, void *newPtr, size_t size)
+{
+    if (m_file == nullptr || newPtr == nullptr)
+    {
+        return;
+    }
+
+    uint32_t id = RemoveObject(oldPtr);
+    if (id == 0)
+    {
+        RecordAlloc(SM_TRACE_ALLOC, newPtr, size);
+        return;
+    }
+
+    AddObject(newPtr, id);
+    Append(SM_TRACE_REALLOC, id, size);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RecordFree
+//
+// @description             : Records a free. Must be called before the memory is given back,
+//                            with the lock held.
+//
+// @param ptr               : Memory to be freed
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::RecordFree(void *ptr)
+{
+    if (m_file == nullptr || ptr == nullptr)
+    {
+        return;
+    }
+
+    uint32_t id = RemoveObject(ptr);
+    if (id == 0)
+    {
+        m_header.ignoredCount++;
+        return;
+    }
+
+    Append(SM_TRACE_FREE, id, 0);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Append
+//
+// @description             : Adds a record to the buffer, writing the buffer when it is full.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::Append(uint8_t op, uint32_t id, size_t size, uint8_t alignmentLog2)
+{
+    sm_captureRecord_t & record = m_buffer[m_bufferCount++];
+    record.timestamp = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count() - m_startTime;
+    record.size = size;
+    record.id = id;
+    record.thread = (uint16_t)GetThreadSlot();
+    record.op = op;
+    record.alignmentLog2 = alignmentLog2;
+    m_header.recordCount++;
+
+    if (m_bufferCount == SM_CAPTURE_BUFFER_RECORDS)
+    {
+        Flush();
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Flush
+//
+// @description             : Writes the buffered records. A write error ends the capture, the
+//                            file then holds what was written before.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::Flush()
+{
+    if (m_bufferCount && fwrite(m_buffer, sizeof(sm_captureRecord_t), m_bufferCount, m_file) != m_bufferCount)
+    {
+        printf("*** CAPTURE ERROR: Cannot write the capture file, capture stopped\n");
+        m_active.store(false, memory_order_relaxed);
+        m_header.recordCount -= m_bufferCount;
+    }
+
+    m_bufferCount = 0;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ReleaseMemory
+//
+// @description             : Gives the buffer and the object table back to the system
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::ReleaseMemory()
+{
+    size_t pageSize = OsGetPageSize();
+    if (m_buffer)
+    {
+        OsReleaseMemory((char*)m_buffer, (SM_CAPTURE_BUFFER_RECORDS * sizeof(sm_captureRecord_t) + pageSize - 1) & ~(pageSize - 1));
+        m_buffer = nullptr;
+    }
+
+    if (m_objects)
+    {
+        OsReleaseMemory((char*)m_objects, (m_objectCapacity * sizeof(sm_captureEntry_t) + pageSize - 1) & ~(pageSize - 1));
+        m_objects = nullptr;
+    }
+
+    m_objectCapacity = 0;
+    m_objectCount = 0;
+}
+
+inline size_t CaptureHash(uint64_t ptr)
+{
+    return (size_t)((ptr >> 4) * 0x9e3779b97f4a7c15ull >> 20);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : AddObject
+//
+// @description             : Enters the object number of an address into the table, which
+//                            doubles when it gets half full.
+//
+// @param ptr               : Address
+// @param id                : Object number
+//
+// @returns                 : true on success, false if the system is out of memory.
+//----------------------------------------------------------------------------------------------
+inline bool SMRecorder::AddObject(void *ptr, uint32_t id)
+{
+    if (2 * (m_objectCount + 1) > m_objectCapacity)
+    {
+        size_t pageSize = OsGetPageSize();
+        size_t capacity = (m_objectCapacity) ? 2 * m_objectCapacity : SM_CAPTURE_MIN_OBJECTS;
+        size_t size = (capacity * sizeof(sm_captureEntry_t) + pageSize - 1) & ~(pageSize - 1);
+        sm_captureEntry_t *objects = (sm_captureEntry_t*)OsReserveMemory(size);
+        if (objects == nullptr || !OsCommitMemory((char*)objects, size))
+        {
+            if (objects)
+            {
+                OsReleaseMemory((char*)objects, size);
+            }
+
+            return false;
+        }
+
+        // Committed memory starts out zeroed, i.e. empty
+        for (size_t i = 0; i < m_objectCapacity; i++)
+        {
+            if (m_objects[i].ptr)
+            {
+                size_t index = CaptureHash(m_objects[i].ptr) & (capacity - 1);
+                while (objects[index].ptr)
+                {
+                    index = (index + 1) & (capacity - 1);
+                }
+
+                objects[index] = m_objects[i];
+            }
+        }
+
+        if (m_objects)
+        {
+            OsReleaseMemory((char*)m_objects, (m_objectCapacity * sizeof(sm_captureEntry_t) + pageSize - 1) & ~(pageSize - 1));
+        }
+
+        m_objects = objects;
+        m_objectCapacity = capacity;
+    }
+
+    size_t mask = m_objectCapacity - 1;
+    size_t index = CaptureHash((uint64_t)(uintptr_t)ptr) & mask;
+    while (m_objects[index].ptr)
+    {
+        index = (index + 1) & mask;
+    }
+
+    m_objects[index].ptr = (uint64_t)(uintptr_t)ptr;
+    m_objects[index].id = id;
+    m_objectCount++;
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RemoveObject
+//
+// @description             : Takes an address out of the table. The entries after it are
+//                            shifted back, so lookups never need to skip deleted entries.
+//
+// @param ptr               : Address
+//
+// @returns                 : Object number, 0 if the address is not in the table.
+//----------------------------------------------------------------------------------------------
+inline uint32_t SMRecorder::RemoveObject(void *ptr)
+{
+    if (m_objectCount == 0)
+    {
+        return 0;
+    }
+
+    size_t mask = m_objectCapacity - 1;
+    size_t index = CaptureHash((uint64_t)(uintptr_t)ptr) & mask;
+    while (m_objects[index].ptr != (uint64_t)(uintptr_t)ptr)
+    {
+        if (m_objects[index].ptr == 0)
+        {
+            return 0;
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    uint32_t id = m_objects[index].id;
+    size_t next = index;
+    for (;;)
+    {
+        next = (next + 1) & mask;
+        if (m_objects[next].ptr == 0)
+        {
+            break;
+        }
+
+        // An entry may move back unless its home lies between the hole and itself
+        size_t home = CaptureHash(m_objects[next].ptr) & mask;
+        bool between = (index <= next) ? (index < home && home <= next) : (index < home || home <= next);
+        if (!between)
+        {
+            m_objects[index] = m_objects[next];
+            index = next;
+        }
+    }
+
+    m_objects[index].ptr = 0;
+    m_objectCount--;
+    return id;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : LockForFork
+//
+// @description             : Keeps captured operations out of the way of fork()
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::LockForFork()
+{
+    m_mutex.lock();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : UnlockAfterFork
+//
+// @description             : Releases the lock taken by LockForFork. A child does not go on
+//                            with the capture of its parent, the file stays with the parent.
+//
+// @param inChild           : true when called in the child process
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMRecorder::UnlockAfterFork(bool inChild)
+{
+    if (!inChild)
+    {
+        m_mutex.unlock();
+        return;
+    }
+
+    new (&m_mutex) mutex();
+    if (m_file)
+    {
+        m_active.store(false, memory_order_relaxed);
+        m_file = nullptr;
+        ReleaseMemory();
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// Bit scan helpers used by the size class bitmap
+//----------------------------------------------------------------------------------------------
+inline unsigned int FindFirstSetBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index = 0;
+#ifdef _WIN64
+    _BitScanForward64(&index, value);
+#else
+    if (!_BitScanForward(&index, (unsigned long)value))
+    {
+        _BitScanForward(&index, (unsigned long)(value >> 32));
+        index += 32;
+    }
+#endif
+    return index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+inline unsigned int FindLastSetBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index = 0;
+#ifdef _WIN64
+    _BitScanReverse64(&index, value);
+#else
+    if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+    {
+        index += 32;
+    }
+    else
+    {
+        _BitScanReverse(&index, (unsigned long)value);
+    }
+#endif
+    return index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMCounters
+//
+// @description             : Constructor. Shards are created by the threads on their first 
+//                            count.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline SMCounters::SMCounters()
+{
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        m_shards[i].store(nullptr, memory_order_relaxed);
+    }
+
+    memset((void*)&m_sharedShard, 0, sizeof(m_sharedShard));
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMCounters
+//
+// @description             : Destructor
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline SMCounters::~SMCounters()
+{
+    size_t pageSize = OsGetPageSize();
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        sm_counterShard_t *shard = m_shards[i].load(memory_order_relaxed);
+        if (shard)
+        {
+            OsReleaseMemory((char*)shard, (sizeof(sm_counterShard_t) + pageSize - 1) & ~(pageSize - 1));
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetShard
+//
+// @description             : Returns the shard of a thread slot, creating it on first use.
+//                            Only the thread owning the slot calls this. The memory comes from
+//                            the system, counting must not change the heap it counts.
+//
+// @param index             : Thread slot
+//
+// @returns                 : Shard, nullptr if the system is out of memory.
+//----------------------------------------------------------------------------------------------
+inline sm_counterShard_t* SMCounters::GetShard(unsigned int index)
+{
+    sm_counterShard_t *shard = m_shards[index].load(memory_order_relaxed);
+    if (shard == nullptr)
+    {
+        size_t pageSize = OsGetPageSize();
+        size_t size = (sizeof(sm_counterShard_t) + pageSize - 1) & ~(pageSize - 1);
+        char *memory = OsReserveMemory(size);
+        if (memory == nullptr)
+        {
+            return nullptr;
+        }
+
+        if (!OsCommitMemory(memory, size))
+        {
+            OsReleaseMemory(memory, size);
+            return nullptr;
+        }
+
+        // Fresh pages from the system are zero
+        shard = (sm_counterShard_t*)memory;
+        m_shards[index].store(shard, memory_order_release);
+    }
+
+    return shard;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Add
+//
+// @description             : Adds to a counter. A shard of one thread is counted in without an
+//                            atomic read-modify-write, the shared shard needs one. The release
+//                            orders the count after everything the thread did before.
+//
+// @param counter           : Counter
+// @param value             : Value to add
+// @param shared            : Whether the counter is in the shared shard
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMCounters::Add(atomic<unsigned long long> & counter, unsigned long long value, bool shared)
+{
+    if (shared)
+    {
+        counter.fetch_add(value, memory_order_release);
+    }
+    else
+    {
+        counter.store(counter.load(memory_order_relaxed) + value, memory_order_release);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Count
+//
+// @description             : Counts an event in the calling thread's shard. Takes no lock.
+//
+// @param counter           : SM_COUNT_CHUNK_ALLOCS etc.
+// @param value             : Number of events
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMCounters::Count(unsigned int counter, unsigned long long value)
+{
+    unsigned int index = GetThreadSlot();
+    sm_counterShard_t *shard = (index < SM_MAX_THREADS) ? GetShard(index) : nullptr;
+    if (shard)
+    {
+        Add(shard->counts[counter], value, false);
+    }
+    else
+    {
+        Add(m_sharedShard.counts[counter], value, true);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CountLatency
+//
+// @description             : Counts an operation in the calling thread's latency histogram.
+//                            Takes no lock.
+//
+// @param op                : SM_LATENCY_ALLOC or SM_LATENCY_DEALLOC
+// @param latency           : Latency in nanoseconds
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMCounters::CountLatency(unsigned int op, uint64_t latency)
+{
+    size_t bucket = (latency) ? FindLastSetBit(latency) + 1 : 0;
+    if (bucket >= SM_LATENCY_BUCKETS)
+    {
+        bucket = SM_LATENCY_BUCKETS - 1;
+    }
+
+    unsigned int index = GetThreadSlot();
+    sm_counterShard_t *shard = (index < SM_MAX_THREADS) ? GetShard(index) : nullptr;
+    bool shared = (shard == nullptr);
+    if (shared)
+    {
+        shard = &m_sharedShard;
+    }
+
+    Add(shard->latencyTotalNs[op], latency, shared);
+    Add(shard->latency[op][bucket], 1, shared);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Collect
+//
+// @description             : Adds up the shards into the counters and latency histograms of
+//                            stats, while the threads go on counting. The frees of all shards
+//                            are read first: whatever freed a block was counted after the 
+//                            block was allocated, so the allocations read after it include 
+//                            the block's. Each counter only grows from one snapshot to the
+//                            next.
+//
+// @param stats             : [OUTPUT] Statistics, the counters are added to
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+inline void SMCounters::Collect(sm_stats_t & stats)
+{
+    sm_counterShard_t *shards[SM_MAX_THREADS + 1];
+    unsigned int shardCount = 0;
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        sm_counterShard_t *shard = m_shards[i].load(memory_order_acquire);
+        if (shard)
+        {
+            shards[shardCount++] = shard;
+        }
+    }
+
+    shards[shardCount++] = &m_sharedShard;
+
+    for (unsigned int i = 0; i < shardCount; i++)
+    {
+        stats.countFrees += shards[i]->counts[SM_COUNT_FREES].load(memory_order_acquire);
+    }
+
+    for (unsigned int i = 0; i < shardCount; i++)
+    {
+        sm_counterShard_t *shard = shards[i];
+        stats.countChunkAllocs += shard->counts[SM_COUNT_CHUNK_ALLOCS].load(memory_order_acquire);
+        stats.countMemoryMapAllocs += shard->counts[SM_COUNT_MAP_ALLOCS].load(memory_order_acquire);
+        stats.countTreeAllocs += shard->counts[SM_COUNT_TREE_ALLOCS].load(memory_order_acquire);
+        stats.countSlabAllocs += shard->counts[SM_COUNT_SLAB_ALLOCS].load(memory_order_acquire);
+        stats.countThreadCacheAllocs += shard->counts[SM_COUNT_CACHE_ALLOCS].load(memory_order_acquire);
+        stats.countInPlaceReallocs += shard->counts[SM_COUNT_IN_PLACE_REALLOCS].load(memory_order_acquire);
+        for (size_t j = 0; j < SM_LATENCY_BUCKETS; j++)
+        {
+            stats.allocLatency[j] += shard->latency[SM_LATENCY_ALLOC][j].load(memory_order_relaxed);
+            stats.deallocLatency[j] += shard->latency[SM_LATENCY_DEALLOC][j].load(memory_order_relaxed);
+        }
+
+        stats.allocLatencyTotalNs += shard->latencyTotalNs[SM_LATENCY_ALLOC].load(memory_order_relaxed);
+        stats.deallocLatencyTotalNs += shard->latencyTotalNs[SM_LATENCY_DEALLOC].load(memory_order_relaxed);
+    }
+
+    stats.countAllocs = stats.countChunkAllocs + stats.countMemoryMapAllocs + stats.countTreeAllocs +
+                        stats.countSlabAllocs + stats.countThreadCacheAllocs;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMLatencyTimer
+//
+// @description             : Constructor. Starts the measurement.
+//
+// @param counters          : Counters holding the histogram
+// @param op                : SM_LATENCY_ALLOC or SM_LATENCY_DEALLOC
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+template<class Counters>
+inline SMLatencyTimer<Counters, true>::SMLatencyTimer(Counters & counters, unsigned int op) : m_counters(counters), m_op(op)
+{
+    m_start = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMLatencyTimer
+//
+// @description             : Destructor. Counts the time since the construction.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+template<class Counters>
+inline SMLatencyTimer<Counters, true>::~SMLatencyTimer()
+{
+    uint64_t latency = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count() - m_start;
+    m_counters.CountLatency(m_op, latency);
+}
+
+// Appends to a text buffer with snprintf, counting what does not fit
+inline void AppendText(char *buffer, size_t size, size_t & length, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf((length < size) ? buffer + length : nullptr, (length < size) ? size - length : 0, format, args);
+    va_end(args);
+
+    if (written > 0)
+    {
+        length += (size_t)written;
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FormatStats
+//
+// @description             : Writes statistics as JSON or in the Prometheus text format. Like
+//                            snprintf, the text is cut off if the buffer is too small, and the
+//                            full length is returned.
+//
+// @param stats             : Statistics
+// @param buffer            : Buffer for the text, may be nullptr if size is 0.
+// @param size              : Buffer size
+// @param format            : SM_STATS_JSON or SM_STATS_PROMETHEUS
+//
+// @returns                 : Length of the text, without the terminating zero.
+//----------------------------------------------------------------------------------------------
+inline size_t FormatStats(const sm_stats_t & stats, char *buffer, size_t size, int format)
+{
+    size_t length = 0;
+    if (size)
+    {
+        buffer[0] = 0;
+    }
+
+    const char *latencyNames[2] = { "alloc", "dealloc" };
+    const unsigned long long *latencies[2] = { stats.allocLatency, stats.deallocLatency };
+    unsigned long long latencyTotals[2] = { stats.allocLatencyTotalNs, stats.deallocLatencyTotalNs };
+
+    if (format == SM_STATS_JSON)
+    {
+        AppendText(buffer, size, length, "{\"heap_bytes\":%zu,\"committed_bytes\":%zu,\"huge_page_bytes\":%zu,\"resident_bytes\":%zu,\"purged_bytes\":%zu,\"used_bytes\":%zu,", 
+                   stats.heapSize, stats.committedSize, stats.hugePageSize, stats.residentSize, stats.purgedSize, stats.usedSize);
+        AppendText(buffer, size, length, "\"free_bytes\":%zu,\"free_blocks\":%zu,\"largest_free_block\":%zu,\"fragmentation\":%.6f,",
+                   stats.freeSize, stats.freeBlockCount, stats.largestFreeBlock, stats.fragmentation);
+        AppendText(buffer, size, length, "\"thread_cache_bytes\":%zu,\"slab_bytes\":%zu,\"slab_used_bytes\":%zu,\"chunks\":%u,\"slabs\":%zu,",
+                   stats.threadCacheSize, stats.slabSize, stats.slabUsedSize, stats.chunkCount, stats.slabCount);
+        AppendText(buffer, size, length, "\"region_bytes\":%zu,\"regions\":%zu,", stats.regionSize, stats.regionCount);
+        AppendText(buffer, size, length, "\"deferred_bytes\":%zu,\"deferred_blocks\":%zu,", stats.deferredSize, stats.deferredBlockCount);
+        AppendText(buffer, size, length, "\"allocs\":{\"total\":%llu,\"chunk\":%llu,\"map\":%llu,\"tree\":%llu,\"slab\":%llu,\"thread_cache\":%llu},",
+                   stats.countAllocs, stats.countChunkAllocs, stats.countMemoryMapAllocs, stats.countTreeAllocs, stats.countSlabAllocs,
+                   stats.countThreadCacheAllocs);
+        AppendText(buffer, size, length, "\"frees\":%llu,\"in_place_reallocs\":%llu,\"free_blocks_by_size\":{", stats.countFrees, stats.countInPlaceReallocs);
+
+        const char *separator = "";
+        for (size_t sizeClass = 0; sizeClass < SM_SIZE_CLASSES; sizeClass++)
+        {
+            if (stats.freeBlocksBySize[sizeClass])
+            {
+                AppendText(buffer, size, length, "%s\"%llu\":%llu", separator, 1ull << sizeClass, stats.freeBlocksBySize[sizeClass]);
+                separator = ",";
+            }
+        }
+
+        AppendText(buffer, size, length, "}");
+        for (int i = 0; i < 2 && stats.hasLatency; i++)
+        {
+            AppendText(buffer, size, length, ",\"%s_latency_ns\":{\"total\":%llu,\"buckets\":{", latencyNames[i], latencyTotals[i]);
+            separator = "";
+            for (size_t bucket = 0; bucket < SM_LATENCY_BUCKETS; bucket++)
+            {
+                if (latencies[i][bucket])
+                {
+                    AppendText(buffer, size, length, "%s\"%llu\":%llu", separator, (1ull << bucket) - 1, latencies[i][bucket]);
+                    separator = ",";
+                }
+            }
+
+            AppendText(buffer, size, length, "}}");
+        }
+
+        AppendText(buffer, size, length, "}\n");
+        return length;
+    }
+
+    struct { const char *name; const char *type; const char *help; double value; } metrics[] =
+    {
+        { "sm_heap_bytes", "gauge", "Memory reserved for the chunks", (double)stats.heapSize },
+        { "sm_committed_bytes", "gauge", "Chunk memory committed", (double)stats.committedSize },
+        { "sm_huge_page_bytes", "gauge", "Committed chunk memory asked to get huge pages", (double)stats.hugePageSize },
+        { "sm_resident_bytes", "gauge", "Chunk memory resident, committed minus purged", (double)stats.residentSize },
+        { "sm_purged_bytes", "gauge", "Free memory given back to the system", (double)stats.purgedSize },
+        { "sm_used_bytes", "gauge", "Chunk memory taken, in use or free", (double)stats.usedSize },
+        { "sm_free_bytes", "gauge", "Recycled memory ready for reuse", (double)stats.freeSize },
+        { "sm_free_blocks", "gauge", "Number of recycled blocks", (double)stats.freeBlockCount },
+        { "sm_largest_free_block_bytes", "gauge", "Size of the largest recycled block", (double)stats.largestFreeBlock },
+        { "sm_fragmentation_ratio", "gauge", "1 - largest free block / free bytes", stats.fragmentation },
+        { "sm_thread_cache_bytes", "gauge", "Memory held in thread caches", (double)stats.threadCacheSize },
+        { "sm_slab_bytes", "gauge", "Memory in slabs", (double)stats.slabSize },
+        { "sm_slab_used_bytes", "gauge", "Slab slots in use", (double)stats.slabUsedSize },
+        { "sm_chunks", "gauge", "Number of chunks", (double)stats.chunkCount },
+        { "sm_region_bytes", "gauge", "Memory held by regions", (double)stats.regionSize },
+        { "sm_regions", "gauge", "Number of regions", (double)stats.regionCount },
+        { "sm_deferred_bytes", "gauge", "Freed memory waiting to be coalesced", (double)stats.deferredSize },
+        { "sm_deferred_blocks", "gauge", "Freed blocks waiting to be coalesced", (double)stats.deferredBlockCount },
+        { "sm_frees_total", "counter", "Frees", (double)stats.countFrees },
+        { "sm_in_place_reallocs_total", "counter", "Reallocations done in place", (double)stats.countInPlaceReallocs },
+    };
+
+    for (const auto & metric : metrics)
+    {
+        AppendText(buffer, size, length, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", metric.name, metric.help, metric.name, metric.type,
+                   metric.name, metric.value);
+    }
+
+    AppendText(buffer, size, length, "# HELP sm_allocs_total Allocations by where they were served from\n# TYPE sm_allocs_total counter\n");
+    AppendText(buffer, size, length, "sm_allocs_total{path=\"chunk\"} %llu\nsm_allocs_total{path=\"map\"} %llu\nsm_allocs_total{path=\"tree\"} %llu\n",
+               stats.countChunkAllocs, stats.countMemoryMapAllocs, stats.countTreeAllocs);
+    AppendText(buffer, size, length, "sm_allocs_total{path=\"slab\"} %llu\nsm_allocs_total{path=\"thread_cache\"} %llu\n",
+               stats.countSlabAllocs, stats.countThreadCacheAllocs);
+
+    AppendText(buffer, size, length, "# HELP sm_free_blocks_by_size Recycled blocks of at least min_bytes and less than twice that\n");
+    AppendText(buffer, size, length, "# TYPE sm_free_blocks_by_size gauge\n");
+    for (size_t sizeClass = 0; sizeClass < SM_SIZE_CLASSES; sizeClass++)
+    {
+        if (stats.freeBlocksBySize[sizeClass])
+        {
+            AppendText(buffer, size, length, "sm_free_blocks_by_size{min_bytes=\"%llu\"} %llu\n", 1ull << sizeClass, stats.freeBlocksBySize[sizeClass]);
+        }
+    }
+
+    for (int i = 0; i < 2 && stats.hasLatency; i++)
+    {
+        AppendText(buffer, size, length, "# HELP sm_%s_latency_ns Latency of SM_%s\n# TYPE sm_%s_latency_ns histogram\n",
+                   latencyNames[i], latencyNames[i], latencyNames[i]);
+
+        unsigned long long count = 0;
+        for (size_t bucket = 0; bucket < SM_LATENCY_BUCKETS - 1; bucket++)
+        {
+            count += latencies[i][bucket];
+            AppendText(buffer, size, length, "sm_%s_latency_ns_bucket{le=\"%llu\"} %llu\n", latencyNames[i], (1ull << bucket) - 1, count);
+        }
+
+        count += latencies[i][SM_LATENCY_BUCKETS - 1];
+        AppendText(buffer, size, length, "sm_%s_latency_ns_bucket{le=\"+Inf\"} %llu\nsm_%s_latency_ns_sum %llu\nsm_%s_latency_ns_count %llu\n",
+                   latencyNames[i], count, latencyNames[i], latencyTotals[i], latencyNames[i], count);
+    }
+
+    return length;
+}
+
+//----------------------------------------------------------------------------------------------
+// Boundary tag helpers. A block pointer points to the block header, the user pointer is
+// SM_HEADER_SIZE bytes after it. Headers are only written with the lock held, but the owner of
+// an allocated block reads its header without the lock while its neighbours may be updating 
+// the previous-free bit, hence the relaxed atomic accesses (plain loads and stores).
+//----------------------------------------------------------------------------------------------
+inline size_t BlockHeader(char *block)
+{
+    return ((atomic<size_t>*)block)->load(memory_order_relaxed);
+}
+
+inline void SetBlockHeader(char *block, size_t header)
+{
+    ((atomic<size_t>*)block)->store(header, memory_order_relaxed);
+}
+
+inline size_t BlockSize(char *block)
+{
+    return BlockHeader(block) & ~SM_FLAG_MASK;
+}
+
+inline bool IsBlockFree(char *block)
+{
+    return (BlockHeader(block) & SM_FREE_BIT) != 0;
+}
+
+inline bool IsPrevBlockFree(char *block)
+{
+    return (BlockHeader(block) & SM_PREV_FREE_BIT) != 0;
+}
+
+inline bool IsBlockDeferred(char *block)
+{
+    return (BlockHeader(block) & SM_DEFERRED_BIT) != 0;
+}
+
+inline char* NextBlock(char *block)
+{
+    return block + BlockSize(block);
+}
+
+inline char* PrevBlock(char *block)
+{
+    // Only valid when the previous block is free, its size is in its footer
+    return block - *(size_t*)(block - SM_HEADER_SIZE);
+}
+
+inline void SetPrevBlockFree(char *block, bool isFree)
+{
+    if (isFree)
+        SetBlockHeader(block, BlockHeader(block) | SM_PREV_FREE_BIT);
+    else
+        SetBlockHeader(block, BlockHeader(block) & ~SM_PREV_FREE_BIT);
+}
+
+inline void MarkBlockFree(char *block, size_t size)
+{
+    SetBlockHeader(block, size | SM_FREE_BIT | (BlockHeader(block) & SM_PREV_FREE_BIT));
+    *(size_t*)(block + size - SM_HEADER_SIZE) = size;
+    SetPrevBlockFree(block + size, true);
+}
+
+inline void MarkBlockAllocated(char *block, size_t size)
+{
+    SetBlockHeader(block, size | (BlockHeader(block) & SM_PREV_FREE_BIT));
+    SetPrevBlockFree(block + size, false);
+}
+
+//----------------------------------------------------------------------------------------------
+// Free block tree helpers. The tree is a treap: a search tree ordered by block size, ties broken
+// by address, which is also a max-heap on a priority hashed from the address. That keeps it 
+// balanced in expectation without storing anything but the two child links.
+//----------------------------------------------------------------------------------------------
+inline uint64_t TreePriority(sm_treeBlock_t *block)
+{
+    return ((uint64_t)(uintptr_t)block * 0x9E3779B97F4A7C15ull) >> 16;
+}
+
+inline bool TreeLess(sm_treeBlock_t *a, sm_treeBlock_t *b)
+{
+    size_t sizeA = BlockSize((char*)a);
+    size_t sizeB = BlockSize((char*)b);
+    return sizeA < sizeB || (sizeA == sizeB && a < b);
+}
+
+inline sm_treeBlock_t* MergeTrees(sm_treeBlock_t *left, sm_treeBlock_t *right)
+{
+    // Every block of left is ordered before every block of right
+    if (left == nullptr)
+        return right;
+    if (right == nullptr)
+        return left;
+
+    if (TreePriority(left) > TreePriority(right))
+    {
+        left->right = MergeTrees(left->right, right);
+        return left;
+    }
+
+    right->left = MergeTrees(left, right->left);
+    return right;
+}
+
+inline void InsertTreeBlock(sm_treeBlock_t *&root, sm_treeBlock_t *block)
+{
+    // Walk down to where the new block's priority puts it, then split the 
+    // subtree found there around it.
+    sm_treeBlock_t **link = &root;
+    uint64_t priority = TreePriority(block);
+    while (*link && TreePriority(*link) > priority)
+    {
+        link = TreeLess(block, *link) ? &(*link)->left : &(*link)->right;
+    }
+
+    sm_treeBlock_t *subtree = *link;
+    sm_treeBlock_t **left = &block->left;
+    sm_treeBlock_t **right = &block->right;
+    while (subtree)
+    {
+        if (TreeLess(subtree, block))
+        {
+            *left = subtree;
+            left = &subtree->right;
+            subtree = subtree->right;
+        }
+        else
+        {
+            *right = subtree;
+            right = &subtree->left;
+            subtree = subtree->left;
+        }
+    }
+
+    *left = nullptr;
+    *right = nullptr;
+    *link = block;
+}
+
+inline void RemoveTreeBlock(sm_treeBlock_t *&root, sm_treeBlock_t *block)
+{
+    sm_treeBlock_t **link = &root;
+    while (*link != block)
+    {
+        link = TreeLess(block, *link) ? &(*link)->left : &(*link)->right;
+    }
+
+    *link = MergeTrees(block->left, block->right);
+}
+
+inline sm_treeBlock_t* FindTreeBlock(sm_treeBlock_t *root, size_t size)
+{
+    // Smallest block of at least the given size
+    sm_treeBlock_t *bestFit = nullptr;
+    while (root)
+    {
+        if (BlockSize((char*)root) >= size)
+        {
+            bestFit = root;
+            root = root->left;
+        }
+        else
+        {
+            root = root->right;
+        }
+    }
+
+    return bestFit;
+}
+
+//----------------------------------------------------------------------------------------------
+// Purge list helpers. A block is on the list if it has an older neighbour or is the oldest.
+//----------------------------------------------------------------------------------------------
+inline void AppendPurgeBlock(sm_treeBlock_t *&oldest, sm_treeBlock_t *&newest, sm_treeBlock_t *block)
+{
+    block->older = newest;
+    block->newer = nullptr;
+    if (newest)
+    {
+        newest->newer = block;
+    }
+    else
+    {
+        oldest = block;
+    }
+
+    newest = block;
+}
+
+inline void RemovePurgeBlock(sm_treeBlock_t *&oldest, sm_treeBlock_t *&newest, sm_treeBlock_t *block)
+{
+    if (block->older == nullptr && oldest != block)
+    {
+        return;
+    }
+
+    if (block->older)
+    {
+        block->older->newer = block->newer;
+    }
+    else
+    {
+        oldest = block->newer;
+    }
+
+    if (block->newer)
+    {
+        block->newer->older = block->older;
+    }
+    else
+    {
+        newest = block->older;
+    }
+
+    block->older = nullptr;
+    block->newer = nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// Slab map helpers. Entries are written with the lock held and read without it by SM_dealloc.
+//----------------------------------------------------------------------------------------------
+inline atomic<unsigned char>* SlabMapEntry(sm_chunk_t *chunk, char *slab)
+{
+    return (atomic<unsigned char>*)(chunk->slabMap + ((size_t)(slab - chunk->slabMapBase) >> SM_SLAB_SIZE_LOG2));
+}
+
+inline char* SlabStart(void *ptr)
+{
+    return (char*)((uintptr_t)ptr & ~(uintptr_t)(SM_SLAB_SIZE - 1));
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetBinIndex
+//
+// @description             : Maps a small block size to its size class, one class per 
+//                            SM_GRANULE.
+//
+// @param size              : Block size, a multiple of SM_GRANULE below SM_SMALL_BIN_LIMIT.
+//
+// @returns                 : Index of the size class bin
+//----------------------------------------------------------------------------------------------
+inline size_t GetBinIndex(size_t size)
+{
+    return size / SM_GRANULE;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindNonEmptyBin
+//
+// @description             : Uses the bin bitmap to find the first non-empty size class at or
+//                            above the given one.
+//
+// @param freeLists         : Free lists to search
+// @param startIndex        : Smallest acceptable bin index
+//
+// @returns                 : Index of a non-empty bin, SM_BIN_COUNT if there is none.
+//----------------------------------------------------------------------------------------------
+inline size_t FindNonEmptyBin(const sm_freeLists_t & freeLists, size_t startIndex)
+{
+    if (startIndex >= SM_BIN_COUNT)
+    {
+        return SM_BIN_COUNT;
+    }
+
+    size_t word = startIndex / 64;
+    uint64_t bits = freeLists.binBitmap[word] & (~(uint64_t)0 << (startIndex % 64));
+
+    while (bits == 0)
+    {
+        word++;
+        if (word == SM_BIN_WORDS)
+        {
+            return SM_BIN_COUNT;
+        }
+
+        bits = freeLists.binBitmap[word];
+    }
+
+    return word * 64 + FindFirstSetBit(bits);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindLargestFreeBlock
+//
+// @description             : Finds the largest free block. It is the rightmost block of the 
+//                            free block tree or, if the tree is empty, a block from the largest
+//                            non-empty size class.
+//
+// @param freeLists         : Free lists to search
+//
+// @returns                 : Pointer to the free block, nullptr if there is none.
+//----------------------------------------------------------------------------------------------
+inline char* FindLargestFreeBlock(const sm_freeLists_t & freeLists)
+{
+    if (freeLists.tree)
+    {
+        sm_treeBlock_t *block = freeLists.tree;
+        while (block->right)
+        {
+            block = block->right;
+        }
+
+        return (char*)block;
+    }
+
+    for (size_t word = SM_BIN_WORDS; word > 0; word--)
+    {
+        if (freeLists.binBitmap[word - 1])
+        {
+            size_t index = (word - 1) * 64 + FindLastSetBit(freeLists.binBitmap[word - 1]);
+            return (char*)freeLists.bins[index];
+        }
+    }
+
+    return nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMBestFit::FindFreeBlock
+//
+// @description             : Finds the smallest free block which can hold the requested size.
+//                            Small classes are exact, so the first non-empty bin at or above
+//                            the request's class is the best fit among the small blocks. 
+//                            Failing that, the best fit is looked up in the free block tree.
+//
+// @param freeLists         : Free lists to search
+// @param size              : Requested block size, a multiple of SM_GRANULE.
+//
+// @returns                 : Pointer to a fitting free block, nullptr otherwise.
+//----------------------------------------------------------------------------------------------
+inline char* SMBestFit::FindFreeBlock(const sm_freeLists_t & freeLists, size_t size)
+{
+    if (size < SM_SMALL_BIN_LIMIT)
+    {
+        size_t binIndex = FindNonEmptyBin(freeLists, GetBinIndex(size));
+        if (binIndex != SM_BIN_COUNT)
+        {
+            return (char*)freeLists.bins[binIndex];
+        }
+    }
+
+    return (char*)FindTreeBlock(freeLists.tree, size);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SMWorstFit::FindFreeBlock
+//
+// @description             : Picks the largest free block, so that what is split off stays as
+//                            large as possible.
+//
+// @param freeLists         : Free lists to search
+// @param size              : Requested block size, a multiple of SM_GRANULE.
+//
+// @returns                 : Pointer to a fitting free block, nullptr otherwise.
+//----------------------------------------------------------------------------------------------
+inline char* SMWorstFit::FindFreeBlock(const sm_freeLists_t & freeLists, size_t size)
+{
+    char *block = FindLargestFreeBlock(freeLists);
+    if (block && BlockSize(block) >= size)
+    {
+        return block;
+    }
+
+    return nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : StorageManager
+//
+// @description             : Constructor. The heap starts with one chunk of the given size and
+//                            grows by chunks of the same size without limit.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+SM_CLASS::BasicStorageManager(size_t size)
+{
+    m_config.initialSize = size;
+    m_config.growSize = size;
+    m_config.maxFootprint = 0;
+    m_config.prefault = false;
+    m_config.slabs = true;
+    m_config.coalesceThread = false;
+    m_config.hugePages = false;
+    m_config.purgeThreshold = 0;
+    m_config.purgeDelay = 0;
+    m_config.softLimit = 0;
+    m_prefaultStop = false;
+    m_coalesceStop = false;
+    m_purgeStop = false;
+
+    if (!InitStorageManager(size))
+    {
+        printf("\n *** FATAL ERROR: InitStorageManager: Cannot proceed!\n");
+        return;
+    }
+
+    if (LockPolicy::THREAD_CACHE)
+    {
+        AddThreadExitFlush(this, &BasicStorageManager::FlushExitingThread);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : StorageManager
+//
+// @description             : Constructor
+//
+// @param config            : Initial chunk size, growth step, footprint limit, prefaulting,
+//                            slabs, background coalescing, huge pages and purging
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+SM_CLASS::BasicStorageManager(const sm_config_t & config)
+{
+    m_config = config;
+    m_config.coalesceThread = config.coalesceThread && CoalescePolicy::DEFERRED && LockPolicy::THREAD_SAFE;
+    m_prefaultStop = false;
+    m_coalesceStop = false;
+    m_purgeStop = false;
+
+    if (!InitStorageManager(config.initialSize))
+    {
+        printf("\n *** FATAL ERROR: InitStorageManager: Cannot proceed!\n");
+        return;
+    }
+
+    if (m_config.prefault && LockPolicy::THREAD_SAFE)
+    {
+        m_prefaultThread = thread(&BasicStorageManager::PrefaultThread, this);
+    }
+
+    if (m_config.coalesceThread)
+    {
+        m_coalesceThread = thread(&BasicStorageManager::CoalesceThread, this);
+    }
+
+    if (m_config.purgeDelay && LockPolicy::THREAD_SAFE)
+    {
+        m_purgeThread = thread(&BasicStorageManager::PurgeThread, this);
+    }
+
+    if (LockPolicy::THREAD_CACHE)
+    {
+        AddThreadExitFlush(this, &BasicStorageManager::FlushExitingThread);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : StorageManager
+//
+// @description             : Destructor
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+SM_CLASS::~BasicStorageManager()
+{
+    if (LockPolicy::THREAD_CACHE)
+    {
+        RemoveThreadExitFlush(this);
+    }
+
+    if (m_prefaultThread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(m_prefaultMutex);
+            m_prefaultStop = true;
+        }
+
+        m_prefaultCondition.notify_one();
+        m_prefaultThread.join();
+    }
+
+    if (m_coalesceThread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(m_coalesceMutex);
+            m_coalesceStop = true;
+        }
+
+        m_coalesceCondition.notify_one();
+        m_coalesceThread.join();
+    }
+
+    if (m_purgeThread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(m_purgeMutex);
+            m_purgeStop = true;
+        }
+
+        m_purgeCondition.notify_one();
+        m_purgeThread.join();
+    }
+
+    for (unsigned int i = 0; i < m_chunkCount; i++)
+    {
+        OsReleaseMemory(m_chunks[i].chunkPtr, m_chunks[i].reservedSize);
+        m_chunks[i].chunkPtr = nullptr;
+    }
+
+    if (m_handles)
+    {
+        size_t pageSize = OsGetPageSize();
+        OsReleaseMemory((char*)m_handles, (m_handleCapacity * sizeof(sm_handleEntry_t) + pageSize - 1) & ~(pageSize - 1));
+        m_handles = nullptr;
+    }
+
+    m_chunkCount = 0;
+    m_sortedChunkCount = 0;
+    m_newestChunk = nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : InitStorageManager
+//
+// @description             : Resets the heap state and allocates the first chunk.
+//
+// @param size              : Memory chunk allocated on init.
+//
+// @returns                 : true on success, false otherwise.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::InitStorageManager(size_t size)
+{
+    m_chunkCount = 0;
+    m_newestChunk = nullptr;
+    m_chunkTotalSize = 0;
+    m_chunkUsedSize = 0;
+    m_chunkCommittedSize = 0;
+    m_hugeCommittedSize = 0;
+    m_sortedChunkCount = 0;
+    m_chunkTableVersion = 0;
+    memset(&m_freeLists, 0, sizeof(m_freeLists));
+    m_freeSize = 0;
+    m_freeBlockCount = 0;
+    memset(m_freeBlocksBySize, 0, sizeof(m_freeBlocksBySize));
+    memset(m_threadCaches, 0, sizeof(m_threadCaches));
+    memset(m_slabs, 0, sizeof(m_slabs));
+    m_slabCount = 0;
+    m_slabUsedSize = 0;
+    m_regionSize = 0;
+    m_regionCount = 0;
+    m_handles = nullptr;
+    m_handleCapacity = 0;
+    m_handleEnd = 0;
+    m_freeHandle = 0;
+    m_deferredHead = nullptr;
+    m_deferredTail = nullptr;
+    m_deferredSize = 0;
+    m_deferredCount = 0;
+    m_purgeOldest = nullptr;
+    m_purgeNewest = nullptr;
+    m_purgedSize = 0;
+    m_purgeTime = 0;
+    m_purgeTicks = 0;
+    m_lastPath = SM_TRACE_PATH_NONE;
+
+    if (AddChunk(size))
+    {
+        if (StatsPolicy::REPORT)
+            printf("Storage Manager initialized with %zu bytes\n", m_chunkTotalSize);
+
+        return true;
+    }
+
+    if (StatsPolicy::REPORT)
+        printf("Storage Manager failed to allocate %zu bytes\n", size);
+
+    return false;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : AddChunk
+//
+// @description             : Grows the heap by one chunk, which becomes the one bump allocated
+//                            from. The chunk is only reserved, pages get committed as they are
+//                            needed. What is left of the committed part of the previous newest
+//                            chunk is turned into a free block. The first block of a chunk is placed so that user 
+//                            pointers are SM_GRANULE aligned, and the word at currentPtr is an
+//                            epilogue header (size 0, allocated) which stops coalescing at the
+//                            end of the used part of the chunk. With slabs enabled the chunk
+//                            starts with its slab map. With huge pages the chunk is rounded up
+//                            to whole huge pages, and falls back to small pages if the system
+//                            has none. Must be called with the lock held.
+//
+// @param minSize           : Size the chunk must have at least. The chunk is given 
+//                            m_config.growSize bytes if that is larger.
+//
+// @returns                 : true on success, false if the chunk limit or the footprint limit
+//                            was reached or the system is out of memory.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::AddChunk(size_t minSize)
+{
+    size_t size = (m_chunkCount && m_config.growSize > minSize) ? m_config.growSize : minSize;
+
+    if (m_chunkCount == SM_MAX_CHUNKS)
+    {
+        return false;
+    }
+
+    // The slab map goes in front of the first block. It needs an entry for every
+    // SM_SLAB_SIZE bytes of the chunk including the map itself, plus one because
+    // the chunk need not start at a slab boundary.
+    size_t slabMapSize = 0;
+    if (m_config.slabs)
+    {
+        if (size > (size_t)-1 / 2)
+        {
+            return false;
+        }
+
+        slabMapSize = ((size + (size >> SM_SLAB_SIZE_LOG2)) >> SM_SLAB_SIZE_LOG2) + 3;
+        slabMapSize = (slabMapSize + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+        size += slabMapSize;
+        minSize += slabMapSize;
+    }
+
+    if (m_config.maxFootprint)
+    {
+        if (m_chunkTotalSize + minSize > m_config.maxFootprint)
+        {
+            return false;
+        }
+
+        if (m_chunkTotalSize + size > m_config.maxFootprint)
+        {
+            size = m_config.maxFootprint - m_chunkTotalSize;
+        }
+    }
+
+    size_t pageSize = (m_config.hugePages) ? OS_HUGE_PAGE_SIZE : OsGetPageSize();
+    if (size > (size_t)-1 - pageSize)
+    {
+        return false;
+    }
+
+    int pages = OS_PAGES_SMALL;
+    size_t reservedSize = (size + pageSize - 1) & ~(pageSize - 1);
+    char *chunkPtr = (m_config.hugePages) ? OsReserveHugeMemory(reservedSize, pages) : OsReserveMemory(reservedSize);
+    if (chunkPtr == nullptr)
+    {
+        return false;
+    }
+
+    if (StatsPolicy::REPORT && m_config.hugePages && pages == OS_PAGES_SMALL)
+        printf("Storage Manager chunk of %zu bytes falls back to small pages\n", reservedSize);
+
+    // Give the unused, committed end of the current chunk to the bins, it will
+    // never be bump allocated from again.
+    if (m_newestChunk)
+    {
+        char *tail = m_newestChunk->currentPtr;
+        char *usableEnd = (m_newestChunk->committedEnd < m_newestChunk->chunkEnd) ? 
+                          m_newestChunk->committedEnd : m_newestChunk->chunkEnd;
+        size_t tailSize = (size_t)(usableEnd - tail - SM_HEADER_SIZE) & ~(SM_GRANULE - 1);
+        if (usableEnd >= tail + SM_HEADER_SIZE && tailSize >= SM_MIN_BLOCK_SIZE)
+        {
+            SetBlockHeader(tail, tailSize | (BlockHeader(tail) & SM_PREV_FREE_BIT));
+            SetBlockHeader(tail + tailSize, 0);
+            m_newestChunk->currentPtr = tail + tailSize;
+            m_newestChunk->usedSize += tailSize;
+            m_chunkUsedSize += tailSize;
+            FreeBlock(tail, false);
+        }
+    }
+
+    sm_chunk_t *chunk = &m_chunks[m_chunkCount];
+    chunk->chunkPtr = chunkPtr;
+    chunk->chunkEnd = chunkPtr + size;
+    chunk->slabMap = (slabMapSize) ? (unsigned char*)chunkPtr : nullptr;
+    chunk->slabMapBase = SlabStart(chunkPtr);
+    chunk->firstBlock = chunkPtr + slabMapSize;
+    while ((uintptr_t)(chunk->firstBlock + SM_HEADER_SIZE) % SM_GRANULE)
+    {
+        chunk->firstBlock++;
+    }
+
+    chunk->currentPtr = chunk->firstBlock;
+    chunk->dirtyEnd = chunk->firstBlock;
+    chunk->committedEnd = chunkPtr;
+    chunk->prefaultedEnd = chunkPtr;
+    chunk->totalSize = size;
+    chunk->reservedSize = reservedSize;
+    chunk->usedSize = 0;
+    chunk->pages = pages;
+
+    // Reserved huge pages are usable from the start
+    if (pages == OS_PAGES_RESERVED_HUGE)
+    {
+        chunk->committedEnd = chunkPtr + reservedSize;
+        m_chunkCommittedSize += reservedSize;
+        m_hugeCommittedSize += reservedSize;
+    }
+
+    if (chunk->currentPtr + SM_HEADER_SIZE <= chunk->chunkEnd)
+    {
+        if (!CommitChunk(chunk, chunk->currentPtr + SM_HEADER_SIZE))
+        {
+            OsReleaseMemory(chunkPtr, reservedSize);
+            return false;
+        }
+
+        SetBlockHeader(chunk->currentPtr, 0);
+    }
+
+    m_chunkCount++;
+    m_newestChunk = chunk;
+    m_chunkTotalSize += size;
+
+    // Insert into the address ordered table
+    unsigned int version = m_chunkTableVersion.load(memory_order_relaxed);
+    m_chunkTableVersion.store(version + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    unsigned int count = m_sortedChunkCount.load(memory_order_relaxed);
+    unsigned int position = count;
+    while (position > 0 && m_sortedChunks[position - 1].load(memory_order_relaxed)->chunkPtr > chunkPtr)
+    {
+        m_sortedChunks[position].store(m_sortedChunks[position - 1].load(memory_order_relaxed), memory_order_relaxed);
+        position--;
+    }
+
+    m_sortedChunks[position].store(chunk, memory_order_relaxed);
+    m_sortedChunkCount.store(count + 1, memory_order_relaxed);
+    m_chunkTableVersion.store(version + 2, memory_order_release);
+
+    if (StatsPolicy::DEBUG && m_chunkCount > 1)
+    {
+        printf("  Storage Manager grown by %zu bytes to %zu bytes\n", size, m_chunkTotalSize);
+    }
+
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CommitChunk
+//
+// @description             : Commits the chunk up to the given address. Commits are done in 
+//                            steps of at least SM_COMMIT_STEP to keep the number of system 
+//                            calls low, and of whole huge pages for transparent huge pages, 
+//                            which the system can only use for a huge page committed as a 
+//                            whole. Free blocks are purged if the commit goes over the soft
+//                            limit. Must be called with the lock held.
+//
+// @param chunk             : Chunk to commit
+// @param end               : Address up to which the memory must be usable
+//
+// @returns                 : true if the memory up to end is committed, false otherwise.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::CommitChunk(sm_chunk_t *chunk, char *end)
+{
+    if (end <= chunk->committedEnd)
+    {
+        return true;
+    }
+
+    size_t pageSize = (chunk->pages == OS_PAGES_TRANSPARENT_HUGE) ? OS_HUGE_PAGE_SIZE : OsGetPageSize();
+    char *reservedEnd = chunk->chunkPtr + chunk->reservedSize;
+    size_t commitSize = (size_t)(end - chunk->committedEnd);
+    if (commitSize < SM_COMMIT_STEP)
+    {
+        commitSize = SM_COMMIT_STEP;
+    }
+
+    commitSize = (commitSize + pageSize - 1) & ~(pageSize - 1);
+    if (commitSize > (size_t)(reservedEnd - chunk->committedEnd))
+    {
+        commitSize = (size_t)(reservedEnd - chunk->committedEnd);
+    }
+
+    if (!OsCommitMemory(chunk->committedEnd, commitSize))
+    {
+        return false;
+    }
+
+    chunk->committedEnd += commitSize;
+    m_chunkCommittedSize += commitSize;
+    if (chunk->pages != OS_PAGES_SMALL)
+    {
+        m_hugeCommittedSize += commitSize;
+    }
+
+    PurgeIfNeeded();
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PrefaultThread
+//
+// @description             : Background thread which commits and faults in the memory ahead of
+//                            the bump pointer of the newest chunk. Faulting is done outside the
+//                            lock, it does not modify the memory.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::PrefaultThread()
+{
+    unique_lock<mutex> wait(m_prefaultMutex);
+
+    while (!m_prefaultStop)
+    {
+        char *start = nullptr;
+        char *end = nullptr;
+
+        {
+            lock_guard<LockPolicy> lock(m_lock);
+
+            sm_chunk_t *chunk = m_newestChunk;
+            if (chunk)
+            {
+                char *target = chunk->chunkEnd;
+                if ((size_t)(chunk->chunkEnd - chunk->currentPtr) > SM_PREFAULT_AHEAD)
+                {
+                    target = chunk->currentPtr + SM_PREFAULT_AHEAD;
+                }
+
+                CommitChunk(chunk, target);
+
+                start = (chunk->prefaultedEnd > chunk->currentPtr) ? chunk->prefaultedEnd : chunk->currentPtr;
+                end = (chunk->committedEnd < target) ? chunk->committedEnd : target;
+                if (end > chunk->prefaultedEnd)
+                {
+                    chunk->prefaultedEnd = end;
+                }
+            }
+        }
+
+        if (start < end)
+        {
+            OsPrefaultMemory(start, end - start);
+        }
+
+        m_prefaultCondition.wait_for(wait, chrono::milliseconds(10));
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CoalesceThread
+//
+// @description             : Background thread which merges the deferred frees. The lock is
+//                            given up after every slice, so an allocation waits for one slice
+//                            at most.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::CoalesceThread()
+{
+    unique_lock<mutex> wait(m_coalesceMutex);
+
+    while (!m_coalesceStop)
+    {
+        size_t merged = SM_COALESCE_SLICE;
+        while (merged == SM_COALESCE_SLICE)
+        {
+            lock_guard<LockPolicy> lock(m_lock);
+            merged = CoalesceDeferred(SM_COALESCE_SLICE);
+        }
+
+        m_coalesceCondition.wait_for(wait, chrono::milliseconds(SM_COALESCE_INTERVAL));
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PurgeThread
+//
+// @description             : Background thread which purges the free blocks whose delay is 
+//                            over. It wakes up every half of the delay, so that the memory of
+//                            a heap which no longer frees under the lock is given back too.
+//                            The lock is given up after every slice.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::PurgeThread()
+{
+    unique_lock<mutex> wait(m_purgeMutex);
+    unsigned int interval = (m_config.purgeDelay > 1) ? m_config.purgeDelay / 2 : 1;
+
+    while (!m_purgeStop)
+    {
+        size_t purged = SM_PURGE_SLICE;
+        while (purged >= SM_PURGE_SLICE)
+        {
+            lock_guard<LockPolicy> lock(m_lock);
+            m_purgeTime = (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+            purged = PurgeIfNeeded();
+        }
+
+        m_purgeCondition.wait_for(wait, chrono::milliseconds(interval));
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindChunk
+//
+// @description             : Finds the chunk containing the given address with a binary 
+//                            search over the address ordered chunk table. Safe to call without
+//                            the lock.
+//
+// @param ptr               : Address to look up
+//
+// @returns                 : Owning chunk, nullptr if the address is not in the heap.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_chunk_t* SM_CLASS::FindChunk(char *ptr)
+{
+    sm_chunk_t *chunk = nullptr;
+    unsigned int version = 0;
+
+    do
+    {
+        version = m_chunkTableVersion.load(memory_order_acquire);
+        chunk = nullptr;
+
+        unsigned int low = 0;
+        unsigned int high = m_sortedChunkCount.load(memory_order_relaxed);
+        while (low < high)
+        {
+            unsigned int middle = (low + high) / 2;
+            sm_chunk_t *candidate = m_sortedChunks[middle].load(memory_order_relaxed);
+            if (ptr < candidate->chunkPtr)
+            {
+                high = middle;
+            }
+            else if (ptr >= candidate->chunkEnd)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                chunk = candidate;
+                break;
+            }
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((version & 1) || version != m_chunkTableVersion.load(memory_order_relaxed));
+
+    return chunk;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_alloc
+//
+// @description             : This function is called from SM_ALLOC_ARRAY macro. Small blocks
+//                            are served from the calling thread's cache without locking,
+//                            everything else from the shared heap.
+//
+// @param size              : Size of memory requested for heap allocation.
+//
+// @returns                 : Pointer to start of the allocated memory
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void * SM_CLASS::SM_alloc(size_t size)
+{
+    char *block = nullptr;
+
+    if (m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        void *ptr = SM_alloc(size);
+        m_recorder.RecordAlloc(SM_TRACE_ALLOC, ptr, size);
+        return ptr;
+    }
+
+    SMLatencyTimer<decltype(m_counters), StatsPolicy::LATENCY> timer(m_counters, SM_LATENCY_ALLOC);
+
+    if (size == 0 || size > (size_t)-1 - SM_HEADER_SIZE - SM_GRANULE)
+    {
+        return nullptr;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom alloc for %zu bytes\n", size);
+
+    if (m_config.slabs && size <= SM_SLAB_LIMIT)
+    {
+        size_t sizeClass = (size - 1) / SM_GRANULE;
+        sm_threadCache_t *cache = (LockPolicy::THREAD_CACHE) ? GetThreadCache() : nullptr;
+        if (cache)
+        {
+            if (cache->slabLists[sizeClass] == nullptr)
+            {
+                RefillSlabCache(cache, sizeClass);
+            }
+
+            void *slot = cache->slabLists[sizeClass];
+            if (slot)
+            {
+                cache->slabLists[sizeClass] = *(void**)slot;
+                cache->slabCounts[sizeClass]--;
+                cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) - (sizeClass + 1) * SM_GRANULE, memory_order_relaxed);
+                m_counters.Count(SM_COUNT_CACHE_ALLOCS);
+
+                m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_CACHE, slot, size);
+                return slot;
+            }
+        }
+        else
+        {
+            lock_guard<LockPolicy> lock(m_lock);
+
+            void *slot = AllocateSlot(sizeClass);
+            if (slot)
+            {
+                m_counters.Count(SM_COUNT_SLAB_ALLOCS);
+
+                m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_SLAB, slot, size);
+                return slot;
+            }
+        }
+
+        // No slab memory left, try the variable sized blocks
+    }
+
+    // Add room for the header. Every block must be able to hold the free list 
+    // links and footer once it is recycled.
+    size_t blockSize = (size + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    if (blockSize < SM_MIN_BLOCK_SIZE)
+    {
+        blockSize = SM_MIN_BLOCK_SIZE;
+    }
+
+    if (LockPolicy::THREAD_CACHE && blockSize < SM_SMALL_BIN_LIMIT)
+    {
+        sm_threadCache_t *cache = GetThreadCache();
+        if (cache)
+        {
+            size_t sizeClass = blockSize / SM_GRANULE;
+            if (cache->lists[sizeClass] == nullptr)
+            {
+                RefillThreadCache(cache, blockSize);
+            }
+
+            sm_freeBlock_t *cachedBlock = cache->lists[sizeClass];
+            if (cachedBlock)
+            {
+                cache->lists[sizeClass] = cachedBlock->next;
+                cache->counts[sizeClass]--;
+                cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) - BlockSize((char*)cachedBlock), memory_order_relaxed);
+                m_counters.Count(SM_COUNT_CACHE_ALLOCS);
+
+                m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_CACHE, (char*)cachedBlock + SM_HEADER_SIZE, size);
+
+                if (StatsPolicy::DEBUG)
+                    printf("  Allocated %p from thread cache\n", (void*)((char*)cachedBlock + SM_HEADER_SIZE));
+
+                return (char*)cachedBlock + SM_HEADER_SIZE;
+            }
+        }
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    block = AllocateBlock(blockSize, true);
+    if (block)
+    {
+        m_tracer.Record(SM_TRACE_ALLOC, m_lastPath, block + SM_HEADER_SIZE, size);
+
+        if (StatsPolicy::DEBUG)
+            printf("  Allocated %p\n", (void*)(block + SM_HEADER_SIZE));
+
+        return block + SM_HEADER_SIZE;
+    }
+
+    m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_NONE, nullptr, size);
+    return nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_alloc_aligned
+//
+// @description             : Allocates memory whose start is a multiple of the given alignment.
+//                            Alignments up to SM_MIN_ALIGNMENT are what SM_alloc gives anyway.
+//                            For larger ones a block with enough slack is allocated, and the
+//                            unused space before and after the aligned part is given back as
+//                            free blocks.
+//
+// @param size              : Size of memory requested for heap allocation.
+// @param alignment         : Required alignment, a power of two.
+//
+// @returns                 : Pointer to start of the allocated memory, nullptr if no memory is
+//                            available or the alignment is not a power of two.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void * SM_CLASS::SM_alloc_aligned(size_t size, size_t alignment)
+{
+    if (m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        void *ptr = SM_alloc_aligned(size, alignment);
+        m_recorder.RecordAlloc(SM_TRACE_ALLOC_ALIGNED, ptr, size, alignment);
+        return ptr;
+    }
+
+    if (alignment == 0 || (alignment & (alignment - 1)))
+    {
+        return nullptr;
+    }
+
+    if (alignment <= SM_MIN_ALIGNMENT)
+    {
+        return SM_alloc(size);
+    }
+
+    if (size == 0 || size > (size_t)-1 / 2 - SM_HEADER_SIZE - SM_GRANULE || alignment > (size_t)-1 / 8)
+    {
+        return nullptr;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom aligned alloc for %zu bytes, alignment %zu\n", size, alignment);
+
+    size_t blockSize = (size + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    if (blockSize < SM_MIN_BLOCK_SIZE)
+    {
+        blockSize = SM_MIN_BLOCK_SIZE;
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    char *block = AllocateAlignedBlock(blockSize, alignment, true);
+    if (block == nullptr)
+    {
+        m_tracer.Record(SM_TRACE_ALLOC_ALIGNED, SM_TRACE_PATH_NONE, nullptr, size);
+        return nullptr;
+    }
+
+    m_tracer.Record(SM_TRACE_ALLOC_ALIGNED, m_lastPath, block + SM_HEADER_SIZE, size);
+
+    if (StatsPolicy::DEBUG)
+        printf("  Allocated %p\n", (void*)(block + SM_HEADER_SIZE));
+
+    return block + SM_HEADER_SIZE;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : AllocateAlignedBlock
+//
+// @description             : Allocates a block whose user pointer is a multiple of the given
+//                            alignment. A block with enough slack is allocated and the unused
+//                            space before and after the aligned part is given back. Must be 
+//                            called with the lock held.
+//
+// @param blockSize         : Block size including the header, a multiple of SM_GRANULE.
+// @param alignment         : Required alignment, a power of two above SM_MIN_ALIGNMENT.
+// @param countAlloc        : Whether to count this in the statistics
+//
+// @returns                 : Pointer to the block, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+char* SM_CLASS::AllocateAlignedBlock(size_t blockSize, size_t alignment, bool countAlloc)
+{
+    // The gap before the aligned block is either empty or a block of its own,
+    // so it is at most two alignments.
+    char *block = AllocateBlock(blockSize + 2 * alignment, countAlloc);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    char *ptr = (char*)(((uintptr_t)block + SM_HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    size_t leadSize = (size_t)(ptr - SM_HEADER_SIZE - block);
+    if (leadSize && leadSize < SM_MIN_BLOCK_SIZE)
+    {
+        ptr += alignment;
+        leadSize += alignment;
+    }
+
+    if (leadSize)
+    {
+        // The aligned block gets its header first, freeing the lead updates it
+        char *alignedBlock = block + leadSize;
+        SetBlockHeader(alignedBlock, BlockSize(block) - leadSize);
+        SetBlockHeader(block, leadSize | (BlockHeader(block) & SM_PREV_FREE_BIT));
+        FreeBlock(block, false);
+        block = alignedBlock;
+    }
+
+    ShrinkBlock(block, blockSize);
+    return block;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_alloc_batch
+//
+// @description             : Allocates count blocks of the same size in one go. What the 
+//                            calling thread's cache holds is taken first, the rest is taken 
+//                            under the lock once: slots one after the other, variable sized 
+//                            blocks cut from one large block. Each allocation is freed on its
+//                            own or with SM_dealloc_batch.
+//
+// @param count             : Number of allocations
+// @param size              : Size of each allocation
+// @param out               : [OUTPUT] Receives the pointers
+//
+// @returns                 : Number of allocations done, less than count if memory ran out.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::SM_alloc_batch(size_t count, size_t size, void **out)
+{
+    size_t done = 0;
+
+    if (m_recorder.IsActive())
+    {
+        while (done < count && (out[done] = SM_alloc(size)) != nullptr)
+        {
+            done++;
+        }
+
+        return done;
+    }
+
+    if (count == 0 || size == 0 || size > (size_t)-1 - SM_HEADER_SIZE - SM_GRANULE)
+    {
+        return 0;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom batch alloc of %zu x %zu bytes\n", count, size);
+
+    sm_threadCache_t *cache = (LockPolicy::THREAD_CACHE) ? GetThreadCache() : nullptr;
+
+    if (m_config.slabs && size <= SM_SLAB_LIMIT)
+    {
+        size_t sizeClass = (size - 1) / SM_GRANULE;
+        if (cache)
+        {
+            while (done < count && cache->slabLists[sizeClass])
+            {
+                void *slot = cache->slabLists[sizeClass];
+                cache->slabLists[sizeClass] = *(void**)slot;
+                out[done++] = slot;
+                m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_CACHE, slot, size);
+            }
+
+            cache->slabCounts[sizeClass] -= (unsigned int)done;
+            cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) - done * (sizeClass + 1) * SM_GRANULE, memory_order_relaxed);
+            m_counters.Count(SM_COUNT_CACHE_ALLOCS, done);
+        }
+
+        size_t cached = done;
+        lock_guard<LockPolicy> lock(m_lock);
+
+        void *slot;
+        while (done < count && (slot = AllocateSlot(sizeClass)) != nullptr)
+        {
+            out[done++] = slot;
+            m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_SLAB, slot, size);
+        }
+
+        m_counters.Count(SM_COUNT_SLAB_ALLOCS, done - cached);
+
+        // No slab memory left, the rest gets variable sized blocks
+        if (done == count)
+        {
+            return done;
+        }
+    }
+
+    size_t blockSize = (size + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    if (blockSize < SM_MIN_BLOCK_SIZE)
+    {
+        blockSize = SM_MIN_BLOCK_SIZE;
+    }
+
+    if (cache && blockSize < SM_SMALL_BIN_LIMIT)
+    {
+        size_t sizeClass = blockSize / SM_GRANULE;
+        size_t cached = 0;
+        while (done < count && cache->lists[sizeClass])
+        {
+            sm_freeBlock_t *cachedBlock = cache->lists[sizeClass];
+            cache->lists[sizeClass] = cachedBlock->next;
+            cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) - BlockSize((char*)cachedBlock), memory_order_relaxed);
+            out[done++] = (char*)cachedBlock + SM_HEADER_SIZE;
+            cached++;
+            m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_CACHE, (char*)cachedBlock + SM_HEADER_SIZE, size);
+        }
+
+        cache->counts[sizeClass] -= (unsigned int)cached;
+        m_counters.Count(SM_COUNT_CACHE_ALLOCS, cached);
+    }
+
+    if (done < count)
+    {
+        lock_guard<LockPolicy> lock(m_lock);
+
+        done += CarveBlocks(blockSize, size, count - done, out + done);
+    }
+
+    return done;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CarveBlocks
+//
+// @description             : Allocates blocks of the same size by cutting up one large block,
+//                            so the heap is searched once for all of them. If no block is 
+//                            large enough the batch is split in halves, only single blocks 
+//                            make the heap grow. Must be called with the lock held.
+//
+// @param blockSize         : Block size including the header, a multiple of SM_GRANULE.
+// @param size              : Size asked for, for the trace
+// @param count             : Number of blocks
+// @param out               : [OUTPUT] Receives the user pointers
+//
+// @returns                 : Number of blocks allocated
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::CarveBlocks(size_t blockSize, size_t size, size_t count, void **out)
+{
+    size_t done = 0;
+    size_t run = count;
+
+    while (done < count)
+    {
+        if (run > count - done)
+        {
+            run = count - done;
+        }
+
+        bool isFresh = false;
+        char *block = (run <= ((size_t)-1 / 2) / blockSize) ? AllocateBlock(blockSize * run, false, &isFresh, run == 1) : nullptr;
+        if (block == nullptr)
+        {
+            if (run == 1)
+            {
+                break;
+            }
+
+            run = (run + 1) / 2;
+            continue;
+        }
+
+        // Only the headers are written, the last block keeps what could not be split off
+        size_t lastSize = BlockSize(block) - (run - 1) * blockSize;
+        SetBlockHeader(block, ((run == 1) ? lastSize : blockSize) | (BlockHeader(block) & SM_PREV_FREE_BIT));
+        for (size_t i = 1; i < run; i++)
+        {
+            SetBlockHeader(block + i * blockSize, (i == run - 1) ? lastSize : blockSize);
+        }
+
+        for (size_t i = 0; i < run; i++)
+        {
+            out[done++] = block + i * blockSize + SM_HEADER_SIZE;
+            m_tracer.Record(SM_TRACE_ALLOC, m_lastPath, block + i * blockSize + SM_HEADER_SIZE, size);
+        }
+
+        // Recycled memory of the small bin sizes may have come from the tree, it is counted
+        // where a single block of the size would have come from
+        if (isFresh)
+        {
+            m_counters.Count(SM_COUNT_CHUNK_ALLOCS, run);
+
+            // A new chunk may have room for all the rest
+            run = count;
+        }
+        else
+        {
+            m_counters.Count((blockSize * run >= SM_SMALL_BIN_LIMIT) ? SM_COUNT_TREE_ALLOCS : SM_COUNT_MAP_ALLOCS, run);
+        }
+    }
+
+    return done;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_calloc
+//
+// @description             : Allocates zero initialized memory for an array. Memory taken 
+//                            from the chunk for the first time is known to be zero already
+//                            and is not cleared again.
+//
+// @param count             : Number of elements
+// @param size              : Size of one element
+//
+// @returns                 : Pointer to start of the allocated memory
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void * SM_CLASS::SM_calloc(size_t count, size_t size)
+{
+    if (m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        void *ptr = SM_calloc(count, size);
+        m_recorder.RecordAlloc(SM_TRACE_CALLOC, ptr, count * size);
+        return ptr;
+    }
+
+    if (size && count > (size_t)-1 / size)
+    {
+        return nullptr;
+    }
+
+    size_t totalSize = count * size;
+    if (totalSize == 0 || totalSize > (size_t)-1 - SM_HEADER_SIZE - SM_GRANULE)
+    {
+        return nullptr;
+    }
+
+    size_t blockSize = (totalSize + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    if (blockSize < SM_MIN_BLOCK_SIZE)
+    {
+        blockSize = SM_MIN_BLOCK_SIZE;
+    }
+
+    // Small blocks are cheap to clear, keep them on the slab and thread cache path
+    if ((m_config.slabs && totalSize <= SM_SLAB_LIMIT) || (LockPolicy::THREAD_CACHE && blockSize < SM_SMALL_BIN_LIMIT))
+    {
+        void *ptr = SM_alloc(totalSize);
+        if (ptr)
+        {
+            memset(ptr, 0, totalSize);
+        }
+
+        return ptr;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom calloc for %zu bytes\n", totalSize);
+
+    bool isFresh = false;
+    char *block = nullptr;
+    {
+        lock_guard<LockPolicy> lock(m_lock);
+
+        block = AllocateBlock(blockSize, true, &isFresh);
+        m_tracer.Record(SM_TRACE_CALLOC, (block) ? m_lastPath : SM_TRACE_PATH_NONE, (block) ? block + SM_HEADER_SIZE : nullptr, totalSize);
+    }
+
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    if (!isFresh)
+    {
+        memset(block + SM_HEADER_SIZE, 0, totalSize);
+    }
+
+    return block + SM_HEADER_SIZE;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_realloc
+//
+// @description             : Changes the size of an allocation, keeping its contents. The 
+//                            block is resized in place whenever possible: it shrinks by 
+//                            splitting off its tail, and grows into the free block following
+//                            it or, if it is the last block of the newest chunk, by moving 
+//                            the bump pointer. Only when neither is possible the contents are
+//                            moved, preferably into the free block before it, otherwise into
+//                            a new allocation.
+//
+// @param ptr               : Memory to resize, nullptr to allocate new memory.
+// @param size              : New size in bytes, 0 to free the memory.
+//
+// @returns                 : Pointer to the resized memory, nullptr if no memory is available
+//                            (the old memory is then left untouched) or if size was 0.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void * SM_CLASS::SM_realloc(void *ptr, size_t size)
+{
+    if (m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        void *newPtr = SM_realloc(ptr, size);
+        if (ptr == nullptr)
+        {
+            m_recorder.RecordAlloc(SM_TRACE_ALLOC, newPtr, size);
+        }
+        else if (size == 0)
+        {
+            m_recorder.RecordFree(ptr);
+        }
+        else
+        {
+            m_recorder.RecordRealloc(ptr, newPtr, size);
+        }
+
+        return newPtr;
+    }
+
+    if (ptr == nullptr)
+    {
+        return SM_alloc(size);
+    }
+
+    if (size == 0)
+    {
+        SM_dealloc(ptr);
+        return nullptr;
+    }
+
+    if (size > (size_t)-1 - SM_HEADER_SIZE - SM_GRANULE)
+    {
+        return nullptr;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom realloc of %p to %zu bytes\n", ptr, size);
+
+    // A slot can only stay where it is if the new size still fits
+    sm_slab_t *slab = FindSlab(ptr);
+    if (slab)
+    {
+        if (size <= slab->slotSize)
+        {
+            m_tracer.Record(SM_TRACE_REALLOC, SM_TRACE_PATH_IN_PLACE, ptr, size);
+            return ptr;
+        }
+
+        void *newPtr = SM_alloc(size);
+        if (newPtr)
+        {
+            memcpy(newPtr, ptr, slab->slotSize);
+            SM_dealloc(ptr);
+        }
+
+        m_tracer.Record(SM_TRACE_REALLOC, (newPtr) ? SM_TRACE_PATH_MOVED : SM_TRACE_PATH_NONE, newPtr, size);
+        return newPtr;
+    }
+
+    char *block = (char*)ptr - SM_HEADER_SIZE;
+    sm_chunk_t *chunk = ValidateBlock(block);
+    if (chunk == nullptr)
+    {
+        fprintf(stderr, "*** REALLOC ERROR: Invalid memory address provided!\n");
+        return nullptr;
+    }
+
+    size_t blockSize = (size + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    if (blockSize < SM_MIN_BLOCK_SIZE)
+    {
+        blockSize = SM_MIN_BLOCK_SIZE;
+    }
+
+    size_t oldSize = 0;
+    {
+        lock_guard<LockPolicy> lock(m_lock);
+
+        if (block >= chunk->currentPtr || IsBlockFree(block))
+        {
+            fprintf(stderr, "*** REALLOC ERROR: Invalid memory address provided!\n");
+            return nullptr;
+        }
+
+        oldSize = BlockSize(block);
+        if (blockSize <= oldSize)
+        {
+            ShrinkBlock(block, blockSize);
+            m_counters.Count(SM_COUNT_IN_PLACE_REALLOCS);
+
+            m_tracer.Record(SM_TRACE_REALLOC, SM_TRACE_PATH_IN_PLACE, ptr, size);
+            return ptr;
+        }
+
+        // Grow into the following free block and, at the end of the newest 
+        // chunk, into the untouched memory behind it.
+        char *nextBlock = block + oldSize;
+        size_t nextSize = IsBlockFree(nextBlock) ? BlockSize(nextBlock) : 0;
+        bool atChunkEnd = (chunk == m_newestChunk && nextBlock + nextSize == chunk->currentPtr);
+        size_t extraSize = (oldSize + nextSize < blockSize) ? blockSize - oldSize - nextSize : 0;
+
+        if (extraSize == 0 || (atChunkEnd && 
+            (size_t)(chunk->chunkEnd - block) >= blockSize + SM_HEADER_SIZE &&
+            CommitChunk(chunk, block + blockSize + SM_HEADER_SIZE)))
+        {
+            if (nextSize)
+            {
+                UnlinkFreeBlock(nextBlock);
+            }
+
+            if (extraSize)
+            {
+                chunk->usedSize += extraSize;
+                m_chunkUsedSize += extraSize;
+                chunk->currentPtr = block + blockSize;
+                SetBlockHeader(chunk->currentPtr, 0);
+                SetBlockHeader(block, blockSize | (BlockHeader(block) & SM_PREV_FREE_BIT));
+            }
+            else
+            {
+                MarkBlockAllocated(block, oldSize + nextSize);
+                ShrinkBlock(block, blockSize);
+            }
+
+            m_counters.Count(SM_COUNT_IN_PLACE_REALLOCS);
+
+            m_tracer.Record(SM_TRACE_REALLOC, SM_TRACE_PATH_IN_PLACE, ptr, size);
+
+            if (StatsPolicy::DEBUG)
+                printf("  Resized %p in place\n", ptr);
+
+            return ptr;
+        }
+
+        // Slide down into the free block before it. Its own predecessor is 
+        // never free, free blocks are always coalesced.
+        if (IsPrevBlockFree(block))
+        {
+            char *prevBlock = PrevBlock(block);
+            size_t prevSize = BlockSize(prevBlock);
+            if (prevSize + oldSize + nextSize >= blockSize)
+            {
+                UnlinkFreeBlock(prevBlock);
+                if (nextSize)
+                {
+                    UnlinkFreeBlock(nextBlock);
+                }
+
+                memmove(prevBlock + SM_HEADER_SIZE, ptr, oldSize - SM_HEADER_SIZE);
+                MarkBlockAllocated(prevBlock, prevSize + oldSize + nextSize);
+                ShrinkBlock(prevBlock, blockSize);
+
+                m_tracer.Record(SM_TRACE_REALLOC, SM_TRACE_PATH_MOVED, prevBlock + SM_HEADER_SIZE, size);
+
+                if (StatsPolicy::DEBUG)
+                    printf("  Moved %p to %p\n", ptr, (void*)(prevBlock + SM_HEADER_SIZE));
+
+                return prevBlock + SM_HEADER_SIZE;
+            }
+        }
+    }
+
+    // The block is owned by the caller, so it can be copied without the lock
+    void *newPtr = SM_alloc(size);
+    if (newPtr)
+    {
+        memcpy(newPtr, ptr, oldSize - SM_HEADER_SIZE);
+        SM_dealloc(ptr);
+    }
+
+    m_tracer.Record(SM_TRACE_REALLOC, (newPtr) ? SM_TRACE_PATH_MOVED : SM_TRACE_PATH_NONE, newPtr, size);
+    return newPtr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_dealloc
+//
+// @description             : This function is called from SM_DEALLOC macro. It marks the 
+//                            memory pointed to by ptr as free. Actual de-allocation DOES NOT
+//                            takes place. This memory block is then re-claimed for future
+//                            allocations from this pool. Small blocks go to the calling
+//                            thread's cache first.
+//
+// @param ptr               : Pointer to memory that needs to be freed.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_dealloc(void *ptr)
+{
+    if (ptr && m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        m_recorder.RecordFree(ptr);
+        SM_dealloc(ptr);
+        return;
+    }
+
+    SMLatencyTimer<decltype(m_counters), StatsPolicy::LATENCY> timer(m_counters, SM_LATENCY_DEALLOC);
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom dealloc for %p\n", ptr);
+
+    if (ptr == nullptr)
+    {
+        return;
+    }
+
+    sm_slab_t *slab = FindSlab(ptr);
+    if (slab)
+    {
+        sm_threadCache_t *cache = (LockPolicy::THREAD_CACHE) ? GetThreadCache() : nullptr;
+        if (cache)
+        {
+            size_t sizeClass = slab->sizeClass;
+            *(void**)ptr = cache->slabLists[sizeClass];
+            cache->slabLists[sizeClass] = ptr;
+            cache->slabCounts[sizeClass]++;
+            cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) + slab->slotSize, memory_order_relaxed);
+            m_counters.Count(SM_COUNT_FREES);
+
+            m_tracer.Record(SM_TRACE_FREE, SM_TRACE_PATH_CACHE, ptr, slab->slotSize);
+
+            if (cache->slabCounts[sizeClass] > SM_TCACHE_MAX)
+            {
+                FlushSlabCache(cache, sizeClass, SM_TCACHE_BATCH);
+            }
+
+            return;
+        }
+
+        lock_guard<LockPolicy> lock(m_lock);
+
+        m_tracer.Record(SM_TRACE_FREE, SM_TRACE_PATH_SLAB, ptr, slab->slotSize);
+        FreeSlot(slab, ptr);
+        m_counters.Count(SM_COUNT_FREES);
+
+        return;
+    }
+
+    // The header sits right before the user pointer. Validate what we can 
+    // without the lock: the block must lie inside one of the chunks.
+    char *block = (char*)ptr - SM_HEADER_SIZE;
+    sm_chunk_t *chunk = ValidateBlock(block);
+    if (chunk == nullptr)
+    {
+        fprintf(stderr, "*** DEALLOC ERROR: Invalid memory address provided!\n");
+        return;
+    }
+
+    DeallocateBlock(block, chunk);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_dealloc
+//
+// @description             : Sized form of SM_dealloc for callers which know the size they
+//                            allocated, such as sized operator delete and the allocators of
+//                            sm_allocator.h. A size above SM_SLAB_LIMIT cannot belong to a
+//                            slab slot, so the chunk and slab map lookups are skipped and the
+//                            block is freed straight from its header. Smaller sizes may be
+//                            slots or blocks and take the unsized path. Debug builds still
+//                            validate the header and check the size against the allocation.
+//
+// @param ptr               : Pointer to memory that needs to be freed.
+// @param size              : Size that was asked for when ptr was allocated or last resized
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_dealloc(void *ptr, size_t size)
+{
+    if (ptr == nullptr || m_recorder.IsActive() || (m_config.slabs && size <= SM_SLAB_LIMIT))
+    {
+        SM_dealloc(ptr);
+        return;
+    }
+
+    char *block = (char*)ptr - SM_HEADER_SIZE;
+    sm_chunk_t *chunk = nullptr;
+
+    if (StatsPolicy::DEBUG)
+    {
+        printf("\nCustom sized dealloc of %zu bytes for %p\n", size, ptr);
+
+        // The free below trusts the header, so check it the way the unsized path 
+        // does and report a wrong size instead of corrupting the bins.
+        chunk = ValidateBlock(block);
+        if (FindSlab(ptr) || chunk == nullptr || IsBlockFree(block))
+        {
+            fprintf(stderr, "*** DEALLOC ERROR: Invalid memory address provided!\n");
+            return;
+        }
+
+        if (BlockSize(block) - SM_HEADER_SIZE < size)
+        {
+            fprintf(stderr, "*** DEALLOC ERROR: Size does not match the allocation!\n");
+            return;
+        }
+    }
+
+    SMLatencyTimer<decltype(m_counters), StatsPolicy::LATENCY> timer(m_counters, SM_LATENCY_DEALLOC);
+
+    DeallocateBlock(block, chunk);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : IsCacheableBlock
+//
+// @description             : Tells whether a freed block may go to a thread cache: it must be
+//                            of a small bin size and neither free already nor waiting to be
+//                            coalesced, which the heap path reports as a double free.
+//
+// @param block             : Block that needs to be freed
+//
+// @returns                 : true if the block may be cached
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::IsCacheableBlock(char *block)
+{
+    return LockPolicy::THREAD_CACHE && BlockSize(block) < SM_SMALL_BIN_LIMIT && !IsBlockFree(block) && !IsBlockDeferred(block);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : DeallocateBlock
+//
+// @description             : Frees a variable sized block for SM_dealloc. Small blocks go to
+//                            the calling thread's cache, the others back to the heap under
+//                            the lock.
+//
+// @param block             : Block that needs to be freed
+// @param chunk             : Chunk holding the block, to check that the block was handed out.
+//                            nullptr when the caller vouches for the block.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::DeallocateBlock(char *block, sm_chunk_t *chunk)
+{
+    size_t blockSize = BlockSize(block);
+    if (IsCacheableBlock(block))
+    {
+        sm_threadCache_t *cache = GetThreadCache();
+        if (cache)
+        {
+            size_t sizeClass = blockSize / SM_GRANULE;
+            sm_freeBlock_t *cachedBlock = (sm_freeBlock_t*)block;
+            cachedBlock->next = cache->lists[sizeClass];
+            cache->lists[sizeClass] = cachedBlock;
+            cache->counts[sizeClass]++;
+            cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) + blockSize, memory_order_relaxed);
+            m_counters.Count(SM_COUNT_FREES);
+
+            m_tracer.Record(SM_TRACE_FREE, SM_TRACE_PATH_CACHE, block + SM_HEADER_SIZE, blockSize);
+
+            if (cache->counts[sizeClass] > SM_TCACHE_MAX)
+            {
+                FlushThreadCache(cache, sizeClass, SM_TCACHE_BATCH);
+            }
+
+            return;
+        }
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    if (chunk && block >= chunk->currentPtr)
+    {
+        fprintf(stderr, "*** DEALLOC ERROR: Invalid memory address provided!\n");
+        return;
+    }
+
+    FreeBlock(block, true);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_dealloc_batch
+//
+// @description             : Frees a number of allocations in one go. Small blocks and slots
+//                            go to the calling thread's cache as long as it has room. The rest
+//                            are sorted by address and freed under the lock once per
+//                            SM_BATCH_PENDING of them, neighbouring blocks being merged with
+//                            each other before they are merged with the heap.
+//
+// @param ptrs              : Pointers to free, nullptr entries are skipped.
+// @param count             : Number of pointers
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_dealloc_batch(void **ptrs, size_t count)
+{
+    if (m_recorder.IsActive())
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            SM_dealloc(ptrs[i]);
+        }
+
+        return;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom batch dealloc of %zu pointers\n", count);
+
+    sm_threadCache_t *cache = (LockPolicy::THREAD_CACHE) ? GetThreadCache() : nullptr;
+    sm_pendingFree_t pending[SM_BATCH_PENDING];
+    size_t pendingCount = 0;
+    unsigned long long cachedCount = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        void *ptr = ptrs[i];
+        if (ptr == nullptr)
+        {
+            continue;
+        }
+
+        sm_slab_t *slab = FindSlab(ptr);
+        sm_chunk_t *chunk = nullptr;
+        if (slab)
+        {
+            size_t sizeClass = slab->sizeClass;
+            if (cache && cache->slabCounts[sizeClass] < SM_TCACHE_MAX)
+            {
+                *(void**)ptr = cache->slabLists[sizeClass];
+                cache->slabLists[sizeClass] = ptr;
+                cache->slabCounts[sizeClass]++;
+                cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) + slab->slotSize, memory_order_relaxed);
+                cachedCount++;
+                m_tracer.Record(SM_TRACE_FREE, SM_TRACE_PATH_CACHE, ptr, slab->slotSize);
+                continue;
+            }
+        }
+        else
+        {
+            char *block = (char*)ptr - SM_HEADER_SIZE;
+            chunk = ValidateBlock(block);
+            if (chunk == nullptr)
+            {
+                fprintf(stderr, "*** DEALLOC ERROR: Invalid memory address provided!\n");
+                continue;
+            }
+
+            size_t blockSize = BlockSize(block);
+            size_t sizeClass = blockSize / SM_GRANULE;
+            if (cache && IsCacheableBlock(block) && cache->counts[sizeClass] < SM_TCACHE_MAX)
+            {
+                sm_freeBlock_t *cachedBlock = (sm_freeBlock_t*)block;
+                cachedBlock->next = cache->lists[sizeClass];
+                cache->lists[sizeClass] = cachedBlock;
+                cache->counts[sizeClass]++;
+                cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) + blockSize, memory_order_relaxed);
+                cachedCount++;
+                m_tracer.Record(SM_TRACE_FREE, SM_TRACE_PATH_CACHE, ptr, blockSize);
+                continue;
+            }
+
+            ptr = block;
+        }
+
+        pending[pendingCount].ptr = (char*)ptr;
+        pending[pendingCount].slab = slab;
+        pending[pendingCount].chunk = chunk;
+        pendingCount++;
+        if (pendingCount == SM_BATCH_PENDING)
+        {
+            FreePending(pending, pendingCount);
+            pendingCount = 0;
+        }
+    }
+
+    FreePending(pending, pendingCount);
+    m_counters.Count(SM_COUNT_FREES, cachedCount);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FreePending
+//
+// @description             : Frees the slots and blocks collected by SM_dealloc_batch under 
+//                            the lock. In address order, a run of blocks which follow each 
+//                            other is freed as one block, so it is merged with the heap and 
+//                            linked into a bin only once.
+//
+// @param pending           : Slots and blocks to free, sorted here.
+// @param count             : Number of entries
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::FreePending(sm_pendingFree_t *pending, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    sort(pending, pending + count, [](const sm_pendingFree_t & a, const sm_pendingFree_t & b) { return a.ptr < b.ptr; });
+
+    unsigned long long freedCount = 0;
+    lock_guard<LockPolicy> lock(m_lock);
+
+    for (size_t i = 0; i < count; )
+    {
+        char *block = pending[i].ptr;
+        if (pending[i].slab)
+        {
+            m_tracer.Record(SM_TRACE_FREE, SM_TRACE_PATH_SLAB, block, pending[i].slab->slotSize);
+            FreeSlot(pending[i].slab, block);
+            freedCount++;
+            i++;
+            continue;
+        }
+
+        // The same pointer twice is only caught here, a block inside a run is not marked free
+        if (block >= pending[i].chunk->currentPtr || IsBlockFree(block) || IsBlockDeferred(block) || (i && pending[i - 1].ptr == block))
+        {
+            fprintf(stderr, "*** DEALLOC ERROR: Invalid or already freed memory address provided!\n");
+            i++;
+            continue;
+        }
+
+        size_t runSize = BlockSize(block);
+        m_tracer.Record(SM_TRACE_FREE, (runSize >= SM_SMALL_BIN_LIMIT) ? SM_TRACE_PATH_TREE : SM_TRACE_PATH_MAP, block + SM_HEADER_SIZE, runSize);
+        size_t next = i + 1;
+        if (CoalescePolicy::COALESCE_ON_FREE || CoalescePolicy::DEFERRED)
+        {
+            while (next < count && pending[next].ptr == block + runSize && pending[next].slab == nullptr && 
+                   block + runSize < pending[i].chunk->currentPtr && !IsBlockFree(block + runSize) && !IsBlockDeferred(block + runSize))
+            {
+                char *nextBlock = block + runSize;
+                m_tracer.Record(SM_TRACE_FREE, (BlockSize(nextBlock) >= SM_SMALL_BIN_LIMIT) ? SM_TRACE_PATH_TREE : SM_TRACE_PATH_MAP,
+                                nextBlock + SM_HEADER_SIZE, BlockSize(nextBlock));
+                runSize += BlockSize(nextBlock);
+                next++;
+            }
+
+            SetBlockHeader(block, runSize | (BlockHeader(block) & SM_PREV_FREE_BIT));
+        }
+
+        FreeBlock(block, false);
+        freedCount += next - i;
+        i = next;
+    }
+
+    m_counters.Count(SM_COUNT_FREES, freedCount);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_usable_size
+//
+// @description             : Finds out how many bytes of an allocation can be used. This is
+//                            at least the size asked for, rounded up to the slot or block size.
+//
+// @param ptr               : Pointer returned by one of the allocation functions
+//
+// @returns                 : Usable size in bytes, 0 for nullptr or an invalid pointer.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::SM_usable_size(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return 0;
+    }
+
+    sm_slab_t *slab = FindSlab(ptr);
+    if (slab)
+    {
+        return slab->slotSize;
+    }
+
+    char *block = (char*)ptr - SM_HEADER_SIZE;
+    if (ValidateBlock(block) == nullptr)
+    {
+        return 0;
+    }
+
+    return BlockSize(block) - SM_HEADER_SIZE;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OwnsPointer
+//
+// @description             : Finds out whether an address lies in one of the chunks, i.e. 
+//                            whether it may have been allocated from this Storage Manager.
+//                            Safe to call without the lock.
+//
+// @param ptr               : Address to check
+//
+// @returns                 : true if the address is inside the heap, false otherwise.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::OwnsPointer(void *ptr)
+{
+    return FindChunk((char*)ptr) != nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_region_create
+//
+// @description             : Creates a region, an arena objects are bump allocated from and 
+//                            freed all at once. The region lives in its first block.
+//
+// @param blockSize         : Size of the blocks the region takes from the heap
+//
+// @returns                 : Region, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_region_t* SM_CLASS::SM_region_create(size_t blockSize)
+{
+    if (blockSize < sizeof(sm_regionBlock_t) + sizeof(sm_region_t) + SM_GRANULE || blockSize > (size_t)-1 / 4)
+    {
+        return nullptr;
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    sm_regionBlock_t *block = AddRegionBlock(blockSize);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    sm_region_t *region = (sm_region_t*)(block + 1);
+    region->firstBlock = block;
+    region->currentBlock = block;
+    region->startPtr = (char*)region + ((sizeof(sm_region_t) + SM_GRANULE - 1) & ~(SM_GRANULE - 1));
+    region->currentPtr = region->startPtr;
+    region->endPtr = block->endPtr;
+    region->blockSize = blockSize;
+    region->size = BlockSize((char*)block - SM_HEADER_SIZE);
+    m_regionCount++;
+
+    if (StatsPolicy::DEBUG)
+        printf("  Created region %p of %zu bytes\n", (void*)region, region->size);
+
+    return region;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_region_alloc
+//
+// @description             : Allocates from a region. Moves the region's pointer forward, 
+//                            takes no lock and writes nothing to the heap unless the current
+//                            block is full. The memory must not be freed or reallocated on its
+//                            own, it is freed with the region.
+//
+// @param region            : Region
+// @param size              : Size of memory requested
+// @param alignment         : Required alignment, a power of two.
+//
+// @returns                 : Pointer to start of the allocated memory, nullptr if no memory is
+//                            available or the alignment is not a power of two.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void* SM_CLASS::SM_region_alloc(sm_region_t *region, size_t size, size_t alignment)
+{
+    if (size == 0 || size > (size_t)-1 / 4 || alignment == 0 || (alignment & (alignment - 1)) || alignment > (size_t)-1 / 8)
+    {
+        return nullptr;
+    }
+
+    char *ptr = (char*)(((uintptr_t)region->currentPtr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (ptr <= region->endPtr && size <= (size_t)(region->endPtr - ptr))
+    {
+        region->currentPtr = ptr + size;
+        return ptr;
+    }
+
+    return GrowRegion(region, size, alignment);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GrowRegion
+//
+// @description             : Moves a region on to its next block with room for an object.
+//                            Blocks kept from before the last reset are used first, then a 
+//                            new block is taken from the heap.
+//
+// @param region            : Region whose current block is full
+// @param size              : Size of the object
+// @param alignment         : Alignment of the object, a power of two.
+//
+// @returns                 : Pointer to the object, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void* SM_CLASS::GrowRegion(sm_region_t *region, size_t size, size_t alignment)
+{
+    while (region->currentBlock->next)
+    {
+        sm_regionBlock_t *block = region->currentBlock->next;
+        region->currentBlock = block;
+        region->currentPtr = (char*)(block + 1);
+        region->endPtr = block->endPtr;
+
+        char *ptr = (char*)(((uintptr_t)region->currentPtr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        if (ptr <= region->endPtr && size <= (size_t)(region->endPtr - ptr))
+        {
+            region->currentPtr = ptr + size;
+            return ptr;
+        }
+    }
+
+    size_t minSize = sizeof(sm_regionBlock_t) + size + ((alignment > SM_MIN_ALIGNMENT) ? alignment - SM_MIN_ALIGNMENT : 0);
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    sm_regionBlock_t *block = AddRegionBlock((minSize > region->blockSize) ? minSize : region->blockSize);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    region->currentBlock->next = block;
+    region->currentBlock = block;
+    region->endPtr = block->endPtr;
+    region->size += BlockSize((char*)block - SM_HEADER_SIZE);
+
+    char *ptr = (char*)(((uintptr_t)(block + 1) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    region->currentPtr = ptr + size;
+    return ptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : AddRegionBlock
+//
+// @description             : Takes a block for a region from the heap. Must be called with the
+//                            lock held.
+//
+// @param minSize           : Space needed after the block header
+//
+// @returns                 : Region block, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_regionBlock_t* SM_CLASS::AddRegionBlock(size_t minSize)
+{
+    size_t blockSize = (minSize + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    char *block = AllocateBlock(blockSize, false);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    sm_regionBlock_t *regionBlock = (sm_regionBlock_t*)(block + SM_HEADER_SIZE);
+    regionBlock->next = nullptr;
+    regionBlock->endPtr = block + BlockSize(block);
+    m_regionSize += BlockSize(block);
+    return regionBlock;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_region_reset
+//
+// @description             : Frees every object of a region at once. Only the region's pointer
+//                            is moved back to the start, the blocks are kept for what will be
+//                            allocated next, so this takes constant time.
+//
+// @param region            : Region
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_region_reset(sm_region_t *region)
+{
+    region->currentBlock = region->firstBlock;
+    region->currentPtr = region->startPtr;
+    region->endPtr = region->firstBlock->endPtr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_region_destroy
+//
+// @description             : Frees every object of a region and gives its blocks back to the
+//                            heap, taking the lock once. The objects themselves are not looked
+//                            at.
+//
+// @param region            : Region, may be nullptr.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_region_destroy(sm_region_t *region)
+{
+    if (region == nullptr)
+    {
+        return;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("  Destroying region %p of %zu bytes\n", (void*)region, region->size);
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    m_regionSize -= region->size;
+    m_regionCount--;
+
+    sm_regionBlock_t *block = region->firstBlock;
+    while (block)
+    {
+        sm_regionBlock_t *next = block->next;
+        FreeBlock((char*)block - SM_HEADER_SIZE, false);
+        block = next;
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_handle_alloc
+//
+// @description             : Allocates a movable block, reached through the returned handle.
+//                            SM_handle_pin gives the address and keeps CompactHeap from moving
+//                            the block until SM_handle_unpin. A capture records the object
+//                            by its handle, which stays the same when the block moves.
+//
+// @param size              : Size in bytes
+//
+// @returns                 : Handle, SM_NULL_HANDLE if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_handle_t SM_CLASS::SM_handle_alloc(size_t size)
+{
+    if (size == 0 || size > (size_t)-1 / 2)
+    {
+        return SM_NULL_HANDLE;
+    }
+
+    if (m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        sm_handle_t handle = SM_handle_alloc(size);
+        m_recorder.RecordAlloc(SM_TRACE_ALLOC, (void*)(uintptr_t)handle, size);
+        return handle;
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("\nCustom handle alloc for %zu bytes\n", size);
+
+    // Room for the header, the object and the handle index in the last word
+    size_t blockSize = (size + 2 * SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+    if (blockSize < SM_MIN_BLOCK_SIZE)
+    {
+        blockSize = SM_MIN_BLOCK_SIZE;
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    if (m_freeHandle == 0 && m_handleEnd == m_handleCapacity && !GrowHandleTable())
+    {
+        return SM_NULL_HANDLE;
+    }
+
+    char *block = AllocateBlock(blockSize, true);
+    if (block == nullptr)
+    {
+        m_tracer.Record(SM_TRACE_ALLOC, SM_TRACE_PATH_NONE, nullptr, size);
+        return SM_NULL_HANDLE;
+    }
+
+    size_t index = 0;
+    if (m_freeHandle)
+    {
+        index = m_freeHandle - 1;
+        m_freeHandle = m_handles[index].nextFree;
+    }
+    else
+    {
+        index = m_handleEnd++;
+    }
+
+    sm_handleEntry_t & entry = m_handles[index];
+    entry.block = block;
+    entry.pinCount = 0;
+    entry.nextFree = 0;
+
+    SetBlockHeader(block, BlockHeader(block) | SM_MOVABLE_BIT);
+    *(size_t*)(block + BlockSize(block) - SM_HEADER_SIZE) = index;
+
+    m_tracer.Record(SM_TRACE_ALLOC, m_lastPath, block + SM_HEADER_SIZE, size);
+
+    return ((sm_handle_t)entry.generation << 32) | (index + 1);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_handle_dealloc
+//
+// @description             : Frees a movable block. The handle becomes invalid, even if the
+//                            block was still pinned.
+//
+// @param handle            : Handle, may be SM_NULL_HANDLE.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_handle_dealloc(sm_handle_t handle)
+{
+    if (handle == SM_NULL_HANDLE)
+    {
+        return;
+    }
+
+    if (m_recorder.IsActive())
+    {
+        lock_guard<SMRecorder> capture(m_recorder);
+        m_recorder.RecordFree((void*)(uintptr_t)handle);
+        SM_handle_dealloc(handle);
+        return;
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    sm_handleEntry_t *entry = FindHandle(handle);
+    if (entry == nullptr)
+    {
+        fprintf(stderr, "*** DEALLOC ERROR: Invalid or already freed handle provided!\n");
+        return;
+    }
+
+    // FreeBlock counts and traces the free
+    char *block = entry->block;
+    SetBlockHeader(block, BlockHeader(block) & ~SM_MOVABLE_BIT);
+    FreeBlock(block, true);
+
+    entry->block = nullptr;
+    entry->generation++;
+    entry->nextFree = m_freeHandle;
+    m_freeHandle = (uint32_t)(entry - m_handles) + 1;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_handle_pin
+//
+// @description             : Resolves a handle to the address of its block and keeps the block
+//                            in place until the matching SM_handle_unpin. Pins nest.
+//
+// @param handle            : Handle
+//
+// @returns                 : Address of the object, nullptr for an invalid handle.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void* SM_CLASS::SM_handle_pin(sm_handle_t handle)
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    sm_handleEntry_t *entry = FindHandle(handle);
+    if (entry == nullptr)
+    {
+        return nullptr;
+    }
+
+    entry->pinCount++;
+    return entry->block + SM_HEADER_SIZE;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_handle_unpin
+//
+// @description             : Undoes one SM_handle_pin. Once the last pin is gone, the address
+//                            may change with the next CompactHeap.
+//
+// @param handle            : Handle
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::SM_handle_unpin(sm_handle_t handle)
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    sm_handleEntry_t *entry = FindHandle(handle);
+    if (entry == nullptr || entry->pinCount == 0)
+    {
+        fprintf(stderr, "*** HANDLE ERROR: Handle is not pinned!\n");
+        return;
+    }
+
+    entry->pinCount--;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : SM_handle_resolve
+//
+// @description             : Resolves a handle to the address of its block without pinning it.
+//                            The address is only good until the next CompactHeap, so this is
+//                            for heaps compacted by the same thread.
+//
+// @param handle            : Handle
+//
+// @returns                 : Address of the object, nullptr for an invalid handle.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void* SM_CLASS::SM_handle_resolve(sm_handle_t handle)
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    sm_handleEntry_t *entry = FindHandle(handle);
+    return (entry) ? entry->block + SM_HEADER_SIZE : nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindHandle
+//
+// @description             : Looks up the entry of a handle. Must be called with the lock held.
+//
+// @param handle            : Handle
+//
+// @returns                 : Entry, nullptr if the handle is invalid or was freed.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_handleEntry_t* SM_CLASS::FindHandle(sm_handle_t handle)
+{
+    size_t index = (size_t)(handle & 0xffffffff) - 1;
+    if (index >= m_handleEnd)
+    {
+        return nullptr;
+    }
+
+    sm_handleEntry_t *entry = &m_handles[index];
+    if (entry->block == nullptr || entry->generation != (uint32_t)(handle >> 32))
+    {
+        return nullptr;
+    }
+
+    return entry;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GrowHandleTable
+//
+// @description             : Doubles the handle table. It takes its memory from the system, 
+//                            like the chunks, so that it does not get in the way of compaction.
+//                            Must be called with the lock held.
+//
+// @returns                 : true on success, false if the system is out of memory or the
+//                            table cannot grow any further.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::GrowHandleTable()
+{
+    size_t capacity = (m_handleCapacity) ? 2 * m_handleCapacity : SM_HANDLE_MIN_ENTRIES;
+    if (capacity > 0xffffffff)
+    {
+        return false;
+    }
+
+    size_t pageSize = OsGetPageSize();
+    size_t size = (capacity * sizeof(sm_handleEntry_t) + pageSize - 1) & ~(pageSize - 1);
+    sm_handleEntry_t *handles = (sm_handleEntry_t*)OsReserveMemory(size);
+    if (handles == nullptr || !OsCommitMemory((char*)handles, size))
+    {
+        if (handles)
+        {
+            OsReleaseMemory((char*)handles, size);
+        }
+
+        return false;
+    }
+
+    if (m_handles)
+    {
+        memcpy(handles, m_handles, m_handleEnd * sizeof(sm_handleEntry_t));
+        OsReleaseMemory((char*)m_handles, (m_handleCapacity * sizeof(sm_handleEntry_t) + pageSize - 1) & ~(pageSize - 1));
+    }
+
+    m_handles = handles;
+    m_handleCapacity = capacity;
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CompactHeap
+//
+// @description             : Slides the unpinned movable blocks of every chunk towards the 
+//                            start of the chunk, so that the free memory between them comes
+//                            together. Other blocks, pinned blocks, slabs, region blocks and 
+//                            the blocks held in thread caches stay where they are, the free 
+//                            memory before each of them becomes one free block. Free memory at
+//                            the end of the newest chunk goes back to the chunk. Takes the
+//                            lock for the whole pass.
+//
+// @returns                 : Number of bytes moved
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::CompactHeap()
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    if (CoalescePolicy::DEFERRED)
+    {
+        CoalesceDeferred((size_t)-1);
+    }
+
+    size_t movedSize = 0;
+    for (unsigned int i = 0; i < m_chunkCount; i++)
+    {
+        sm_chunk_t & chunk = m_chunks[i];
+
+        // Free memory found so far, movable blocks are moved to its start
+        char *gap = nullptr;
+        size_t gapSize = 0;
+
+        char *block = chunk.firstBlock;
+        while (block < chunk.currentPtr)
+        {
+            size_t blockSize = BlockSize(block);
+            char *nextBlock = block + blockSize;
+
+            if (IsBlockFree(block))
+            {
+                UnlinkFreeBlock(block);
+                gap = (gap) ? gap : block;
+                gapSize += blockSize;
+            }
+            else if (gap && (BlockHeader(block) & SM_MOVABLE_BIT) &&
+                     m_handles[*(size_t*)(nextBlock - SM_HEADER_SIZE)].pinCount == 0)
+            {
+                size_t index = *(size_t*)(nextBlock - SM_HEADER_SIZE);
+                memmove(gap, block, blockSize);
+
+                // The block before the gap is never free
+                SetBlockHeader(gap, blockSize | SM_MOVABLE_BIT);
+                m_handles[index].block = gap;
+                gap += blockSize;
+                movedSize += blockSize;
+            }
+            else if (gap)
+            {
+                CloseGap(chunk, gap, gapSize);
+                gap = nullptr;
+                gapSize = 0;
+            }
+
+            block = nextBlock;
+        }
+
+        if (gap)
+        {
+            CloseGap(chunk, gap, gapSize);
+        }
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("  Compacted heap, moved %zu bytes\n", movedSize);
+
+    return movedSize;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CloseGap
+//
+// @description             : Turns the free memory gathered by CompactHeap in front of a block
+//                            that stays in place into one free block. At the end of the newest
+//                            chunk it goes back to the chunk instead. Must be called with the
+//                            lock held.
+//
+// @param chunk             : Chunk being compacted
+// @param gap               : Start of the free memory, its previous block is not free.
+// @param gapSize           : Size of the free memory
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::CloseGap(sm_chunk_t & chunk, char *gap, size_t gapSize)
+{
+    SetBlockHeader(gap, 0);
+
+    if (&chunk == m_newestChunk && gap + gapSize == chunk.currentPtr)
+    {
+        if (chunk.dirtyEnd < chunk.currentPtr)
+        {
+            chunk.dirtyEnd = chunk.currentPtr;
+        }
+
+        chunk.usedSize -= gapSize;
+        m_chunkUsedSize -= gapSize;
+        chunk.currentPtr = gap;
+        return;
+    }
+
+    MarkBlockFree(gap, gapSize);
+    LinkFreeBlock(gap);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : LockForFork
+//
+// @description             : Takes the locks of the Storage Manager before fork(), so the child
+//                            does not inherit them in the middle of a heap update. 
+//                            UnlockAfterFork releases them again in parent and child.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::LockForFork()
+{
+    m_recorder.LockForFork();
+    LockThreadSlots();
+    m_lock.lock();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : UnlockAfterFork
+//
+// @description             : Releases the locks taken by LockForFork. The child's only thread
+//                            is not the owner as far as the system is concerned, so there the
+//                            locks are created anew instead.
+//
+// @param inChild           : true when called in the child process
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::UnlockAfterFork(bool inChild)
+{
+    if (inChild)
+    {
+        // The background threads are not there in the child
+        m_config.coalesceThread = false;
+        new (&m_lock) LockPolicy();
+        UnlockThreadSlots(true);
+        m_recorder.UnlockAfterFork(true);
+        return;
+    }
+
+    m_lock.unlock();
+    UnlockThreadSlots(false);
+    m_recorder.UnlockAfterFork(false);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ValidateBlock
+//
+// @description             : Checks what can be checked about a block without the lock: it 
+//                            must lie inside one of the chunks, be aligned and have a sane 
+//                            size.
+//
+// @param block             : Block address, i.e. the user pointer minus the header.
+//
+// @returns                 : The chunk holding the block, nullptr if the block is invalid.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_chunk_t* SM_CLASS::ValidateBlock(char *block)
+{
+    sm_chunk_t *chunk = FindChunk(block);
+    if (chunk == nullptr || block < chunk->firstBlock || 
+        (uintptr_t)(block + SM_HEADER_SIZE) % SM_GRANULE || BlockSize(block) < SM_MIN_BLOCK_SIZE ||
+        BlockSize(block) > (size_t)(chunk->chunkEnd - block))
+    {
+        return nullptr;
+    }
+
+    return chunk;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : AllocateBlock
+//
+// @description             : Allocates a block from the shared heap: first from the newest
+//                            chunk, then from recycled memory and finally from a new chunk.
+//                            Must be called with the lock held.
+//
+// @param blockSize         : Block size including the header, a multiple of SM_GRANULE.
+// @param countAlloc        : Whether to count this in the statistics. Blocks moved into a
+//                            thread cache are counted when the thread hands them out.
+// @param isFresh           : [OUTPUT] Optional. Set to true if the block comes from memory 
+//                            that was never handed out before, and therefore reads as zero.
+//                            Memory the bump pointer was moved back over is not fresh.
+// @param grow              : Whether to add a chunk if there is no other memory
+//
+// @returns                 : Pointer to the block, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+char* SM_CLASS::AllocateBlock(size_t blockSize, bool countAlloc, bool *isFresh, bool grow)
+{
+    char *block = nullptr;
+    sm_chunk_t *chunk = m_newestChunk;
+
+    if (isFresh)
+    {
+        *isFresh = false;
+    }
+
+    if (CoalescePolicy::DEFERRED && !m_config.coalesceThread)
+    {
+        CoalesceDeferred(SM_COALESCE_SLICE);
+    }
+
+    // Allocate from chunk. Room is needed for the block and the new epilogue.
+    if (chunk && (size_t)(chunk->chunkEnd - chunk->currentPtr) >= blockSize + SM_HEADER_SIZE &&
+        CommitChunk(chunk, chunk->currentPtr + blockSize + SM_HEADER_SIZE))
+    {
+        if (StatsPolicy::DEBUG)
+            printf("  Allocating from chunk\n");
+
+        block = chunk->currentPtr;
+        if (countAlloc)
+        {
+            m_counters.Count(SM_COUNT_CHUNK_ALLOCS);
+        }
+
+        if (StatsPolicy::TRACE)
+        {
+            m_lastPath = SM_TRACE_PATH_CHUNK;
+        }
+
+        chunk->usedSize += blockSize;
+        m_chunkUsedSize += blockSize;
+        chunk->currentPtr = chunk->currentPtr + blockSize;
+
+        // The epilogue moves to the new end, the new block inherits its
+        // knowledge of whether the last block is free.
+        SetBlockHeader(chunk->currentPtr, 0);
+        SetBlockHeader(block, blockSize | (BlockHeader(block) & SM_PREV_FREE_BIT));
+
+        if (isFresh)
+        {
+            *isFresh = block >= chunk->dirtyEnd;
+        }
+
+        // Wake up the prefault thread once half of its lead is used up
+        if (m_config.prefault && chunk->currentPtr + SM_PREFAULT_AHEAD / 2 > chunk->prefaultedEnd)
+        {
+            m_prefaultCondition.notify_one();
+        }
+    }
+    else
+    {
+        // Allocate from recycled memory
+        block = GetMemoryFromMap(blockSize, countAlloc);
+
+        // Memory parked in this thread's cache may be what is missing. The lock
+        // is held already, so the cache is emptied without the Flush functions.
+        unsigned int index = GetThreadSlot();
+        if (block == nullptr && LockPolicy::THREAD_CACHE && index < SM_MAX_THREADS)
+        {
+            sm_threadCache_t *cache = m_threadCaches[index];
+            if (cache && cache->cachedBytes.load(memory_order_relaxed))
+            {
+                for (size_t sizeClass = 0; sizeClass < SM_SMALL_BINS; sizeClass++)
+                {
+                    ReturnCachedBlocks(cache, sizeClass, cache->counts[sizeClass]);
+                }
+
+                for (size_t sizeClass = 0; sizeClass < SM_SLAB_CLASSES; sizeClass++)
+                {
+                    ReturnCachedSlots(cache, sizeClass, cache->slabCounts[sizeClass]);
+                }
+
+                block = GetMemoryFromMap(blockSize, countAlloc);
+            }
+        }
+
+        // Merge all deferred frees before giving up on recycled memory
+        if (block == nullptr && CoalescePolicy::DEFERRED && m_deferredHead)
+        {
+            CoalesceDeferred((size_t)-1);
+            block = GetMemoryFromMap(blockSize, countAlloc);
+        }
+
+        // Grow the heap. The new chunk needs room for alignment, the block and
+        // the epilogue.
+        if (block == nullptr && grow && blockSize <= (size_t)-1 - 2 * SM_GRANULE &&
+            AddChunk(blockSize + 2 * SM_GRANULE))
+        {
+            block = AllocateBlock(blockSize, countAlloc, isFresh);
+        }
+    }
+
+    return block;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ShrinkBlock
+//
+// @description             : Cuts an allocated block down to the given size. The tail is given
+//                            back as a free block if it is large enough to form one, otherwise
+//                            the block keeps it. The tail of the last block of the newest 
+//                            chunk goes back to the chunk instead, so that it can be bump 
+//                            allocated again. Must be called with the lock held.
+//
+// @param block             : Allocated block
+// @param size              : New block size, a multiple of SM_GRANULE.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::ShrinkBlock(char *block, size_t size)
+{
+    size_t blockSize = BlockSize(block);
+    if (blockSize - size < SM_MIN_BLOCK_SIZE)
+    {
+        return;
+    }
+
+    char *tail = block + size;
+    SetBlockHeader(block, size | (BlockHeader(block) & SM_PREV_FREE_BIT));
+
+    sm_chunk_t *chunk = m_newestChunk;
+    if (chunk && block + blockSize == chunk->currentPtr)
+    {
+        if (chunk->dirtyEnd < chunk->currentPtr)
+        {
+            chunk->dirtyEnd = chunk->currentPtr;
+        }
+
+        chunk->usedSize -= blockSize - size;
+        m_chunkUsedSize -= blockSize - size;
+        chunk->currentPtr = tail;
+        SetBlockHeader(tail, 0);
+        return;
+    }
+
+    SetBlockHeader(tail, blockSize - size);
+    FreeBlock(tail, false);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FreeBlock
+//
+// @description             : Returns a block to the shared heap, coalescing it with its free
+//                            neighbours, and purges free blocks as configured. With deferred
+//                            coalescing the block is queued instead. Must be called with the
+//                            lock held.
+//
+// @param block             : Block to free
+// @param countFree         : Whether to count this in the statistics
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::FreeBlock(char *block, bool countFree)
+{
+    if (IsBlockFree(block) || IsBlockDeferred(block))
+    {
+        fprintf(stderr, "*** DEALLOC ERROR: Memory address already freed!\n");
+        return;
+    }
+
+    if (CoalescePolicy::DEFERRED)
+    {
+        SetBlockHeader(block, BlockHeader(block) | SM_DEFERRED_BIT);
+
+        sm_freeBlock_t *deferredBlock = (sm_freeBlock_t*)block;
+        deferredBlock->next = nullptr;
+        if (m_deferredTail)
+        {
+            m_deferredTail->next = deferredBlock;
+        }
+        else
+        {
+            m_deferredHead = deferredBlock;
+        }
+
+        m_deferredTail = deferredBlock;
+        m_deferredSize += BlockSize(block);
+        m_deferredCount++;
+
+        if (countFree)
+        {
+            m_counters.Count(SM_COUNT_FREES);
+
+            m_tracer.Record(SM_TRACE_FREE, (BlockSize(block) >= SM_SMALL_BIN_LIMIT) ? SM_TRACE_PATH_TREE : SM_TRACE_PATH_MAP,
+                            block + SM_HEADER_SIZE, BlockSize(block));
+        }
+
+        if (m_deferredCount > SM_COALESCE_BACKLOG)
+        {
+            CoalesceDeferred(SM_COALESCE_SLICE);
+        }
+        else if (m_config.coalesceThread && m_deferredCount == SM_COALESCE_BACKLOG / 2)
+        {
+            m_coalesceCondition.notify_one();
+        }
+
+        return;
+    }
+
+    // Do not actually deallocate memory, Mark it as free
+    int defragCount = 0;
+    char *freedBlock = block;
+    size_t freedSize = BlockSize(block);
+    if (CoalescePolicy::COALESCE_ON_FREE)
+    {
+        block = HandleFragmentedMemory(block, defragCount);
+    }
+    else
+    {
+        MarkBlockFree(block, BlockSize(block));
+    }
+
+    // Make the block available to future allocations
+    LinkFreeBlock(block);
+
+    if (StatsPolicy::DEBUG && defragCount)
+    {
+        printf ("  Memory map Defragmentation done %d times\n", defragCount);
+    }
+
+    if (countFree)
+    {
+        m_counters.Count(SM_COUNT_FREES);
+
+        m_tracer.Record(SM_TRACE_FREE, (BlockSize(block) >= SM_SMALL_BIN_LIMIT) ? SM_TRACE_PATH_TREE : SM_TRACE_PATH_MAP,
+                        freedBlock + SM_HEADER_SIZE, freedSize, defragCount);
+    }
+
+    PurgeIfNeeded();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CoalesceDeferred
+//
+// @description             : Merges queued frees with their free neighbours, oldest first, and
+//                            makes them available to allocations. Must be called with the lock
+//                            held.
+//
+// @param limit             : Maximum number of queued frees to merge
+//
+// @returns                 : Number of queued frees merged
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::CoalesceDeferred(size_t limit)
+{
+    size_t count = 0;
+    int defragCount = 0;
+
+    while (m_deferredHead && count < limit)
+    {
+        char *block = (char*)m_deferredHead;
+        m_deferredHead = m_deferredHead->next;
+        if (m_deferredHead == nullptr)
+        {
+            m_deferredTail = nullptr;
+        }
+
+        m_deferredSize -= BlockSize(block);
+        m_deferredCount--;
+        count++;
+
+        block = HandleFragmentedMemory(block, defragCount);
+        LinkFreeBlock(block);
+    }
+
+    if (StatsPolicy::DEBUG && defragCount)
+    {
+        printf ("  Memory map Defragmentation done %d times\n", defragCount);
+    }
+
+    if (count)
+    {
+        PurgeIfNeeded();
+    }
+
+    return count;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PurgeIfNeeded
+//
+// @description             : Purges the oldest large free blocks while the resident free bytes
+//                            are above the threshold or the oldest block has been free for 
+//                            longer than the delay, up to SM_PURGE_SLICE blocks. While the 
+//                            resident heap is above the soft limit, as many as it takes. The
+//                            resident heap is taken as the committed bytes minus the purged 
+//                            ones. Must be called with the lock held.
+//
+// @returns                 : Number of blocks purged
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::PurgeIfNeeded()
+{
+    if (m_purgeOldest == nullptr)
+    {
+        return 0;
+    }
+
+    if (m_config.purgeDelay && ++m_purgeTicks % SM_PURGE_TICKS == 0)
+    {
+        m_purgeTime = (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    size_t count = 0;
+    while (m_purgeOldest)
+    {
+        bool overLimit = m_config.softLimit && m_chunkCommittedSize - m_purgedSize > m_config.softLimit;
+        bool overThreshold = m_config.purgeThreshold && m_freeSize - m_purgedSize > m_config.purgeThreshold;
+        bool expired = m_config.purgeDelay && m_purgeTime - m_purgeOldest->freedAt >= m_config.purgeDelay;
+        if (!overLimit && (count >= SM_PURGE_SLICE || !(overThreshold || expired)))
+        {
+            break;
+        }
+
+        PurgeBlock(m_purgeOldest);
+        count++;
+    }
+
+    return count;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PurgeBlock
+//
+// @description             : Gives the pages inside a free block back to the system and takes
+//                            the block off the purge list. The start of the block with its 
+//                            tree links and the size at its end are kept. In chunks with huge
+//                            pages only whole huge pages are purged, so that they are not
+//                            split. Must be called with the lock held.
+//
+// @param block             : Free block on the purge list
+//
+// @returns                 : Number of bytes purged
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::PurgeBlock(sm_treeBlock_t *block)
+{
+    sm_chunk_t *chunk = FindChunk((char*)block);
+    size_t pageSize = (chunk && chunk->pages != OS_PAGES_SMALL) ? OS_HUGE_PAGE_SIZE : OsGetPageSize();
+    size_t start = ((size_t)(block + 1) + pageSize - 1) & ~(pageSize - 1);
+    size_t end = ((size_t)block + BlockSize((char*)block) - SM_HEADER_SIZE) & ~(pageSize - 1);
+    size_t size = (end > start) ? end - start : 0;
+
+    if (size)
+    {
+        OsPurgeMemory((char*)start, size);
+    }
+
+    if (StatsPolicy::DEBUG)
+        printf("  Purging %zu bytes of a %zu byte free block\n", size, BlockSize((char*)block));
+
+    RemovePurgeBlock(m_purgeOldest, m_purgeNewest, block);
+    block->purgedSize = size;
+    m_purgedSize += size;
+    return size;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PurgeMemory
+//
+// @description             : Gives the pages of all large free blocks back to the system right
+//                            away, whatever purging is configured, for instance after a load 
+//                            spike. Deferred frees are merged first. Blocks below 
+//                            SM_PURGE_MIN_BLOCK and the thread caches are left alone.
+//
+// @returns                 : Number of bytes purged
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::PurgeMemory()
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    if (CoalescePolicy::DEFERRED)
+    {
+        CoalesceDeferred((size_t)-1);
+    }
+
+    size_t purgedSize = 0;
+    while (m_purgeOldest)
+    {
+        purgedSize += PurgeBlock(m_purgeOldest);
+    }
+
+    return purgedSize;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetThreadCache
+//
+// @description             : Returns the calling thread's cache, creating it on first use.
+//                            The cache itself is allocated from the shared heap.
+//
+// @returns                 : Thread cache, nullptr if the thread has none.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_threadCache_t* SM_CLASS::GetThreadCache()
+{
+    unsigned int index = GetThreadSlot();
+    if (index >= SM_MAX_THREADS)
+    {
+        return nullptr;
+    }
+
+    sm_threadCache_t *cache = m_threadCaches[index];
+    if (cache == nullptr)
+    {
+        lock_guard<LockPolicy> lock(m_lock);
+
+        size_t blockSize = (sizeof(sm_threadCache_t) + SM_HEADER_SIZE + SM_GRANULE - 1) & ~(SM_GRANULE - 1);
+        char *block = AllocateBlock(blockSize, false);
+        if (block)
+        {
+            cache = new (block + SM_HEADER_SIZE) sm_threadCache_t();
+            memset(cache->lists, 0, sizeof(cache->lists));
+            memset(cache->counts, 0, sizeof(cache->counts));
+            memset(cache->slabLists, 0, sizeof(cache->slabLists));
+            memset(cache->slabCounts, 0, sizeof(cache->slabCounts));
+            m_threadCaches[index] = cache;
+        }
+    }
+
+    return cache;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FlushExitingThread
+//
+// @description             : Returns everything the thread cache of an exiting thread holds 
+//                            to the shared heap. The cache itself is kept for the next thread
+//                            to get the slot. Called by the exiting thread, which still owns
+//                            the slot.
+//
+// @param owner             : Storage Manager
+// @param index             : Thread slot of the exiting thread
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::FlushExitingThread(void *owner, unsigned int index)
+{
+    SM_CLASS *manager = (SM_CLASS*)owner;
+    sm_threadCache_t *cache = manager->m_threadCaches[index];
+    if (cache == nullptr)
+    {
+        return;
+    }
+
+    for (size_t sizeClass = 0; sizeClass < SM_SMALL_BINS; sizeClass++)
+    {
+        manager->FlushThreadCache(cache, sizeClass, cache->counts[sizeClass]);
+    }
+
+    for (size_t sizeClass = 0; sizeClass < SM_SLAB_CLASSES; sizeClass++)
+    {
+        manager->FlushSlabCache(cache, sizeClass, cache->slabCounts[sizeClass]);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RefillThreadCache
+//
+// @description             : Moves a batch of blocks of the given size from the shared heap
+//                            into the thread cache, taking the lock once for all of them. A
+//                            block may be slightly larger than asked for when the remainder
+//                            was too small to split off.
+//
+// @param cache             : Thread cache to fill
+// @param blockSize         : Block size of the size class to fill
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::RefillThreadCache(sm_threadCache_t *cache, size_t blockSize)
+{
+    size_t sizeClass = blockSize / SM_GRANULE;
+
+    lock_guard<LockPolicy> lock(m_lock);
+
+    for (unsigned int i = 0; i < SM_TCACHE_BATCH; i++)
+    {
+        char *block = AllocateBlock(blockSize, false);
+        if (block == nullptr)
+        {
+            break;
+        }
+
+        sm_freeBlock_t *cachedBlock = (sm_freeBlock_t*)block;
+        cachedBlock->next = cache->lists[sizeClass];
+        cache->lists[sizeClass] = cachedBlock;
+        cache->counts[sizeClass]++;
+        cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) + BlockSize(block), memory_order_relaxed);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FlushThreadCache
+//
+// @description             : Returns blocks of one size class from the thread cache to the 
+//                            shared heap, taking the lock once for all of them.
+//
+// @param cache             : Thread cache to flush
+// @param sizeClass         : Size class to flush
+// @param count             : Maximum number of blocks to return
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::FlushThreadCache(sm_threadCache_t *cache, size_t sizeClass, unsigned int count)
+{
+    if (count == 0 || cache->lists[sizeClass] == nullptr)
+    {
+        return;
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+    ReturnCachedBlocks(cache, sizeClass, count);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ReturnCachedBlocks
+//
+// @description             : Moves blocks of one size class from the thread cache back to the
+//                            shared heap. Must be called with the lock held.
+//
+// @param cache             : Thread cache to take the blocks from
+// @param sizeClass         : Size class to return
+// @param count             : Maximum number of blocks to return
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::ReturnCachedBlocks(sm_threadCache_t *cache, size_t sizeClass, unsigned int count)
+{
+    while (count && cache->lists[sizeClass])
+    {
+        char *block = (char*)cache->lists[sizeClass];
+        cache->lists[sizeClass] = cache->lists[sizeClass]->next;
+        cache->counts[sizeClass]--;
+        cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) - BlockSize(block), memory_order_relaxed);
+        FreeBlock(block, false);
+        count--;
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindSlab
+//
+// @description             : Finds out whether a pointer is a slab slot by looking up the 
+//                            slab map of its chunk. Safe to call without the lock.
+//
+// @param ptr               : User pointer
+//
+// @returns                 : The slab holding the slot, nullptr if ptr is not a slab slot.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_slab_t* SM_CLASS::FindSlab(void *ptr)
+{
+    if (!m_config.slabs)
+    {
+        return nullptr;
+    }
+
+    sm_chunk_t *chunk = FindChunk((char*)ptr);
+    if (chunk == nullptr || chunk->slabMap == nullptr)
+    {
+        return nullptr;
+    }
+
+    char *slab = SlabStart(ptr);
+    if (SlabMapEntry(chunk, slab)->load(memory_order_relaxed) == 0)
+    {
+        return nullptr;
+    }
+
+    return (sm_slab_t*)slab;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : CreateSlab
+//
+// @description             : Allocates a new slab for a size class from the shared heap and 
+//                            adds it to the class's list. The slab is an SM_SLAB_SIZE aligned
+//                            block, its slots are handed out in address order the first time.
+//                            Must be called with the lock held.
+//
+// @param sizeClass         : Slab size class, the slot size is (sizeClass + 1) * SM_GRANULE.
+//
+// @returns                 : New slab, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+sm_slab_t* SM_CLASS::CreateSlab(size_t sizeClass)
+{
+    // The block ends right before the next slab boundary, so slabs allocated
+    // one after another from the chunk lie back to back.
+    char *block = AllocateAlignedBlock(SM_SLAB_SIZE, SM_SLAB_SIZE, false);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    sm_slab_t *slab = (sm_slab_t*)(block + SM_HEADER_SIZE);
+    slab->prev = nullptr;
+    slab->next = m_slabs[sizeClass];
+    slab->freeList = nullptr;
+    slab->unusedPtr = (char*)slab + ((sizeof(sm_slab_t) + SM_GRANULE - 1) & ~(SM_GRANULE - 1));
+    slab->endPtr = block + SM_SLAB_SIZE;
+    slab->slotSize = (unsigned int)((sizeClass + 1) * SM_GRANULE);
+    slab->slotCount = (unsigned int)((slab->endPtr - slab->unusedPtr) / slab->slotSize);
+    slab->usedCount = 0;
+    slab->sizeClass = (unsigned int)sizeClass;
+
+    if (slab->next)
+    {
+        slab->next->prev = slab;
+    }
+
+    m_slabs[sizeClass] = slab;
+    m_slabCount++;
+
+    SlabMapEntry(FindChunk(block), (char*)slab)->store(1, memory_order_relaxed);
+
+    if (StatsPolicy::DEBUG)
+        printf("  Created slab %p for %u byte slots\n", (void*)slab, slab->slotSize);
+
+    return slab;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : AllocateSlot
+//
+// @description             : Takes a slot from the first slab of a size class which has free 
+//                            slots, creating a slab if there is none. Full slabs leave the 
+//                            list. Must be called with the lock held.
+//
+// @param sizeClass         : Slab size class
+//
+// @returns                 : Pointer to the slot, nullptr if no memory is available.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void* SM_CLASS::AllocateSlot(size_t sizeClass)
+{
+    sm_slab_t *slab = m_slabs[sizeClass];
+    if (slab == nullptr)
+    {
+        slab = CreateSlab(sizeClass);
+        if (slab == nullptr)
+        {
+            return nullptr;
+        }
+    }
+
+    void *slot = slab->freeList;
+    if (slot)
+    {
+        slab->freeList = *(void**)slot;
+    }
+    else
+    {
+        slot = slab->unusedPtr;
+        slab->unusedPtr += slab->slotSize;
+    }
+
+    slab->usedCount++;
+    m_slabUsedSize += slab->slotSize;
+
+    if (slab->usedCount == slab->slotCount)
+    {
+        m_slabs[sizeClass] = slab->next;
+        if (slab->next)
+        {
+            slab->next->prev = nullptr;
+        }
+
+        slab->next = nullptr;
+    }
+
+    return slot;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FreeSlot
+//
+// @description             : Returns a slot to its slab. A full slab gets back into its size
+//                            class's list, an empty one is given back to the shared heap 
+//                            unless it is the only slab of its class with free slots. Must be
+//                            called with the lock held.
+//
+// @param slab              : Slab holding the slot
+// @param ptr               : Slot to free
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::FreeSlot(sm_slab_t *slab, void *ptr)
+{
+    size_t sizeClass = slab->sizeClass;
+
+    *(void**)ptr = slab->freeList;
+    slab->freeList = ptr;
+
+    if (slab->usedCount == slab->slotCount)
+    {
+        slab->prev = nullptr;
+        slab->next = m_slabs[sizeClass];
+        if (slab->next)
+        {
+            slab->next->prev = slab;
+        }
+
+        m_slabs[sizeClass] = slab;
+    }
+
+    slab->usedCount--;
+    m_slabUsedSize -= slab->slotSize;
+
+    if (slab->usedCount == 0 && (slab->prev || slab->next))
+    {
+        if (slab->prev)
+        {
+            slab->prev->next = slab->next;
+        }
+        else
+        {
+            m_slabs[sizeClass] = slab->next;
+        }
+
+        if (slab->next)
+        {
+            slab->next->prev = slab->prev;
+        }
+
+        char *block = (char*)slab - SM_HEADER_SIZE;
+        SlabMapEntry(FindChunk(block), (char*)slab)->store(0, memory_order_relaxed);
+        m_slabCount--;
+        FreeBlock(block, false);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RefillSlabCache
+//
+// @description             : Moves a batch of slots of one size class from the slabs into the
+//                            thread cache, taking the lock once for all of them.
+//
+// @param cache             : Thread cache to fill
+// @param sizeClass         : Slab size class to fill
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::RefillSlabCache(sm_threadCache_t *cache, size_t sizeClass)
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    for (unsigned int i = 0; i < SM_TCACHE_BATCH; i++)
+    {
+        void *slot = AllocateSlot(sizeClass);
+        if (slot == nullptr)
+        {
+            break;
+        }
+
+        *(void**)slot = cache->slabLists[sizeClass];
+        cache->slabLists[sizeClass] = slot;
+        cache->slabCounts[sizeClass]++;
+        cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) + (sizeClass + 1) * SM_GRANULE, memory_order_relaxed);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FlushSlabCache
+//
+// @description             : Returns slots of one size class from the thread cache to their 
+//                            slabs, taking the lock once for all of them.
+//
+// @param cache             : Thread cache to flush
+// @param sizeClass         : Slab size class to flush
+// @param count             : Maximum number of slots to return
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::FlushSlabCache(sm_threadCache_t *cache, size_t sizeClass, unsigned int count)
+{
+    if (count == 0 || cache->slabLists[sizeClass] == nullptr)
+    {
+        return;
+    }
+
+    lock_guard<LockPolicy> lock(m_lock);
+    ReturnCachedSlots(cache, sizeClass, count);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ReturnCachedSlots
+//
+// @description             : Moves slots of one size class from the thread cache back to 
+//                            their slabs. Must be called with the lock held.
+//
+// @param cache             : Thread cache to take the slots from
+// @param sizeClass         : Slab size class to return
+// @param count             : Maximum number of slots to return
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::ReturnCachedSlots(sm_threadCache_t *cache, size_t sizeClass, unsigned int count)
+{
+    while (count && cache->slabLists[sizeClass])
+    {
+        void *slot = cache->slabLists[sizeClass];
+        cache->slabLists[sizeClass] = *(void**)slot;
+        cache->slabCounts[sizeClass]--;
+        cache->cachedBytes.store(cache->cachedBytes.load(memory_order_relaxed) - (sizeClass + 1) * SM_GRANULE, memory_order_relaxed);
+        FreeSlot(FindSlab(slot), slot);
+        count--;
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindNextFreeSpaceInMemoryMap
+//
+// @description             : Finds out the free block in Memory map next to the given block.
+//                            The blocks are walked in address order using their headers.
+//
+// @returns                 : If a free block is found, then pointer to free block, 
+//                            nullptr otherwise.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+char* SM_CLASS::FindNextFreeSpaceInMemoryMap(char *ptr)
+{
+    sm_chunk_t *chunk = FindChunk(ptr);
+    if (chunk == nullptr || ptr < chunk->firstBlock || ptr >= chunk->currentPtr)
+    {
+        return nullptr;
+    }
+
+    for (char *block = NextBlock(ptr); block < chunk->currentPtr; block = NextBlock(block))
+    {
+        if (IsBlockFree(block))
+        {
+            return block;
+        }
+    }
+
+    return nullptr;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindFreeSpaceInMemoryMap
+//
+// @description             : Finds out the largest free block. It is the rightmost block of 
+//                            the free block tree or, if the tree is empty, a block from the 
+//                            largest non-empty size class. The memory map is not traversed.
+//
+// @returns                 : If a free block is found, then pointer to free block, 
+//                            nullptr otherwise.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+char* SM_CLASS::FindFreeSpaceInMemoryMap()
+{
+    return FindLargestFreeBlock(m_freeLists);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FindFreeSpaceSizeInMemoryMap
+//
+// @description             : Finds out the total size of the free blocks in Memory map. The
+//                            total is kept up to date as blocks are linked and unlinked, the
+//                            memory map is not traversed.
+//
+// @returns                 : Total size of free blocks in bytes
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::FindFreeSpaceSizeInMemoryMap()
+{
+    return m_freeSize;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : FetchMemoryIfAvailable
+//
+// @description             : Given the block address, this function checks if it is marked 
+//                            as free and has adequate size to cater to the requested block 
+//                            size. The leftover space, if large enough to form a block of its
+//                            own, is split off and returned to the bins. Its neighbours can
+//                            not be free since free blocks are always coalesced. Block sizes 
+//                            are multiples of SM_GRANULE, so the split keeps both user 
+//                            pointers aligned.
+//
+// @returns                 : pointer to the allocated block
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+inline char *SM_CLASS::FetchMemoryIfAvailable(const size_t size, char *blockToCheck)
+{
+    char *block = nullptr; 
+    size_t originalBlockSize = BlockSize(blockToCheck);
+
+    if (StatsPolicy::DEBUG && IsBlockFree(blockToCheck))
+    {
+        printf("  Required: %zu, inMap: %zu\n", size, originalBlockSize);
+    }
+
+    if (IsBlockFree(blockToCheck) && originalBlockSize >= size)
+    {
+        block = blockToCheck;
+        UnlinkFreeBlock(block);
+
+        // What to do if there is some memory left after this allocation?
+        if (originalBlockSize - size >= SM_MIN_BLOCK_SIZE)
+        {
+            char *fragmentedBlock = block + size;
+            SetBlockHeader(fragmentedBlock, 0);
+            MarkBlockFree(fragmentedBlock, originalBlockSize - size);
+            MarkBlockAllocated(block, size);
+            LinkFreeBlock(fragmentedBlock);
+            
+            if (StatsPolicy::DEBUG)
+                printf("Adding fragmented block %p to memory map\n", (void*)fragmentedBlock);
+        }
+        else
+        {
+            MarkBlockAllocated(block, originalBlockSize);
+        }
+    }
+
+    return block;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetMemoryFromMap
+//
+// @description             : Looks for a memory block of sufficient size in the recycled memory.
+//                            The size class bins and the free block tree are searched instead
+//                            of the memory map, so the cost does not depend on the number of
+//                            blocks.
+//
+// @param size              : Block size
+// @param countAlloc        : Whether to count this in the statistics
+//
+// @returns                 : pointer to free block in recycled memory
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+char* SM_CLASS::GetMemoryFromMap(size_t size, bool countAlloc)
+{
+    char *block = nullptr;
+
+    char *blockToCheck = FitPolicy::FindFreeBlock(m_freeLists, size);
+    if (blockToCheck)
+    {
+        bool isTreeBlock = BlockSize(blockToCheck) >= SM_SMALL_BIN_LIMIT;
+        block = FetchMemoryIfAvailable(size, blockToCheck);
+        if (block)
+        {
+            if (StatsPolicy::DEBUG)
+            {
+                printf("  Adding block %p from %s\n", (void*)block, isTreeBlock ? "free block tree" : "Memory map");
+            }
+
+            if (StatsPolicy::TRACE)
+            {
+                m_lastPath = (isTreeBlock) ? SM_TRACE_PATH_TREE : SM_TRACE_PATH_MAP;
+            }
+
+            if (countAlloc)
+            {
+                m_counters.Count((isTreeBlock) ? SM_COUNT_TREE_ALLOCS : SM_COUNT_MAP_ALLOCS);
+            }
+        }
+    }
+
+    return block;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : LinkFreeBlock
+//
+// @description             : Adds a free block to the head of its size class bin, or to the 
+//                            free block tree if it is not small. Blocks large enough to be 
+//                            purged also go to the end of the purge list.
+//
+// @param freeBlock         : Free block address, its header holds the size.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::LinkFreeBlock(char *freeBlock)
+{
+    m_freeSize += BlockSize(freeBlock);
+    m_freeBlockCount++;
+    m_freeBlocksBySize[FindLastSetBit(BlockSize(freeBlock))]++;
+
+    if (BlockSize(freeBlock) >= SM_SMALL_BIN_LIMIT)
+    {
+        sm_treeBlock_t *treeBlock = (sm_treeBlock_t*)freeBlock;
+        InsertTreeBlock(m_freeLists.tree, treeBlock);
+
+        if (BlockSize(freeBlock) >= SM_PURGE_MIN_BLOCK)
+        {
+            if (m_config.purgeDelay)
+            {
+                m_purgeTime = (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+            }
+
+            treeBlock->freedAt = m_purgeTime;
+            treeBlock->purgedSize = 0;
+            AppendPurgeBlock(m_purgeOldest, m_purgeNewest, treeBlock);
+        }
+
+        return;
+    }
+
+    size_t index = GetBinIndex(BlockSize(freeBlock));
+    sm_freeBlock_t *block = (sm_freeBlock_t*)freeBlock;
+
+    block->prev = nullptr;
+    block->next = m_freeLists.bins[index];
+    if (block->next)
+    {
+        block->next->prev = block;
+    }
+
+    m_freeLists.bins[index] = block;
+    m_freeLists.binBitmap[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : UnlinkFreeBlock
+//
+// @description             : Removes a free block from its size class bin or from the free
+//                            block tree, and from the purge list. What was purged of it no 
+//                            longer counts as purged, its pages come back as it is used.
+//
+// @param freeBlock         : Free block address, its header must hold the size it was 
+//                            linked with.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::UnlinkFreeBlock(char *freeBlock)
+{
+    m_freeSize -= BlockSize(freeBlock);
+    m_freeBlockCount--;
+    m_freeBlocksBySize[FindLastSetBit(BlockSize(freeBlock))]--;
+
+    if (BlockSize(freeBlock) >= SM_SMALL_BIN_LIMIT)
+    {
+        sm_treeBlock_t *treeBlock = (sm_treeBlock_t*)freeBlock;
+        RemoveTreeBlock(m_freeLists.tree, treeBlock);
+
+        if (BlockSize(freeBlock) >= SM_PURGE_MIN_BLOCK)
+        {
+            RemovePurgeBlock(m_purgeOldest, m_purgeNewest, treeBlock);
+            m_purgedSize -= treeBlock->purgedSize;
+        }
+
+        return;
+    }
+
+    size_t index = GetBinIndex(BlockSize(freeBlock));
+    sm_freeBlock_t *block = (sm_freeBlock_t*)freeBlock;
+
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+    else
+    {
+        m_freeLists.bins[index] = block->next;
+    }
+
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+
+    if (m_freeLists.bins[index] == nullptr)
+    {
+        m_freeLists.binBitmap[index / 64] &= ~((uint64_t)1 << (index % 64));
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : DefragmentMemoryMap
+//
+// @description             : NOT USED. Looks for consecutive free blocks and merges them. Since
+//                            freed blocks are coalesced right away this only finds something 
+//                            when the coalescing policy does not coalesce on free.
+//
+// @returns                 : Number of times defragmentation was done
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+int SM_CLASS::DefragmentMemoryMap()
+{
+    int count = 0;
+
+    if (StatsPolicy::DEBUG)
+        printf("  Defragmenting memory map...\n");
+
+    for (unsigned int i = 0; i < m_chunkCount; i++)
+    {
+        sm_chunk_t & chunk = m_chunks[i];
+        for (char *block = chunk.firstBlock; block < chunk.currentPtr; block = NextBlock(block))
+        {
+            if (IsBlockFree(block) && IsBlockFree(NextBlock(block)))
+            {
+                UnlinkFreeBlock(block);
+                block = HandleFragmentedMemory(block, count);
+                LinkFreeBlock(block);
+            }
+        }
+    }
+
+    return count;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : HandleFragmentedMemory
+//
+// @description             : Marks a block as free and merges it with the free blocks 
+//                            immediately before and after it, using the boundary tags. The
+//                            merged neighbours are removed from their bins, the resulting
+//                            block is NOT linked into a bin.
+//
+// @param block             : Current block address
+// @param mergeCount        : [OUTPUT] Incremented once for every merge done.
+//
+// @returns                 : Start address of the merged free block
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+char* SM_CLASS::HandleFragmentedMemory(char *block, int & mergeCount)
+{
+    size_t size = BlockSize(block);
+
+    // The epilogue at the chunk's currentPtr is never free, so this stops at the end
+    char *nextBlock = block + size;
+    if (IsBlockFree(nextBlock))
+    {
+        if (StatsPolicy::DEBUG)
+            printf("  Merging %zu --> %zu bytes\n", size, size + BlockSize(nextBlock));
+
+        UnlinkFreeBlock(nextBlock);
+        size += BlockSize(nextBlock);
+        mergeCount++;
+    }
+
+    if (IsPrevBlockFree(block))
+    {
+        char *prevBlock = PrevBlock(block);
+
+        if (StatsPolicy::DEBUG)
+            printf("  Merging %zu --> %zu bytes\n", BlockSize(prevBlock), size + BlockSize(prevBlock));
+
+        UnlinkFreeBlock(prevBlock);
+        size += BlockSize(prevBlock);
+        block = prevBlock;
+        mergeCount++;
+    }
+
+    MarkBlockFree(block, size);
+    return block;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : DisplayLargestFreeBlock
+//
+// @description             : Displays the largest block of recycled memory
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::DisplayLargestFreeBlock()
+{
+    char *block = FindFreeSpaceInMemoryMap();
+    printf("  Largest free block : %p %zu bytes\n", (void*)block, block ? BlockSize(block) : 0);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : DisplayMemoryMapDetails
+//
+// @description             : Displays the address, size and free/occupied status of every
+//                            block in the used part of the chunk.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::DisplayMemoryMapDetails()
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    printf("\n");
+    printf("+-----------------------------------------------+\n");
+    printf("|               Memory map                      |\n");
+    printf("+-----------------------------------------------+\n");
+    unsigned int index = 1;
+    for (unsigned int i = 0; i < m_chunkCount; i++)
+    {
+        sm_chunk_t & chunk = m_chunks[i];
+        if (i > 0)
+        {
+            printf("|-----------------------------------------------|\n");
+        }
+
+        for (char *block = chunk.firstBlock; block < chunk.currentPtr; block = NextBlock(block))
+        {
+            printf("| %3u) %p : %-4zu bytes   <%-8s>     |\n", index, (void*)(block + SM_HEADER_SIZE), BlockSize(block), IsBlockFree(block) ? "  Free  " : "Occupied");
+            index++;
+        }
+    }
+    printf("+-----------------------------------------------+\n");
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetStats
+//
+// @description             : Takes the statistics. All of them are kept up to date as the heap
+//                            changes, only the largest free block is looked up, in the free 
+//                            block tree. The state of the heap is taken under the lock, the
+//                            counters are added up from the per-thread shards without it, so
+//                            allocation goes on meanwhile. The resident size is taken as the
+//                            committed size minus the purged size, the huge page size as the
+//                            committed size of the chunks which asked for huge pages. 
+//                            MeasureResidentSize and MeasureHugePageSize ask the system.
+//
+// @param stats             : [OUTPUT] Statistics
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::GetStats(sm_stats_t & stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    m_counters.Collect(stats);
+    stats.hasLatency = StatsPolicy::LATENCY;
+
+    GetHeapStats(stats);
+
+    stats.residentSize = stats.committedSize - stats.purgedSize;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : MeasureResidentSize
+//
+// @description             : Asks the system how much of the heap is resident in physical 
+//                            memory. Unlike GetStats this walks the page tables of every chunk
+//                            as far as it is reserved, which takes time in proportion to the 
+//                            reserved size. It is done without the lock.
+//
+// @returns                 : Resident bytes. Where the system does not tell, the committed 
+//                            size minus the purged size, as in GetStats.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::MeasureResidentSize()
+{
+    unsigned int chunkCount = 0;
+    size_t estimate = 0;
+    {
+        lock_guard<LockPolicy> lock(m_lock);
+        chunkCount = m_chunkCount;
+        estimate = m_chunkCommittedSize - m_purgedSize;
+    }
+
+    // Chunks are never changed once added, the lock taken above makes them visible
+    size_t residentSize = 0;
+    for (unsigned int i = 0; i < chunkCount; i++)
+    {
+        size_t residentBytes = 0;
+        if (!OsGetResidentBytes(m_chunks[i].chunkPtr, m_chunks[i].reservedSize, residentBytes))
+        {
+            return estimate;
+        }
+
+        residentSize += residentBytes;
+    }
+
+    return residentSize;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : MeasureHugePageSize
+//
+// @description             : Asks the system how much of the heap is backed by huge pages. On
+//                            Linux this reads /proc/self/smaps, once for all chunks, which 
+//                            takes time in proportion to the mappings of the process. The file
+//                            is read without the lock.
+//
+// @returns                 : Bytes backed by huge pages, 0 without huge pages or where the 
+//                            system does not tell.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::MeasureHugePageSize()
+{
+    char *ranges[SM_MAX_CHUNKS];
+    size_t sizes[SM_MAX_CHUNKS];
+    unsigned int count = 0;
+    {
+        lock_guard<LockPolicy> lock(m_lock);
+        for (unsigned int i = 0; i < m_sortedChunkCount.load(memory_order_relaxed); i++)
+        {
+            sm_chunk_t *chunk = m_sortedChunks[i].load(memory_order_relaxed);
+            if (chunk->pages != OS_PAGES_SMALL)
+            {
+                ranges[count] = chunk->chunkPtr;
+                sizes[count] = chunk->reservedSize;
+                count++;
+            }
+        }
+    }
+
+    return (count) ? OsGetHugePageBytes(ranges, sizes, count) : 0;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetHeapStats
+//
+// @description             : Takes the part of the statistics describing the state of the 
+//                            heap, under the lock.
+//
+// @param stats             : [OUTPUT] Statistics
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::GetHeapStats(sm_stats_t & stats)
+{
+    lock_guard<LockPolicy> lock(m_lock);
+
+    for (unsigned int i = 0; i < SM_MAX_THREADS; i++)
+    {
+        if (m_threadCaches[i])
+        {
+            stats.threadCacheSize += m_threadCaches[i]->cachedBytes.load(memory_order_relaxed);
+        }
+    }
+
+    char *largestBlock = FindLargestFreeBlock(m_freeLists);
+    stats.heapSize = m_chunkTotalSize;
+    stats.committedSize = m_chunkCommittedSize;
+    stats.hugePageSize = m_hugeCommittedSize;
+    stats.purgedSize = m_purgedSize;
+    stats.usedSize = m_chunkUsedSize;
+    stats.freeSize = m_freeSize;
+    stats.freeBlockCount = m_freeBlockCount;
+    stats.largestFreeBlock = (largestBlock) ? BlockSize(largestBlock) : 0;
+    stats.fragmentation = (m_freeSize) ? 1.0 - (double)stats.largestFreeBlock / m_freeSize : 0.0;
+    stats.slabSize = m_slabCount * SM_SLAB_SIZE;
+    stats.slabUsedSize = m_slabUsedSize;
+    stats.chunkCount = m_chunkCount;
+    stats.slabCount = m_slabCount;
+    stats.regionSize = m_regionSize;
+    stats.regionCount = m_regionCount;
+    stats.deferredSize = m_deferredSize;
+    stats.deferredBlockCount = m_deferredCount;
+    memcpy(stats.freeBlocksBySize, m_freeBlocksBySize, sizeof(stats.freeBlocksBySize));
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ExportStats
+//
+// @description             : Writes the statistics as JSON or in the Prometheus text format,
+//                            for monitoring. Allocates nothing, so it can be called from any
+//                            context. Like snprintf, the text is cut off if the buffer is too
+//                            small, and the full length is returned.
+//
+// @param buffer            : Buffer for the text, may be nullptr if size is 0.
+// @param size              : Buffer size
+// @param format            : SM_STATS_JSON or SM_STATS_PROMETHEUS
+//
+// @returns                 : Length of the text, without the terminating zero.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::ExportStats(char *buffer, size_t size, int format)
+{
+    sm_stats_t stats;
+    GetStats(stats);
+    return FormatStats(stats, buffer, size, format);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : DisplayMemoryStats
+//
+// @description             : Memory usage statistics
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::DisplayMemoryStats()
+{
+    sm_stats_t stats;
+    GetStats(stats);
+
+    printf("+----------------------------------------------------------+\n");
+    printf("|               Storage Manager Statistics                 |\n");
+    printf("+----------------------------------------------------------+\n");
+    printf("| 1) Total chunk size                 : %-12zu bytes |\n", stats.heapSize);
+    printf("|     a) Number of chunks             : %-12u       |\n", stats.chunkCount);
+    printf("|     b) Committed                    : %-12zu bytes |\n", stats.committedSize);
+    printf("|     c) In huge page chunks          : %-12zu bytes |\n", stats.hugePageSize);
+    printf("|     d) Resident                     : %-12zu bytes |\n", stats.residentSize);
+    printf("|     e) Purged free memory           : %-12zu bytes |\n", stats.purgedSize);
+    printf("| 2) Used chunk size                  : %-12zu bytes |\n", stats.usedSize);
+    printf("| 3) Available chunk size             : %-12zu bytes |\n", stats.heapSize - stats.usedSize);
+    printf("| 4) Reusable recycled memory size    : %-12zu bytes |\n", stats.freeSize);
+    printf("|     a) Number of free blocks        : %-12zu       |\n", stats.freeBlockCount);
+    printf("|     b) Largest free block           : %-12zu bytes |\n", stats.largestFreeBlock);
+    printf("|     c) External fragmentation       : %-12.4f       |\n", stats.fragmentation);
+    printf("| 5) Memory held in thread caches     : %-12zu bytes |\n", stats.threadCacheSize);
+    printf("| 6) Memory in slabs                  : %-12zu bytes |\n", stats.slabSize);
+    printf("|     a) Number of slabs              : %-12zu       |\n", stats.slabCount);
+    printf("|     b) Used slots                   : %-12zu bytes |\n", stats.slabUsedSize);
+    printf("| 7) Total Allocs                     : %-12llu       |\n", stats.countAllocs);
+    printf("|     a) From memory chunk            : %-12llu       |\n", stats.countChunkAllocs);
+    printf("|     b) From recycled small blocks   : %-12llu       |\n", stats.countMemoryMapAllocs);
+    printf("|     c) From free block tree         : %-12llu       |\n", stats.countTreeAllocs);
+    printf("|     d) From slabs                   : %-12llu       |\n", stats.countSlabAllocs);
+    printf("|     e) From thread caches           : %-12llu       |\n", stats.countThreadCacheAllocs);
+    printf("| 8) Total Frees                      : %-12llu       |\n", stats.countFrees);
+    printf("| 9) Reallocs done in place           : %-12llu       |\n", stats.countInPlaceReallocs);
+    printf("| 10) Memory held by regions          : %-12zu bytes |\n", stats.regionSize);
+    printf("|     a) Number of regions            : %-12zu       |\n", stats.regionCount);
+    printf("| 11) Frees waiting to be coalesced   : %-12zu bytes |\n", stats.deferredSize);
+    printf("|     a) Number of blocks             : %-12zu       |\n", stats.deferredBlockCount);
+    printf("+----------------------------------------------------------+\n");
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : DumpTrace
+//
+// @description             : Writes the allocation trace to a file for tools/sm_trace_decode.
+//
+// @param fileName          : File to write
+//
+// @returns                 : true on success, false if tracing is disabled by the stats policy
+//                            or the file could not be written.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::DumpTrace(const char *fileName)
+{
+    return m_tracer.Dump(fileName);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : StartCapture
+//
+// @description             : Starts capturing every allocation, reallocation and free for
+//                            tools/sm_replay. Works in every configuration and can be started
+//                            and stopped any number of times while the program runs.
+//
+// @param fileName          : File to write
+//
+// @returns                 : true on success, false if a capture is running already or the
+//                            file could not be created.
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+bool SM_CLASS::StartCapture(const char *fileName)
+{
+    return m_recorder.Start(fileName);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : StopCapture
+//
+// @description             : Ends the capture and completes the file
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+void SM_CLASS::StopCapture()
+{
+    m_recorder.Stop();
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : GetFootprint
+//
+// @description             : Memory taken from the chunks so far, whether in use or free.
+//                            Untouched chunk memory does not count.
+//
+// @returns                 : Footprint in bytes
+//----------------------------------------------------------------------------------------------
+SM_TEMPLATE
+size_t SM_CLASS::GetFootprint()
+{
+    lock_guard<LockPolicy> lock(m_lock);
+    return m_chunkUsedSize;
+}
+
+#endif
@@ -0,0 +1,358 @@
+#include "sm_os.h"
+#include<atomic>
+#ifdef _WIN32
+#include<windows.h>
+#else
+#include<sys/mman.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<stdlib.h>
+#include<string.h>
+#endif
+
+using namespace std;
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsGetPageSize
+//
+// @description             : Size of a virtual memory page
+//
+// @returns                 : Page size in bytes
+//----------------------------------------------------------------------------------------------
+size_t OsGetPageSize()
+{
+    static size_t pageSize = 0;
+
+    if (pageSize == 0)
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        pageSize = info.dwPageSize;
+#else
+        pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+
+    return pageSize;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsReserveMemory
+//
+// @description             : Reserves address space without backing it with memory. Nothing
+//                            may be accessed before it is committed.
+//
+// @param size              : Size to reserve, a multiple of the page size.
+//
+// @returns                 : Start of the reserved range, nullptr on failure.
+//----------------------------------------------------------------------------------------------
+char* OsReserveMemory(size_t size)
+{
+#ifdef _WIN32
+    return (char*)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void *ptr = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (ptr == MAP_FAILED) ? nullptr : (char*)ptr;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsReserveHugeMemory
+//
+// @description             : Reserves address space to be backed by huge pages. Reserved huge
+//                            pages (MAP_HUGETLB) are tried first. The system sets them aside
+//                            for the whole range right away, so this fails cleanly when too
+//                            few of them are configured. Otherwise the range is aligned to a
+//                            huge page and transparent huge pages are asked for, and failing
+//                            that it is a plain reservation.
+//
+// @param size              : Size to reserve, a multiple of OS_HUGE_PAGE_SIZE.
+// @param pages             : [OUTPUT] OS_PAGES_RESERVED_HUGE, OS_PAGES_TRANSPARENT_HUGE or 
+//                            OS_PAGES_SMALL
+//
+// @returns                 : Start of the reserved range, nullptr on failure.
+//----------------------------------------------------------------------------------------------
+char* OsReserveHugeMemory(size_t size, int & pages)
+{
+    pages = OS_PAGES_SMALL;
+
+#ifdef _WIN32
+    // Large pages need a privilege and cannot be committed piece by piece
+    return OsReserveMemory(size);
+#else
+#ifdef MAP_HUGETLB
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED)
+    {
+        pages = OS_PAGES_RESERVED_HUGE;
+        return (char*)ptr;
+    }
+#endif
+
+    // Reserve one huge page more and cut off the ends, so that the range is huge page aligned
+    if (size > (size_t)-1 - OS_HUGE_PAGE_SIZE)
+    {
+        return nullptr;
+    }
+
+    char *reserved = OsReserveMemory(size + OS_HUGE_PAGE_SIZE);
+    if (reserved == nullptr)
+    {
+        return nullptr;
+    }
+
+    char *aligned = (char*)(((size_t)reserved + OS_HUGE_PAGE_SIZE - 1) & ~(OS_HUGE_PAGE_SIZE - 1));
+    if (aligned > reserved)
+    {
+        munmap(reserved, aligned - reserved);
+    }
+
+    if (reserved + OS_HUGE_PAGE_SIZE > aligned)
+    {
+        munmap(aligned + size, reserved + OS_HUGE_PAGE_SIZE - aligned);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, size, MADV_HUGEPAGE) == 0)
+    {
+        pages = OS_PAGES_TRANSPARENT_HUGE;
+    }
+#endif
+
+    return aligned;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsCommitMemory
+//
+// @description             : Makes a reserved range usable. The pages read as zero and only
+//                            get physical memory when they are first touched.
+//
+// @param ptr               : Start of the range, page aligned.
+// @param size              : Size of the range, a multiple of the page size.
+//
+// @returns                 : true on success, false otherwise.
+//----------------------------------------------------------------------------------------------
+bool OsCommitMemory(char *ptr, size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsReleaseMemory
+//
+// @description             : Gives a reserved range back to the system.
+//
+// @param ptr               : Start of the range as returned by OsReserveMemory.
+// @param size              : Size passed to OsReserveMemory.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+void OsReleaseMemory(char *ptr, size_t size)
+{
+#ifdef _WIN32
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsPrefaultMemory
+//
+// @description             : Backs a committed range with physical pages ahead of use, so the
+//                            page faults do not hit the allocating thread. The contents are 
+//                            not changed, which allows this to run concurrently with code 
+//                            that starts using the range.
+//
+// @param ptr               : Start of the committed range
+// @param size              : Size of the range
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+void OsPrefaultMemory(char *ptr, size_t size)
+{
+    size_t pageSize = OsGetPageSize();
+
+#ifdef MADV_POPULATE_WRITE
+    char *alignedPtr = (char*)((size_t)ptr & ~(pageSize - 1));
+    if (madvise(alignedPtr, size + (ptr - alignedPtr), MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+
+    // Write fault every page by atomically adding zero to its first word
+    char *page = (char*)(((size_t)ptr + pageSize - 1) & ~(pageSize - 1));
+    for (; page < ptr + size; page += pageSize)
+    {
+        ((atomic<size_t>*)page)->fetch_add(0, memory_order_relaxed);
+    }
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsPurgeMemory
+//
+// @description             : Gives the physical pages of a committed range back to the system.
+//                            The range stays committed, its pages are faulted in again when it
+//                            is used, with undefined contents. On Linux MADV_DONTNEED is used
+//                            rather than MADV_FREE, which would leave the pages counted in the
+//                            resident set until the system runs short of memory.
+//
+// @param ptr               : Start of the range, page aligned
+// @param size              : Size of the range, a multiple of the page size
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+void OsPurgeMemory(char *ptr, size_t size)
+{
+#ifdef _WIN32
+    VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+#else
+    madvise(ptr, size, MADV_DONTNEED);
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsGetResidentBytes
+//
+// @description             : Finds out how much of a reserved range is resident in physical
+//                            memory, with mincore in pieces of a buffer on the stack, so 
+//                            nothing is allocated.
+//
+// @param ptr               : Start of the range as returned by OsReserveMemory or 
+//                            OsReserveHugeMemory.
+// @param size              : Size of the range
+// @param residentBytes     : [OUTPUT] Bytes resident
+//
+// @returns                 : true on success, false where the system does not tell.
+//----------------------------------------------------------------------------------------------
+bool OsGetResidentBytes(char *ptr, size_t size, size_t & residentBytes)
+{
+    residentBytes = 0;
+
+#ifdef _WIN32
+    return false;
+#else
+    size_t pageSize = OsGetPageSize();
+    unsigned char pages[4096];
+    for (size_t offset = 0; offset < size; offset += sizeof(pages) * pageSize)
+    {
+        size_t length = size - offset;
+        if (length > sizeof(pages) * pageSize)
+        {
+            length = sizeof(pages) * pageSize;
+        }
+
+        if (mincore(ptr + offset, length, pages) != 0)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < (length + pageSize - 1) / pageSize; i++)
+        {
+            residentBytes += (pages[i] & 1) ? pageSize : 0;
+        }
+    }
+
+    return true;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : OsGetHugePageBytes
+//
+// @description             : Finds out how much of a number of reserved ranges is backed by
+//                            huge pages, from the mappings starting inside them in 
+//                            /proc/self/smaps. The file is read once for all ranges, in pieces
+//                            on the stack, so nothing is allocated.
+//
+// @param ranges            : Starts of the ranges as returned by OsReserveHugeMemory, in 
+//                            ascending order.
+// @param sizes             : Sizes of the ranges
+// @param count             : Number of ranges
+//
+// @returns                 : Bytes backed by huge pages, 0 where the system does not tell.
+//----------------------------------------------------------------------------------------------
+size_t OsGetHugePageBytes(char * const *ranges, const size_t *sizes, unsigned int count)
+{
+#ifdef __linux__
+    int file = open("/proc/self/smaps", O_RDONLY);
+    if (file < 0)
+    {
+        return 0;
+    }
+
+    size_t hugeBytes = 0;
+    bool inRange = false;
+    char buffer[4096];
+    size_t length = 0;
+    for (;;)
+    {
+        ssize_t readCount = read(file, buffer + length, sizeof(buffer) - 1 - length);
+        if (readCount <= 0)
+        {
+            break;
+        }
+
+        length += (size_t)readCount;
+        buffer[length] = 0;
+
+        // Parse the complete lines, keep the last partial one for the next read
+        char *line = buffer;
+        char *lineEnd = nullptr;
+        while ((lineEnd = strchr(line, '\n')) != nullptr)
+        {
+            *lineEnd = 0;
+
+            char *end = nullptr;
+            unsigned long long start = strtoull(line, &end, 16);
+            if (end != line && *end == '-')
+            {
+                // A mapping starts, "start-end permissions ...". Find the last range
+                // starting at or below it.
+                unsigned int low = 0;
+                unsigned int high = count;
+                while (low < high)
+                {
+                    unsigned int middle = (low + high) / 2;
+                    if ((size_t)ranges[middle] <= start)
+                    {
+                        low = middle + 1;
+                    }
+                    else
+                    {
+                        high = middle;
+                    }
+                }
+
+                inRange = low > 0 && start < (size_t)ranges[low - 1] + sizes[low - 1];
+            }
+            else if (inRange && (strncmp(line, "AnonHugePages:", 14) == 0 || strncmp(line, "Private_Hugetlb:", 16) == 0))
+            {
+                hugeBytes += (size_t)strtoull(strchr(line, ':') + 1, nullptr, 10) * 1024;
+            }
+
+            line = lineEnd + 1;
+        }
+
+        length = (size_t)(buffer + length - line);
+        memmove(buffer, line, length);
+        if (length == sizeof(buffer) - 1)
+        {
+            length = 0;
+        }
+    }
+
+    close(file);
+    return hugeBytes;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,27 @@
+#ifndef SM_OS_H
+#define SM_OS_H
+#include<stddef.h>
+
+//----------------------------------------------------------------------------------------------
+// Thin layer over the virtual memory functions of the operating system. Memory is first
+// reserved (address space only) and then committed piece by piece as it is needed.
+//----------------------------------------------------------------------------------------------
+// Pages backing a reservation of OsReserveHugeMemory. Reserved huge pages (MAP_HUGETLB) are 
+// committed from the start. Transparent huge pages are only asked for, the system may or may
+// not provide them, and need commits of whole huge pages.
+const int OS_PAGES_SMALL = 0;
+const int OS_PAGES_TRANSPARENT_HUGE = 1;
+const int OS_PAGES_RESERVED_HUGE = 2;
+const size_t OS_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+size_t OsGetPageSize();
+char* OsReserveMemory(size_t size);
+char* OsReserveHugeMemory(size_t size, int & pages);
+bool OsCommitMemory(char *ptr, size_t size);
+void OsReleaseMemory(char *ptr, size_t size);
+void OsPrefaultMemory(char *ptr, size_t size);
+void OsPurgeMemory(char *ptr, size_t size);
+bool OsGetResidentBytes(char *ptr, size_t size, size_t & residentBytes);
+size_t OsGetHugePageBytes(char * const *ranges, const size_t *sizes, unsigned int count);
+
+#endif
@@ -0,0 +1,238 @@
+#ifdef SM_PRELOAD
+#ifdef TEST
+#error "Comment out TEST in sm.h for the preload library, it prints every allocation"
+#endif
+#include "sm.h"
+#include "sm_os.h"
+#include<dlfcn.h>
+#include<errno.h>
+#include<pthread.h>
+#include<unistd.h>
+
+//----------------------------------------------------------------------------------------------
+// Replacement of the C allocation functions for use with LD_PRELOAD. Every malloc, free, calloc
+// and realloc of the program then goes to the global Storage Manager, C++ new and delete follow
+// as the standard library builds them on malloc. Memory handed out before the library took
+// over is not ours, freeing it is ignored and reallocating it is left to the next realloc.
+//----------------------------------------------------------------------------------------------
+typedef void* (*sm_reallocFunction_t)(void *ptr, size_t size);
+static atomic<sm_reallocFunction_t> g_nextRealloc;
+
+static void ForkPrepare()
+{
+    SM_GetInstance()->LockForFork();
+}
+
+static void ForkParent()
+{
+    SM_GetInstance()->UnlockAfterFork(false);
+}
+
+static void ForkChild()
+{
+    SM_GetInstance()->UnlockAfterFork(true);
+}
+
+__attribute__((constructor)) static void RegisterForkHandlers()
+{
+    pthread_atfork(ForkPrepare, ForkParent, ForkChild);
+
+    // SM_CAPTURE=<file> captures all allocations of the program for tools/sm_replay. A %p
+    // in the name is replaced by the process id, so that child processes get files of their own.
+    const char *captureFile = getenv("SM_CAPTURE");
+    StorageManager *instance = SM_GetInstance();
+    if (captureFile == nullptr || *captureFile == 0 || instance == nullptr)
+    {
+        return;
+    }
+
+    char fileName[4096];
+    const char *pidPos = strstr(captureFile, "%p");
+    if (pidPos)
+    {
+        snprintf(fileName, sizeof(fileName), "%.*s%d%s", (int)(pidPos - captureFile), captureFile, (int)getpid(), pidPos + 2);
+    }
+    else
+    {
+        snprintf(fileName, sizeof(fileName), "%s", captureFile);
+    }
+
+    if (!instance->StartCapture(fileName))
+    {
+        fprintf(stderr, "Storage Manager: cannot capture to %s\n", fileName);
+    }
+}
+
+__attribute__((destructor)) static void CompleteCapture()
+{
+    StorageManager *instance = SM_GetInstance();
+    if (instance)
+    {
+        instance->StopCapture();
+    }
+}
+
+static void* AllocateAligned(size_t alignment, size_t size)
+{
+    StorageManager *instance = SM_GetInstance();
+    void *ptr = instance ? instance->SM_alloc_aligned(size ? size : 1, alignment) : nullptr;
+    if (ptr == nullptr)
+    {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+static void* ReallocateForeign(void *ptr, size_t size)
+{
+    sm_reallocFunction_t nextRealloc = g_nextRealloc.load(memory_order_acquire);
+    if (nextRealloc == nullptr)
+    {
+        nextRealloc = (sm_reallocFunction_t)dlsym(RTLD_NEXT, "realloc");
+        g_nextRealloc.store(nextRealloc, memory_order_release);
+    }
+
+    void *newPtr = (nextRealloc) ? nextRealloc(ptr, size) : nullptr;
+    if (newPtr == nullptr && size)
+    {
+        errno = ENOMEM;
+    }
+
+    return newPtr;
+}
+
+extern "C"
+{
+
+void* malloc(size_t size)
+{
+    StorageManager *instance = SM_GetInstance();
+    void *ptr = instance ? instance->SM_alloc(size ? size : 1) : nullptr;
+    if (ptr == nullptr)
+    {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    StorageManager *instance = SM_GetInstance();
+    if (ptr && instance && instance->OwnsPointer(ptr))
+    {
+        instance->SM_dealloc(ptr);
+    }
+}
+
+void* calloc(size_t count, size_t size)
+{
+    if (count == 0 || size == 0)
+    {
+        count = 1;
+        size = 1;
+    }
+
+    StorageManager *instance = SM_GetInstance();
+    void *ptr = instance ? instance->SM_calloc(count, size) : nullptr;
+    if (ptr == nullptr)
+    {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+void* realloc(void *ptr, size_t size)
+{
+    StorageManager *instance = SM_GetInstance();
+    if (ptr && (instance == nullptr || !instance->OwnsPointer(ptr)))
+    {
+        return ReallocateForeign(ptr, size);
+    }
+
+    if (instance == nullptr)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    if (ptr && size == 0)
+    {
+        instance->SM_dealloc(ptr);
+        return nullptr;
+    }
+
+    void *newPtr = instance->SM_realloc(ptr, size ? size : 1);
+    if (newPtr == nullptr)
+    {
+        errno = ENOMEM;
+    }
+
+    return newPtr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)))
+    {
+        return EINVAL;
+    }
+
+    void *ptr = AllocateAligned(alignment, size);
+    if (ptr == nullptr)
+    {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)))
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    return AllocateAligned(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+    return AllocateAligned(OsGetPageSize(), size);
+}
+
+void* pvalloc(size_t size)
+{
+    size_t pageSize = OsGetPageSize();
+    if (size > (size_t)-1 - pageSize)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    return AllocateAligned(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    StorageManager *instance = SM_GetInstance();
+    if (ptr == nullptr || instance == nullptr || !instance->OwnsPointer(ptr))
+    {
+        return 0;
+    }
+
+    return instance->SM_usable_size(ptr);
+}
+
+}
+#endif
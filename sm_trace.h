@@ -0,0 +1,95 @@
+#ifndef SM_TRACE_H
+#define SM_TRACE_H
+#include<stdint.h>
+#include<stddef.h>
+
+//----------------------------------------------------------------------------------------------
+// Binary allocation trace. Every thread records the operations it does into a ring buffer of
+// fixed size records, so recording takes neither a lock nor a system call. A trace dump is an
+// sm_traceFileHeader_t followed by the records, each thread's in the order they happened.
+// tools/sm_trace_decode.cpp turns a dump into text or CSV.
+//----------------------------------------------------------------------------------------------
+const uint32_t SM_TRACE_MAGIC = 0x52544d53;     // "SMTR"
+const uint32_t SM_TRACE_VERSION = 1;
+
+// Records kept per thread, older ones are overwritten
+const size_t SM_TRACE_RECORDS = 16384;
+
+// Operations
+const uint8_t SM_TRACE_ALLOC = 0;
+const uint8_t SM_TRACE_ALLOC_ALIGNED = 1;
+const uint8_t SM_TRACE_CALLOC = 2;
+const uint8_t SM_TRACE_REALLOC = 3;
+const uint8_t SM_TRACE_FREE = 4;
+const uint8_t SM_TRACE_OPS = 5;
+
+// Where the memory came from or went to
+const uint8_t SM_TRACE_PATH_NONE = 0;       // Failed or invalid
+const uint8_t SM_TRACE_PATH_CHUNK = 1;      // Bump allocated from the newest chunk
+const uint8_t SM_TRACE_PATH_CACHE = 2;      // Thread cache
+const uint8_t SM_TRACE_PATH_MAP = 3;        // Recycled small blocks
+const uint8_t SM_TRACE_PATH_TREE = 4;       // Free block tree
+const uint8_t SM_TRACE_PATH_SLAB = 5;       // Slab slot
+const uint8_t SM_TRACE_PATH_IN_PLACE = 6;   // Realloc without moving
+const uint8_t SM_TRACE_PATH_MOVED = 7;      // Realloc which moved the contents
+const uint8_t SM_TRACE_PATHS = 8;
+
+static const char * const SM_TRACE_OP_NAMES[SM_TRACE_OPS] =
+    { "alloc", "alloc_aligned", "calloc", "realloc", "free" };
+static const char * const SM_TRACE_PATH_NAMES[SM_TRACE_PATHS] =
+    { "none", "chunk", "cache", "map", "tree", "slab", "in_place", "moved" };
+
+typedef struct
+{
+    uint64_t timestamp;     // Nanoseconds of the steady clock
+    uint64_t ptr;           // User pointer, the new one for realloc
+    uint64_t size;          // Size asked for, the block size for free
+    uint16_t thread;        // Thread slot
+    uint8_t op;
+    uint8_t path;
+    uint32_t mergeCount;    // Free blocks merged with a freed block
+}sm_traceRecord_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t threadCount;   // Number of threads which recorded something
+    uint64_t recordCount;
+    uint64_t lostCount;     // Records overwritten before the dump
+}sm_traceFileHeader_t;
+
+//----------------------------------------------------------------------------------------------
+// Allocation capture. Unlike the trace, a capture keeps every operation from StartCapture to
+// StopCapture and identifies allocations by object number instead of address, so that it can
+// be replayed against any allocator (tools/sm_replay.cpp). A capture file is an
+// sm_captureFileHeader_t followed by the records in the order the operations happened.
+//----------------------------------------------------------------------------------------------
+const uint32_t SM_CAPTURE_MAGIC = 0x50434d53;   // "SMCP"
+const uint32_t SM_CAPTURE_VERSION = 1;
+
+// Records buffered before they are written
+const size_t SM_CAPTURE_BUFFER_RECORDS = 4096;
+
+typedef struct
+{
+    uint64_t timestamp;     // Nanoseconds since the capture started
+    uint64_t size;          // Size asked for, 0 for free
+    uint32_t id;            // Object, numbered from 1 in the order of allocation
+    uint16_t thread;        // Thread slot
+    uint8_t op;             // SM_TRACE_ALLOC etc., realloc keeps the object number
+    uint8_t alignmentLog2;  // SM_TRACE_ALLOC_ALIGNED only
+}sm_captureRecord_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t objectCount;   // Objects allocated during the capture
+    uint64_t recordCount;   // 0 if the capture was not stopped, the file size tells then
+    uint64_t ignoredCount;  // Frees of memory allocated before the capture
+}sm_captureFileHeader_t;
+
+#endif
@@ -0,0 +1,416 @@
+#if defined(_WIN32)
+#error "sm_replay runs every replay in a child process and needs a POSIX system"
+#endif
+#include "../sm.h"
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<vector>
+#include<chrono>
+#include<unistd.h>
+#include<sys/resource.h>
+#include<sys/stat.h>
+#include<sys/wait.h>
+#if defined(__GLIBC__)
+#include<malloc.h>
+#endif
+
+//----------------------------------------------------------------------------------------------
+// Replays an allocation capture, written by StorageManager::StartCapture, against the system
+// malloc and against StorageManager configurations. The records are replayed in file order on
+// one thread, so every run does exactly the same operations. Each allocator gets its own child
+// process: a timed replay, then a second one which samples the footprint as it goes. Thread
+// numbers in the capture are not used, threads are only as concurrent as the capture shows.
+//
+//     sm_replay [--heap MB] <capture file>
+//----------------------------------------------------------------------------------------------
+
+// Operations between two footprint samples
+const size_t SAMPLE_INTERVAL = 256;
+
+// New memory is written once per page, like the program would, so that it counts in the RSS
+const size_t TOUCH_STEP = 4096;
+
+typedef struct
+{
+    double milliseconds;
+    double nsPerOp;
+    size_t peakLiveBytes;
+    size_t peakFootprint;
+    long peakRssKb;
+    uint64_t failedAllocs;
+}replay_result_t;
+
+static size_t g_heapSize = 64 * 1024 * 1024;
+
+static inline uint64_t NowNs()
+{
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long CurrentRssKb()
+{
+    long pages = 0;
+    long residentPages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == nullptr)
+    {
+        return 0;
+    }
+
+    if (fscanf(file, "%ld %ld", &pages, &residentPages) != 2)
+    {
+        residentPages = 0;
+    }
+
+    fclose(file);
+    return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+//----------------------------------------------------------------------------------------------
+// Allocators to replay against. GetFootprint returns the memory the allocator has taken for
+// the heap, in use or free.
+//----------------------------------------------------------------------------------------------
+class MallocReplay
+{
+private:
+    long m_baselineRssKb;
+
+public:
+    MallocReplay() : m_baselineRssKb(0) {}
+    void Reset() { m_baselineRssKb = CurrentRssKb(); }
+    void* Alloc(size_t size) { return malloc(size); }
+    void* AllocAligned(size_t size, size_t alignment)
+    {
+        void *ptr = nullptr;
+        return (posix_memalign(&ptr, (alignment < sizeof(void*)) ? sizeof(void*) : alignment, size) == 0) ? ptr : nullptr;
+    }
+    void* Calloc(size_t size) { return calloc(1, size); }
+    void* Realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+    void Free(void *ptr) { free(ptr); }
+
+    size_t GetFootprint()
+    {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        struct mallinfo2 info = mallinfo2();
+        return info.arena + info.hblkhd;
+#else
+        long rssKb = CurrentRssKb() - m_baselineRssKb;
+        return (rssKb > 0) ? (size_t)rssKb * 1024 : 0;
+#endif
+    }
+};
+
+template<class LockPolicy>
+class SMReplay
+{
+private:
+    typedef BasicStorageManager<SMBestFit, SMCoalesceOnFree, LockPolicy, SMNoStats> Heap;
+    Heap *m_heap;
+
+public:
+    SMReplay() : m_heap(nullptr) {}
+    ~SMReplay() { delete m_heap; }
+
+    void Reset()
+    {
+        sm_config_t config = {};
+        config.initialSize = g_heapSize;
+        config.growSize = g_heapSize;
+        config.slabs = true;
+        delete m_heap;
+        m_heap = new Heap(config);
+    }
+
+    void* Alloc(size_t size) { return m_heap->SM_alloc(size); }
+    void* AllocAligned(size_t size, size_t alignment) { return m_heap->SM_alloc_aligned(size, alignment); }
+    void* Calloc(size_t size) { return m_heap->SM_calloc(1, size); }
+    void* Realloc(void *ptr, size_t size) { return m_heap->SM_realloc(ptr, size); }
+    void Free(void *ptr) { m_heap->SM_dealloc(ptr); }
+    size_t GetFootprint() { return m_heap->GetFootprint(); }
+};
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ReadCapture
+//
+// @description             : Reads and checks a capture file. A capture which was not stopped
+//                            has no record count, then every complete record is read.
+//
+// @param fileName          : Capture file
+// @param header            : [OUTPUT] File header
+// @param records           : [OUTPUT] Records
+//
+// @returns                 : true on success, false otherwise.
+//----------------------------------------------------------------------------------------------
+static bool ReadCapture(const char *fileName, sm_captureFileHeader_t & header, vector<sm_captureRecord_t> & records)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Cannot open %s\n", fileName);
+        return false;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != SM_CAPTURE_MAGIC)
+    {
+        fprintf(stderr, "%s is not a Storage Manager capture\n", fileName);
+        fclose(file);
+        return false;
+    }
+
+    if (header.version != SM_CAPTURE_VERSION || header.recordSize != sizeof(sm_captureRecord_t))
+    {
+        fprintf(stderr, "%s has capture format version %u, expected %u\n", fileName, header.version, SM_CAPTURE_VERSION);
+        fclose(file);
+        return false;
+    }
+
+    struct stat fileStat;
+    size_t available = (fstat(fileno(file), &fileStat) == 0) ? (size_t)(fileStat.st_size - sizeof(header)) / sizeof(sm_captureRecord_t) : 0;
+    if (header.recordCount == 0)
+    {
+        fprintf(stderr, "%s was not completed, replaying the %zu records it holds\n", fileName, available);
+        header.recordCount = available;
+    }
+
+    records.resize((size_t)header.recordCount);
+    if (fread(records.data(), sizeof(sm_captureRecord_t), records.size(), file) != records.size())
+    {
+        fprintf(stderr, "%s is truncated\n", fileName);
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : Replay
+//
+// @description             : Replays the records once and frees what is left at the end,
+//                            which is not timed.
+//
+// @param allocator         : Allocator to replay against
+// @param records           : Records
+// @param objectCount       : Highest object number
+// @param result            : [OUTPUT] Footprint and live bytes, if sample is true.
+// @param sample            : Sample the footprint every SAMPLE_INTERVAL operations
+//
+// @returns                 : Duration of the replay in nanoseconds
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static uint64_t Replay(Allocator & allocator, const vector<sm_captureRecord_t> & records, size_t objectCount,
+                       replay_result_t & result, bool sample)
+{
+    vector<void*> objects(objectCount + 1, nullptr);
+    vector<size_t> sizes((sample) ? objectCount + 1 : 0, 0);
+    size_t liveBytes = 0;
+    uint64_t failed = 0;
+
+    uint64_t start = NowNs();
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const sm_captureRecord_t & record = records[i];
+        void *& ptr = objects[record.id];
+        bool success = true;
+
+        switch (record.op)
+        {
+        case SM_TRACE_ALLOC:
+            ptr = allocator.Alloc((size_t)record.size);
+            break;
+        case SM_TRACE_ALLOC_ALIGNED:
+            ptr = allocator.AllocAligned((size_t)record.size, (size_t)1 << record.alignmentLog2);
+            break;
+        case SM_TRACE_CALLOC:
+            ptr = allocator.Calloc((size_t)record.size);
+            break;
+        case SM_TRACE_REALLOC:
+        {
+            void *newPtr = allocator.Realloc(ptr, (size_t)record.size);
+            success = (newPtr != nullptr);
+            if (newPtr)
+            {
+                ptr = newPtr;
+            }
+            break;
+        }
+        case SM_TRACE_FREE:
+            allocator.Free(ptr);
+            ptr = nullptr;
+            break;
+        }
+
+        if (record.op != SM_TRACE_FREE && ptr == nullptr)
+        {
+            success = false;
+        }
+
+        if (!success)
+        {
+            failed++;
+        }
+        else if (ptr && record.op != SM_TRACE_CALLOC)
+        {
+            for (size_t offset = 0; offset < record.size; offset += TOUCH_STEP)
+            {
+                ((volatile char*)ptr)[offset] = 1;
+            }
+        }
+
+        if (sample && success)
+        {
+            liveBytes -= sizes[record.id];
+            sizes[record.id] = (ptr) ? (size_t)record.size : 0;
+            liveBytes += sizes[record.id];
+
+            if (liveBytes > result.peakLiveBytes)
+            {
+                result.peakLiveBytes = liveBytes;
+            }
+
+            if (i % SAMPLE_INTERVAL == 0 || i + 1 == records.size())
+            {
+                size_t footprint = allocator.GetFootprint();
+                if (footprint > result.peakFootprint)
+                {
+                    result.peakFootprint = footprint;
+                }
+            }
+        }
+    }
+
+    uint64_t duration = NowNs() - start;
+    result.failedAllocs = failed;
+
+    for (void *ptr : objects)
+    {
+        if (ptr)
+        {
+            allocator.Free(ptr);
+        }
+    }
+
+    return duration;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : RunInChild
+//
+// @description             : Forks, replays in the child and passes the results back through
+//                            a pipe, so that every allocator has a peak RSS of its own.
+//
+// @param allocator         : Allocator to replay against
+// @param records           : Records
+// @param objectCount       : Highest object number
+// @param result            : [OUTPUT] Results
+//
+// @returns                 : true on success, false if the child failed.
+//----------------------------------------------------------------------------------------------
+template<class Allocator>
+static bool RunInChild(Allocator & allocator, const vector<sm_captureRecord_t> & records, size_t objectCount, replay_result_t & result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+
+        replay_result_t childResult;
+        memset(&childResult, 0, sizeof(childResult));
+        long baselineRssKb = CurrentRssKb();
+
+        allocator.Reset();
+        uint64_t duration = Replay(allocator, records, objectCount, childResult, false);
+        allocator.Reset();
+        Replay(allocator, records, objectCount, childResult, true);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        childResult.peakRssKb = usage.ru_maxrss - baselineRssKb;
+        childResult.milliseconds = duration / 1e6;
+        childResult.nsPerOp = (records.empty()) ? 0 : (double)duration / records.size();
+
+        ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+        _exit(written == (ssize_t)sizeof(childResult) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool success = (pid > 0 && read(fds[0], &result, sizeof(result)) == (ssize_t)sizeof(result));
+    close(fds[0]);
+
+    int status = 0;
+    if (pid > 0)
+    {
+        waitpid(pid, &status, 0);
+    }
+
+    return success && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+template<class Allocator>
+static void Report(const char *allocatorName, const vector<sm_captureRecord_t> & records, size_t objectCount)
+{
+    Allocator allocator;
+    replay_result_t result;
+    if (!RunInChild(allocator, records, objectCount, result))
+    {
+        printf("%-12s failed\n", allocatorName);
+        return;
+    }
+
+    // Share of the largest footprint that was never needed for live data
+    double fragmentation = (result.peakFootprint > result.peakLiveBytes) ? 100.0 * (1.0 - (double)result.peakLiveBytes / result.peakFootprint) : 0;
+    printf("%-12s %10.2f %8.1f %14.2f %14.2f %8.1f %%  %12.2f %8llu\n", allocatorName, result.milliseconds, result.nsPerOp,
+           result.peakLiveBytes / 1048576.0, result.peakFootprint / 1048576.0, fragmentation, result.peakRssKb / 1024.0,
+           (unsigned long long)result.failedAllocs);
+}
+
+int main(int argc, char **argv)
+{
+    int argIndex = 1;
+    if (argc == 4 && strcmp(argv[1], "--heap") == 0)
+    {
+        g_heapSize = (size_t)strtoull(argv[2], nullptr, 10) * 1024 * 1024;
+        argIndex = 3;
+    }
+
+    if (argIndex != argc - 1 || g_heapSize == 0)
+    {
+        fprintf(stderr, "Usage: %s [--heap MB] <capture file>\n", argv[0]);
+        return 2;
+    }
+
+    sm_captureFileHeader_t header;
+    vector<sm_captureRecord_t> records;
+    if (!ReadCapture(argv[argIndex], header, records))
+    {
+        return 1;
+    }
+
+    size_t objectCount = header.objectCount;
+    for (const sm_captureRecord_t & record : records)
+    {
+        if (record.id > objectCount)
+        {
+            objectCount = record.id;
+        }
+    }
+
+    printf("Replaying %llu operations on %zu objects, %llu frees of older memory were not captured\n\n",
+           (unsigned long long)records.size(), objectCount, (unsigned long long)header.ignoredCount);
+    printf("%-12s %10s %8s %14s %14s %10s  %12s %8s\n", "allocator", "time ms", "ns/op", "peak live MB", "footprint MB",
+           "fragment.", "peak RSS MB", "failed");
+
+    Report<MallocReplay>("malloc", records, objectCount);
+    Report<SMReplay<SMThreadCacheLock>>("sm", records, objectCount);
+    Report<SMReplay<SMNoLock>>("sm-nolock", records, objectCount);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include "../sm_trace.h"
+#include<stdio.h>
+#include<string.h>
+#include<vector>
+#include<algorithm>
+
+using namespace std;
+
+//----------------------------------------------------------------------------------------------
+// Decoder for the binary allocation trace written by StorageManager::DumpTrace. Prints the
+// records of all threads merged in time order, as a table with a summary or as CSV.
+//
+//     sm_trace_decode [--csv] <trace file>
+//----------------------------------------------------------------------------------------------
+
+static const char* OpName(uint8_t op)
+{
+    return (op < SM_TRACE_OPS) ? SM_TRACE_OP_NAMES[op] : "?";
+}
+
+static const char* PathName(uint8_t path)
+{
+    return (path < SM_TRACE_PATHS) ? SM_TRACE_PATH_NAMES[path] : "?";
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : ReadTrace
+//
+// @description             : Reads and checks a trace file.
+//
+// @param fileName          : Trace file
+// @param header            : [OUTPUT] File header
+// @param records           : [OUTPUT] Records in file order
+//
+// @returns                 : true on success, false otherwise.
+//----------------------------------------------------------------------------------------------
+static bool ReadTrace(const char *fileName, sm_traceFileHeader_t & header, vector<sm_traceRecord_t> & records)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Cannot open %s\n", fileName);
+        return false;
+    }
+
+    bool success = fread(&header, sizeof(header), 1, file) == 1;
+    if (!success || header.magic != SM_TRACE_MAGIC)
+    {
+        fprintf(stderr, "%s is not a Storage Manager trace\n", fileName);
+        fclose(file);
+        return false;
+    }
+
+    if (header.version != SM_TRACE_VERSION || header.recordSize != sizeof(sm_traceRecord_t))
+    {
+        fprintf(stderr, "%s has trace format version %u, expected %u\n", fileName, header.version, SM_TRACE_VERSION);
+        fclose(file);
+        return false;
+    }
+
+    records.resize((size_t)header.recordCount);
+    if (fread(records.data(), sizeof(sm_traceRecord_t), records.size(), file) != records.size())
+    {
+        fprintf(stderr, "%s is truncated\n", fileName);
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PrintText
+//
+// @description             : Prints the records as a table, timestamps relative to the first
+//                            record, followed by the number of operations per path.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+static void PrintText(const sm_traceFileHeader_t & header, const vector<sm_traceRecord_t> & records)
+{
+    unsigned long long counts[SM_TRACE_OPS][SM_TRACE_PATHS];
+    unsigned long long merges = 0;
+    memset(counts, 0, sizeof(counts));
+
+    printf("Trace of %llu records from %u threads, %llu older records lost\n\n",
+           (unsigned long long)header.recordCount, header.threadCount, (unsigned long long)header.lostCount);
+    printf("%14s  %6s  %-13s  %-8s  %-18s  %12s  %6s\n", "time (us)", "thread", "operation", "path", "address", "size", "merged");
+
+    uint64_t start = records.empty() ? 0 : records[0].timestamp;
+    for (const sm_traceRecord_t & record : records)
+    {
+        printf("%14.3f  %6u  %-13s  %-8s  0x%016llx  %12llu  %6u\n", (record.timestamp - start) / 1000.0, record.thread,
+               OpName(record.op), PathName(record.path), (unsigned long long)record.ptr, (unsigned long long)record.size, record.mergeCount);
+
+        if (record.op < SM_TRACE_OPS && record.path < SM_TRACE_PATHS)
+        {
+            counts[record.op][record.path]++;
+        }
+
+        merges += record.mergeCount;
+    }
+
+    printf("\n%-13s", "");
+    for (uint8_t path = 0; path < SM_TRACE_PATHS; path++)
+    {
+        printf("  %10s", PathName(path));
+    }
+
+    printf("\n");
+    for (uint8_t op = 0; op < SM_TRACE_OPS; op++)
+    {
+        printf("%-13s", OpName(op));
+        for (uint8_t path = 0; path < SM_TRACE_PATHS; path++)
+        {
+            printf("  %10llu", counts[op][path]);
+        }
+
+        printf("\n");
+    }
+
+    printf("\nFree blocks merged on free: %llu\n", merges);
+}
+
+//----------------------------------------------------------------------------------------------
+// @name                    : PrintCsv
+//
+// @description             : Prints the records as CSV with absolute timestamps.
+//
+// @returns                 : Nothing
+//----------------------------------------------------------------------------------------------
+static void PrintCsv(const vector<sm_traceRecord_t> & records)
+{
+    printf("timestamp_ns,thread,operation,path,address,size,merged\n");
+    for (const sm_traceRecord_t & record : records)
+    {
+        printf("%llu,%u,%s,%s,0x%llx,%llu,%u\n", (unsigned long long)record.timestamp, record.thread, OpName(record.op),
+               PathName(record.path), (unsigned long long)record.ptr, (unsigned long long)record.size, record.mergeCount);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool csv = (argc == 3 && strcmp(argv[1], "--csv") == 0);
+    if (argc != 2 && !csv)
+    {
+        fprintf(stderr, "Usage: %s [--csv] <trace file>\n", argv[0]);
+        return 2;
+    }
+
+    sm_traceFileHeader_t header;
+    vector<sm_traceRecord_t> records;
+    if (!ReadTrace(argv[argc - 1], header, records))
+    {
+        return 1;
+    }
+
+    // The file holds one thread after the other
+    stable_sort(records.begin(), records.end(), [](const sm_traceRecord_t & a, const sm_traceRecord_t & b)
+    {
+        return a.timestamp < b.timestamp;
+    });
+
+    if (csv)
+    {
+        PrintCsv(records);
+    }
+    else
+    {
+        PrintText(header, records);
+    }
+
+    return 0;
+}